@@ -7,7 +7,14 @@ extern "C" {
 
 #include <stdbool.h>
 #include <stdint.h>
+#include "fileXferDefines.h"
 #include "fileXferConf.h"
+#include "fileXferPlatform.h"
+#include "fileXferCallbacks.h"
+#include "fileXferDelta.h"
+#include "fileXferTree.h"
+#include "fileXferIndex.h"
+#include "fileXferRate.h"
 
 #define FXFER_PARSE_STATES_NUM         3
 
@@ -26,34 +33,433 @@ enum file_xfer_session_states {
     FXFER_SSTATE_WAIT_FILESEND_ACK,
     FXFER_SSTATE_WAIT_FILEREQ_ACK,
     FXFER_SSTATE_WAIT_FILE,
+    FXFER_SSTATE_WAIT_FILESIGS,
+    FXFER_SSTATE_WAIT_FILERESUME,
+    FXFER_SSTATE_WAIT_FILETREE,
     FXFER_SSTATE_ERR_RECEIVED
 };
 
+/* Priority classes of queued file sends, the higher one is served first */
+#define FXFER_PRIO_NUM                 3
+
+enum file_xfer_prio {
+    FXFER_PRIO_BULK = 0,
+    FXFER_PRIO_NORMAL,
+    FXFER_PRIO_URGENT
+};
+
 enum file_xfer_err_states {
     FXFER_NO_ERROR = 0,
     FXFER_ERR_NO_HANDSHAKE,
     FXFER_ERR_WRONG_CRC,
     FXFER_ERR_UNEXPECTED_PACKET,
     FXFER_ERR_BAD_REQUEST,
-    FXFER_ERR_NO_MEMORY
+    FXFER_ERR_NO_MEMORY,
+    FXFER_ERR_TIMEOUT,
+    FXFER_ERR_PLATFORM,
+    FXFER_ERR_WRONG_FILE_CRC
 };
 
-struct file_xfer_stat {
+struct fxfer_ctx;
+
+/* Called when request is completed, err is FXFER_NO_ERROR on success */
+typedef void (*fxfer_done_cb)(struct fxfer_ctx *ctx, uint32_t req_id,
+        enum file_xfer_err_states err, void *arg);
+
+/* Request awaiting the response, one per channel. It's sent again on timeout,
+ * retries is reset when the response moves the request to the next stage */
+struct file_xfer_request {
+    uint32_t id;
+    bool active_flag;
+    uint32_t start_tick;
+    uint8_t retries;
+    const char *file_name;
+    enum file_xfer_err_states result;
+    fxfer_done_cb done_cb;
+    void *done_arg;
+};
+
+/* Completion of blocking request, it's stored by its own done callback, so the result
+ * isn't lost when the channel is reused by the next request */
+struct file_xfer_wait {
+    bool done_flag;
+    enum file_xfer_err_states result;
+};
+
+/* File send waiting in transfer queue, request id is given at enqueue */
+struct file_xfer_job {
+    uint32_t id;
+    bool used_flag;
+    uint32_t seq;
+    const char *file_name;
+    enum file_xfer_prio prio;
+    uint8_t weight;
+    uint32_t enqueue_tick;
+    fxfer_done_cb done_cb;
+    void *done_arg;
+};
+
+/* Transfer queue metrics, wait time is ticks from enqueue to the start of file send */
+struct fxfer_queue_stat {
+    uint8_t depth;
+    uint8_t depth_max;
+    uint32_t started[FXFER_PRIO_NUM];
+    uint32_t wait_last[FXFER_PRIO_NUM];
+    uint32_t wait_max[FXFER_PRIO_NUM];
+};
+
+/* Link quality of the session. RTT is time from FILE_DATA segment send to its ACK
+ * in ticks, smoothed and its variation, resent segments aren't measured. Windows are
+ * payload sizes of adaptive window: tx is used for file data sent by this device,
+ * rx is given to the peer in handshake */
+struct fxfer_link_stat {
+    uint32_t srtt;
+    uint32_t rttvar;
+    uint32_t rtt_min;
+    uint32_t tx_segs;
+    uint32_t tx_crc_errors;
+    uint32_t rx_packs;
+    uint32_t rx_crc_errors;
+    uint32_t timeouts;
+    uint32_t fec_rebuilt;
+    uint32_t tx_winsize;
+    uint32_t rx_winsize;
+};
+
+/* Adaptive window state, counters of the current epoch */
+struct file_xfer_adapt {
+    bool enabled_flag;
+    uint32_t rtt_samples;
+    uint32_t rx_winsize_max;
+    uint32_t rx_winsize_sent;
+    uint32_t tx_segs;
+    uint32_t tx_errors;
+    uint32_t rx_packs;
+    uint32_t rx_errors;
+};
+
+/* Delta transfer state of sender, sigs is NULL if file is sent as is.
+ * Segments cover different amount of file data, so offsets of the ones
+ * in flight are kept to encode them again if they are resent */
+struct file_xfer_tx_delta {
+    const uint8_t *data;
+    struct fxfer_delta_sig *sigs;
+    uint32_t sigs_max;
+    uint32_t sig_num;
+    uint32_t block_size;
+    uint64_t next_off;
+    uint64_t seg_off[FXFER_MAX_SEGS_IN_FLIGHT + 1];
+};
+
+/* FEC parity of the group is formed in tx_buf. Receiver keeps parity groups
+ * that window of FXFER_MAX_SEGS_IN_FLIGHT segments may overlap, the negotiated
+ * group isn't less than FXFER_FEC_GROUP */
+#define FXFER_FEC_TX_PARITY_MAX        (FXFER_TX_BUF_SIZE - FXFER_PACK_PAYLOAD_IND - FXFER_PACK_CRC_FIELD_LEN)
+#define FXFER_FEC_GROUPS_NUM           ((FXFER_MAX_SEGS_IN_FLIGHT + FXFER_FEC_GROUP - 1) / FXFER_FEC_GROUP + 1)
+
+/* Sender side of sliding window, seq = seg_num - 1 - seg_ind. file_hash is crc32
+ * of the file data sent so far, it's counted if FILE_CRC is negotiated. read_fill
+ * bytes of the file from read_off are in read-ahead buffer. open_flag is set
+ * between file_open_cb() and file_close_cb() */
+struct file_xfer_tx_window {
+    const char *file_name;
+    uint64_t file_size;
+    uint64_t start_offset;
+    uint32_t seg_data_max;
+    uint32_t next_seq;
+    uint32_t seg_num;
+    uint32_t acked_num;
+    uint32_t sacked_mask;
+    uint8_t dup_ack_cnt;
+    bool retransmit_flag;
+    uint32_t resend_seq;
+    uint64_t data_bytes;
+    uint64_t payload_bytes;
+    uint32_t seg_tick[FXFER_MAX_SEGS_IN_FLIGHT];
+    uint32_t timed_mask;
+    uint32_t file_hash;
+    uint64_t read_off;
+    uint32_t read_fill;
+    bool open_flag;
+    struct file_xfer_tx_delta delta;
+    uint16_t fec_len;
+    uint8_t fec_parity[FXFER_FEC_TX_PARITY_MAX];
+};
+
+/* Receiver's FEC group: XOR of its segments received and parity is kept in
+ * rx_fec_acc of the channel, when only one segment is missing it's the XOR.
+ * group is group index + 1, 0 if the slot is free. Segments from fec_next_seq
+ * of rx window aren't sent yet, so the broken one there is sent for the first
+ * time and its parity is awaited */
+struct file_xfer_rx_fec {
+    uint32_t group;
+    uint32_t rx_mask;
+    bool parity_flag;
+    uint16_t len;
+};
+
+/* Receiver side of sliding window, out of order segments are stored
+ * in slots until the gap before them is filled. file_hash is crc32 of
+ * the committed data, it's counted if hash index is set or FILE_CRC is
+ * negotiated, file_crc is the one given by sender in the last segment.
+ * write_fill is the data in write-behind buffer, committed_size includes it.
+ * open_flag is set between file_open_cb() and file_close_cb(), rx_tick is the
+ * time of the last segment */
+struct file_xfer_rx_window {
+    uint32_t seg_num;
+    uint32_t committed_num;
+    uint64_t committed_size;
+    uint32_t stored_mask;
+    uint32_t slot_len[FXFER_MAX_SEGS_IN_FLIGHT];
+    uint8_t slot_buf[FXFER_MAX_SEGS_IN_FLIGHT];
+    uint32_t slot_off[FXFER_MAX_SEGS_IN_FLIGHT];
+    uint8_t slot_codec[FXFER_MAX_SEGS_IN_FLIGHT];
+    struct file_xfer_rx_fec fec[FXFER_FEC_GROUPS_NUM];
+    uint32_t fec_next_seq;
+    uint32_t fec_broken;
+    uint32_t file_hash;
+    uint32_t file_crc;
+    uint32_t write_fill;
+    uint64_t write_unsynced;
+    bool open_flag;
+    uint32_t rx_tick;
+};
+
+/* Application buffers used to receive packets, FILE_DATA segments are given
+ * to application without copy, refs counts segments held in each buffer */
+struct file_xfer_rx_pool {
+    uint8_t **bufs;
+    uint8_t buf_num;
+    uint32_t buf_size;
+    uint8_t cur_buf;
+    uint8_t refs[FXFER_RX_POOL_BUFS_MAX];
+};
+
+/* Write-behind buffer given by application, split to equal parts of receiving
+ * channels. Received data is collected in them and given to file_append_cb()
+ * by parts that end at FXFER_WRITE_ALIGN offsets */
+struct file_xfer_write_buf {
+    uint8_t *buf;
+    uint32_t part_size;
+    uint32_t sync_size;
+};
+
+/* Read-ahead buffer given by application, split to equal parts of sending channels.
+ * File data is read to them by big sequential reads, segments are taken from there */
+struct file_xfer_read_buf {
+    uint8_t *buf;
+    uint32_t part_size;
+};
+
+/* Hash tree request, the nodes of level from first_node are stored to nodes */
+struct file_xfer_tree_req {
+    struct fxfer_tree_nodes *nodes;
+    uint8_t level;
+    uint32_t first_node;
+};
+
+/* Logical channel: state of one request of this device, or of the peer's request
+ * that is served (e.g. file receiving). Channels are multiplexed over the link */
+struct file_xfer_channel {
+    uint8_t id;
     char file_name_temp[FXFER_FILE_NAME_LEN_MAX];
-    uint16_t tx_buf_fill_size;
-    uint16_t rx_buf_fill_size;
-    bool handshake_done_flag;
-    uint16_t respondent_winsize;
-    enum file_xfer_parse_states parse_state;
     enum file_xfer_session_states session_state;
     enum file_xfer_err_states last_error;
+    struct file_xfer_request request;
+    struct file_xfer_tree_req tree;
+    enum file_xfer_prio prio;
+    uint8_t weight;
+    uint32_t deficit;
+    struct file_xfer_tx_window tx_win;
+    struct file_xfer_rx_window rx_win;
+    uint8_t rx_slots[FXFER_MAX_SEGS_IN_FLIGHT][FXFER_RX_SEG_DATA_MAX];
+    uint8_t rx_fec_acc[FXFER_FEC_GROUPS_NUM][FXFER_RX_SEG_DATA_MAX];
 };
 
-bool make_handshake(uint16_t window_size);
-bool request_files_list();
-bool request_file_hash(const char* filename);
-bool send_file(const char* filename);
-void fxfer_parser();
+struct file_xfer_stat {
+    uint32_t tx_buf_fill_size;
+    uint32_t rx_buf_fill_size;
+    uint32_t rx_buf_pos;
+    uint32_t rx_need;
+    uint32_t rx_payload_len;
+    uint8_t rx_payload_ind;
+    bool handshake_done_flag;
+    uint32_t respondent_winsize;
+    uint16_t respondent_unpack_max;
+    uint8_t segs_in_flight;
+    uint8_t caps;
+    uint8_t chans_num;
+    uint8_t chan_side;
+    uint8_t fec_group;
+    uint8_t last_tx_chan;
+    uint8_t sched_next;
+    uint32_t queue_seq;
+    enum file_xfer_parse_states parse_state;
+    uint32_t body_tick;
+    uint32_t last_req_id;
+};
+
+/* Size of jumbo buffer for packets with payload of window size */
+#define FXFER_JUMBO_BUF_SIZE(window)   ((window) + FXFER_PACK_EXT_PAYLOAD_IND + FXFER_PACK_CRC_FIELD_LEN)
+
+/* Session context, owns buffers and state of one link with one peer.
+ * Contexts are independent, so any number of sessions may run in parallel.
+ * tx_data and rx_data are own buffers, or jumbo ones given by application,
+ * rx_pack_max is the longest packet that is received */
+struct fxfer_ctx {
+    uint8_t tx_buf[FXFER_TX_BUF_SIZE];
+    uint8_t rx_buf[FXFER_RX_RING_SIZE];
+    uint8_t rx_unpack_buf[FXFER_RX_SEG_DATA_MAX];
+    uint8_t *tx_data;
+    uint32_t tx_data_size;
+    uint8_t *rx_data;
+    uint32_t rx_data_size;
+    uint32_t rx_pack_max;
+    struct file_xfer_rx_pool rx_pool;
+    struct file_xfer_write_buf write_buf;
+    struct file_xfer_read_buf read_buf;
+    struct fxfer_hash_index hash_index;
+    struct fxfer_tree_cache tree_cache;
+    struct file_xfer_stat status;
+    struct file_xfer_channel chans[2 * FXFER_CHANNELS_NUM];
+    struct file_xfer_job queue[FXFER_QUEUE_LEN];
+    struct fxfer_queue_stat queue_stat;
+    struct fxfer_rate_limit rate_limit;
+    struct fxfer_rate_limit *link_limit;
+    struct fxfer_link_stat link_stat;
+    struct file_xfer_adapt adapt;
+    const struct fxfer_platform *platform;
+    const struct fxfer_callbacks *callbacks;
+    void *user_data;
+};
+
+void fxfer_init(struct fxfer_ctx *ctx, const struct fxfer_platform *platform,
+        const struct fxfer_callbacks *callbacks, void *user_data);
+
+/* Optional jumbo buffers that replace tx buffer and rx ring, e.g. allocated by application
+ * for the window it gives in handshake, FXFER_JUMBO_BUF_SIZE(window) bytes. NULL keeps
+ * the own buffer (tx one is enough if segments are sent without copy). Should be set
+ * before rx pool, the handshake and the parser start. Without rx pool (zero copy receive)
+ * jumbo window is received with one segment in flight */
+bool fxfer_set_jumbo_bufs(struct fxfer_ctx *ctx, uint8_t *tx_buf, uint32_t tx_size,
+        uint8_t *rx_buf, uint32_t rx_size);
+
+/* Optional rx pool of buf_num buffers of buf_size bytes (not less than FXFER_RX_BUF_SIZE,
+ * or jumbo rx buffer size), should be set before the parser is started. fxfer_rx_buf_release()
+ * should be called in the parser thread for every segment given by file_append_buf_cb() */
+bool fxfer_set_rx_pool(struct fxfer_ctx *ctx, uint8_t **bufs, uint8_t buf_num, uint32_t buf_size);
+void fxfer_rx_buf_release(struct fxfer_ctx *ctx, uint8_t buf_id);
+
+/* Optional write-behind buffer of size bytes for received files, should be set before the
+ * parser is started. Segments are ACKed as soon as they are copied to it, file_append_cb()
+ * gets FXFER_WRITE_ALIGN aligned parts of size / FXFER_CHANNELS_NUM bytes and the rest of
+ * the file at its end. file_sync_cb() is called every sync_size bytes written (0 - never
+ * during the file). fxfer_flush_writes() writes and syncs the buffered data of files being
+ * received, e.g. before shutdown, data of the interrupted file is written when the next
+ * request comes to its channel */
+bool fxfer_set_write_buf(struct fxfer_ctx *ctx, uint8_t *buf, uint32_t size, uint32_t sync_size);
+void fxfer_flush_writes(struct fxfer_ctx *ctx);
+
+/* Optional read-ahead buffer of size bytes for sent files, should be set before files are
+ * sent. file_read_partial_cb() reads size / FXFER_CHANNELS_NUM bytes at once and new segments
+ * are copied from there, file_prefetch_cb() is given the range that will be read next. It isn't
+ * used if segments are sent from file_map_partial_cb() data */
+bool fxfer_set_read_buf(struct fxfer_ctx *ctx, uint8_t *buf, uint32_t size);
+
+/* Optional hash index of entry_num entries given by application (see fileXferIndex.h):
+ * FILE_HASH_REQ of the file which size and stamp are the same is answered from it.
+ * Indexed hash is always crc32 of the whole file (seed 0, as crc32_compute_file() gives it)
+ * counted by the library, get_file_hash_cb() isn't used while the index is set. Received
+ * files are hashed while they are appended, so they are indexed with no extra read. The index is saved to buf
+ * (e.g. to be written to flash) and loaded from it at startup, save returns 0 if it
+ * doesn't fit. The file changed by application without get_file_stamp_cb() is dropped,
+ * from the tree cache too */
+void fxfer_set_hash_index(struct fxfer_ctx *ctx, struct fxfer_hash_entry *entries, uint16_t entry_num);
+uint32_t fxfer_hash_index_save(struct fxfer_ctx *ctx, uint8_t *buf, uint32_t buf_size);
+bool fxfer_hash_index_load(struct fxfer_ctx *ctx, const uint8_t *buf, uint32_t len);
+void fxfer_hash_index_drop(struct fxfer_ctx *ctx, const char* filename);
+
+/* Async requests return request id at once (0 if request can't be started),
+ * completion is signaled with done_cb and platform notify(). fxfer_poll() should
+ * be called periodically to handle timeouts and retransmissions. File name given to send_file_async()
+ * should be valid until the request is completed. Requests are run at the same time
+ * in different channels, up to the number of channels negotiated in handshake */
+uint32_t make_handshake_async(struct fxfer_ctx *ctx, uint32_t window_size,
+        fxfer_done_cb done_cb, void *done_arg);
+uint32_t request_files_list_async(struct fxfer_ctx *ctx, fxfer_done_cb done_cb, void *done_arg);
+uint32_t request_file_hash_async(struct fxfer_ctx *ctx, const char* filename,
+        fxfer_done_cb done_cb, void *done_arg);
+uint32_t send_file_async(struct fxfer_ctx *ctx, const char* filename,
+        fxfer_done_cb done_cb, void *done_arg);
+void fxfer_poll(struct fxfer_ctx *ctx);
+
+/* Delta transfer: only the data that receiver's file version doesn't have is sent.
+ * sigs is storage for signatures of receiver's file blocks, it should be valid until
+ * the request is completed. Needs file_map_partial_cb(), file is sent as is otherwise */
+uint32_t send_file_delta_async(struct fxfer_ctx *ctx, const char* filename,
+        struct fxfer_delta_sig *sigs, uint32_t sigs_max, fxfer_done_cb done_cb, void *done_arg);
+
+/* Hash tree of file (see fileXferTree.h) with FXFER_TREE_BLOCK_SIZE blocks: nodes of
+ * the level from first_node are requested from the peer, as many as fit nodes->hashes
+ * and the window. The blocks that differ from the local file are found by comparing
+ * them with fxfer_file_tree_hash() ones from the top level down, requesting children
+ * of the differing nodes only. nodes should be valid until the request is completed */
+uint32_t request_file_tree_async(struct fxfer_ctx *ctx, const char* filename, uint8_t level,
+        uint32_t first_node, struct fxfer_tree_nodes *nodes, fxfer_done_cb done_cb, void *done_arg);
+
+/* Nodes of the level of local file's hash tree, blocks are read by file_map_partial_cb()
+ * or file_read_partial_cb(). It takes no session lock and keeps no state, so application
+ * threads may hash different nodes (e.g. parts of level 0) at the same time on several
+ * cores if file callbacks are thread safe, upper levels are got by tree_parent_hash() */
+bool fxfer_file_tree_hash(struct fxfer_ctx *ctx, const char* filename, uint8_t level,
+        uint32_t first_node, uint32_t node_num, uint64_t *hashes);
+
+/* Optional cache of hash tree of one file for peer's tree requests, hashes_max nodes given
+ * by application (about 2 per block of the biggest file). All levels of the requested file
+ * are hashed by one pass and answered from there while its size and stamp are the same,
+ * files which tree doesn't fit are hashed per request */
+void fxfer_set_tree_cache(struct fxfer_ctx *ctx, uint64_t *hashes, uint32_t hashes_max);
+
+/* Transfer queue: file send is started when a channel is free, the highest priority
+ * class first and in order of enqueue inside the class. Jobs below FXFER_PRIO_URGENT
+ * leave one channel free for urgent ones. FILE_DATA segments of file sends of one
+ * class are interleaved by weight (1 to 255), higher class is sent first. Returns
+ * request id that is given to done_cb, 0 if the queue is full */
+uint32_t fxfer_queue_file(struct fxfer_ctx *ctx, const char* filename, enum file_xfer_prio prio,
+        uint8_t weight, fxfer_done_cb done_cb, void *done_arg);
+void fxfer_get_queue_stat(struct fxfer_ctx *ctx, struct fxfer_queue_stat *stat);
+
+/* Tx bandwidth limit of the session: rate is bytes per second (0 is unlimited), burst
+ * is bytes sent at once after idle time (0 is one FXFER_TX_BUF_SIZE packet). Link
+ * limiter is shared by sessions of one link (they should share the lock too), it's
+ * set by fxfer_rate_limit_set(), NULL removes it. FILE_DATA segments wait for tokens, control packets aren't delayed.
+ * Waiting segments are sent by fxfer_poll(), so it should be called every few ticks */
+void fxfer_set_rate_limit(struct fxfer_ctx *ctx, uint32_t rate, uint32_t burst);
+void fxfer_set_link_limit(struct fxfer_ctx *ctx, struct fxfer_rate_limit *link);
+
+/* Adaptive window: payload size of file data sent by this device and the window
+ * given to the peer are reduced if link has CRC errors and timeouts, and grown back
+ * while it's clean. The new rx window is given to the peer by handshake made in
+ * fxfer_poll(), the new tx window is used from the next file send */
+void fxfer_set_adaptive_window(struct fxfer_ctx *ctx, bool enable);
+void fxfer_get_link_stat(struct fxfer_ctx *ctx, struct fxfer_link_stat *stat);
+
+/* Sent bytes per second of the session, measured every second */
+uint32_t fxfer_get_throughput(struct fxfer_ctx *ctx);
+
+/* File data size to sent payload size ratio of the last file send, in percents */
+uint32_t fxfer_get_compress_ratio(struct fxfer_ctx *ctx);
+
+/* Blocking requests, fxfer_parser() should run in another thread */
+bool make_handshake(struct fxfer_ctx *ctx, uint32_t window_size);
+bool request_files_list(struct fxfer_ctx *ctx);
+bool request_file_hash(struct fxfer_ctx *ctx, const char* filename);
+bool send_file(struct fxfer_ctx *ctx, const char* filename);
+bool send_file_delta(struct fxfer_ctx *ctx, const char* filename,
+        struct fxfer_delta_sig *sigs, uint32_t sigs_max);
+bool request_file_tree(struct fxfer_ctx *ctx, const char* filename, uint8_t level,
+        uint32_t first_node, struct fxfer_tree_nodes *nodes);
+void fxfer_parser(struct fxfer_ctx *ctx);
 
 #ifdef __cplusplus
 }
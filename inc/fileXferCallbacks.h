@@ -8,17 +8,53 @@ extern "C" {
 #include <stdint.h>
 #include <stdbool.h>
 
-void files_list_gotten_cb(uint8_t files_num, uint8_t *files_names_arr);
-void form_files_list_cb(uint8_t *payload_ptr, uint16_t free_space, uint16_t *payload_len);
+/* Event callbacks of one session, user_data is the one given to fxfer_init().
+ * file_map_partial_cb() is optional, it gives pointer to file data (e.g. mmap'ed region
+ * or buffer owned by application) that stays valid until the file send is completed,
+ * it's also used to hash blocks of hash tree, the pointer isn't kept then.
+ * file_append_buf_cb() is optional, it's used instead of file_append_cb() if rx pool is set,
+ * data stays in the pool buffer buf_id until fxfer_rx_buf_release() is called for it.
+ * get_file_partial_cb() is optional, it gives size and hash of the part of file which
+ * receiving was interrupted, so the file send is resumed from this offset.
+ * get_file_stamp_cb() is optional, it gives mtime or generation counter of the file,
+ * hash index entry of the file is used while the stamp and size are the same.
+ * file_sync_cb() is optional, it's called at durability points of write-behind buffer
+ * (every sync_size bytes written and when receiving is interrupted), e.g. to fsync the file.
+ * file_prefetch_cb() is optional, it's called after read-ahead buffer is filled with the range
+ * that will be read next, e.g. to start its read by posix_fadvise() or io_uring.
+ * file_alloc_cb() is optional, it's called when file receiving is started from offset
+ * (the part kept for resume, 0 otherwise) with the announced file size (0 if it isn't
+ * announced, size of delta encoding for delta transfer), e.g. to preallocate the file.
+ * file_open_cb() and file_close_cb() are optional, they are called when file send (write_flag
+ * is false) or receiving is started and finished (completed, failed, interrupted by the next
+ * request of the channel, or no segment came for FXFER_RX_IDLE_TICKS, the file is opened
+ * again by the next one), e.g. to keep map of the file or to close it */
+struct fxfer_callbacks {
+    void (*files_list_gotten_cb)(void *user_data, uint8_t files_num, uint8_t *files_names_arr);
+    void (*form_files_list_cb)(void *user_data, uint8_t *payload_ptr, uint16_t free_space,
+            uint16_t *payload_len);
 
-void file_hash_gotten_cb(uint32_t *file_hash);
-bool get_file_hash_cb(const char *file_name, uint32_t *file_hash);
+    void (*file_hash_gotten_cb)(void *user_data, uint32_t *file_hash);
+    bool (*get_file_hash_cb)(void *user_data, const char *file_name, uint32_t *file_hash);
 
-bool get_file_size_cb(const char *file_name, uint32_t *file_size);
-bool file_read_partial_cb(const char *file_name, uint32_t offset,
-        uint32_t chunc_size, uint8_t *out_buf);
-bool file_append_cb(const char *file_name, uint32_t chunc_size,
-        uint8_t *in_buf, bool *eof_flag);
+    bool (*get_file_size_cb)(void *user_data, const char *file_name, uint64_t *file_size);
+    bool (*file_read_partial_cb)(void *user_data, const char *file_name, uint64_t offset,
+            uint32_t chunc_size, uint8_t *out_buf);
+    bool (*file_append_cb)(void *user_data, const char *file_name, uint64_t offset,
+            uint32_t chunc_size, uint8_t *in_buf, bool *eof_flag);
+    bool (*file_map_partial_cb)(void *user_data, const char *file_name, uint64_t offset,
+            uint32_t chunc_size, const uint8_t **data_ptr);
+    bool (*file_append_buf_cb)(void *user_data, const char *file_name, uint64_t offset,
+            uint8_t buf_id, uint32_t data_offset, uint32_t chunc_size, bool *eof_flag);
+    bool (*get_file_partial_cb)(void *user_data, const char *file_name, uint64_t *committed_size,
+            uint32_t *prefix_hash);
+    bool (*get_file_stamp_cb)(void *user_data, const char *file_name, uint64_t *stamp);
+    bool (*file_sync_cb)(void *user_data, const char *file_name);
+    void (*file_prefetch_cb)(void *user_data, const char *file_name, uint64_t offset, uint32_t len);
+    bool (*file_alloc_cb)(void *user_data, const char *file_name, uint64_t offset, uint64_t file_size);
+    bool (*file_open_cb)(void *user_data, const char *file_name, bool write_flag);
+    void (*file_close_cb)(void *user_data, const char *file_name, bool write_flag);
+};
 
 
 #ifdef __cplusplus
@@ -14,8 +14,123 @@
                                           FXFER_DEFAULT_WINDOW_SIZE + \
                                           FXFER_PACK_CRC_FIELD_LEN)
 
-/* Timeout for waiting the response */
+/* Buffer used to accumulate received data, several packets can be read
+ * from transport at once, should be not less than FXFER_RX_BUF_SIZE */
+#define FXFER_RX_RING_SIZE                (4 * FXFER_RX_BUF_SIZE)
+
+/* Maximum number of application buffers given to fxfer_set_rx_pool() */
+#define FXFER_RX_POOL_BUFS_MAX            8
+
+/* Alignment of write-behind buffer flushes (see fxfer_set_write_buf()), e.g. flash page
+ * or eMMC erase block size. Buffer part of every channel is a multiple of it */
+#define FXFER_WRITE_ALIGN                 512
+
+/* Size of storage for one FILE_DATA segment received out of order */
+#define FXFER_RX_SEG_DATA_MAX             (FXFER_RX_BUF_SIZE - FXFER_PACK_PAYLOAD_IND - \
+                                          FXFER_PACK_CRC_FIELD_LEN - sizeof(uint16_t))
+
+/* Maximum number of FILE_DATA segments sent without waiting for ACK,
+ * the actual value is negotiated in handshake (1 to 32) */
+#define FXFER_MAX_SEGS_IN_FLIGHT          4
+
+/* Offer 64-bit file sizes and 32-bit segment indexes in handshake,
+ * otherwise file size is limited by 4 GB and 65535 segments */
+#define FXFER_WIDE_OFFSETS                1
+
+/* Offer LZ compression of FILE_DATA segments in handshake */
+#define FXFER_COMPRESSION                 1
+
+/* LZ compressor hash table is (2 << FXFER_LZ_HASH_BITS) bytes on stack,
+ * bigger one finds more matches in big segments */
+#define FXFER_LZ_HASH_BITS                10
+
+/* Offer delta transfer in handshake */
+#define FXFER_DELTA                       1
+
+/* The least size of block of receiver's file version, which is looked for
+ * by sender. Block size is increased for big files to fit sender's storage */
+#define FXFER_DELTA_BLOCK_MIN             256
+
+/* Offer resume of interrupted file transfers in handshake */
+#define FXFER_RESUME                      1
+
+/* Offer forward error correction of FILE_DATA in handshake: XOR parity of every
+ * FXFER_FEC_GROUP segments (1 to 32) is sent after them, so receiver rebuilds one
+ * lost segment of the group without retransmission. The bigger group of two devices
+ * is used. Parity costs 1 / FXFER_FEC_GROUP of bandwidth, it pays on lossy links
+ * where resend round trip is long */
+#define FXFER_FEC                         0
+#define FXFER_FEC_GROUP                   4
+
+/* Offer jumbo frames in handshake: packets with 32-bit LEN are sent to the peer
+ * which window doesn't fit 16-bit one. Big buffers are given by fxfer_set_jumbo_bufs() */
+#define FXFER_JUMBO                       1
+
+/* Offer hash tree of files in handshake: the peer gives xxHash64 of its file blocks
+ * and of their groups, so the blocks that differ are found going down the tree */
+#define FXFER_HASH_TREE                   1
+
+/* Offer file crc in handshake: the last FILE_DATA segment carries crc32 of the whole
+ * file counted while it's sent, receiver checks it before the last append */
+#define FXFER_FILE_CRC                    1
+
+/* Size of hash tree leaf blocks requested from the peer, and of stack buffer they
+ * are read by if file_map_partial_cb() isn't given */
+#define FXFER_TREE_BLOCK_SIZE             4096
+#define FXFER_TREE_READ_SIZE              512
+
+/* Number of logical channels that each device may open for its requests (1 to 4),
+ * the actual value is negotiated in handshake. Requests of different channels
+ * (e.g. file sends and hash requests) run at the same time over one link */
+#define FXFER_CHANNELS_NUM                2
+
+/* Number of file sends waiting in transfer queue for a free channel */
+#define FXFER_QUEUE_LEN                   8
+
+/* Adaptive window: the least payload size it's reduced to, and the number
+ * of packets after which link error rate is checked */
+#define FXFER_ADAPT_WINDOW_MIN            32
+#define FXFER_ADAPT_EPOCH_PACKS           64
+
+/* Platform get_tick() ticks per second, used by tx rate limiter */
+#define FXFER_TICKS_PER_SEC               1000
+
+/* Timeout for waiting the response, it's used until RTT is measured by FILE_DATA
+ * segments. Then the timeout is smoothed RTT + 4 * RTT variation within the limits */
 #define FXFER_RESPONSE_TIMEOUT_TICKS      1000
+#define FXFER_RTO_MIN_TICKS               50
+#define FXFER_RTO_MAX_TICKS               8000
+
+/* Number of times request or FILE_DATA segment is sent again on timeout or NACK
+ * with WRONG_CRC before the request fails, timeout is doubled every time */
+#define FXFER_RETRIES_MAX                 5
+
+/* File being received is closed by file_close_cb() if no segment came for this time,
+ * sender has given up by then */
+#define FXFER_RX_IDLE_TICKS               60000
+
+/* CRC32 software engine: 1 - byte table (1 KB), 8 - slice-by-8 (8 KB),
+ * 16 - slice-by-16 (16 KB) */
+#define FXFER_CRC32_SLICE_BY              8
+
+/* Use PCLMULQDQ (x86) or CRC32 instructions (ARMv8) if CPU supports them */
+#define FXFER_CRC32_HW_ACCEL              1
+
+/* Built-in POSIX file backend (fileXferPosix.h), off by default: sent files are read
+ * from cached mmaps, received ones are preallocated by the announced size, written
+ * by offset and renamed from temporary file when completed. Maps of files being sent
+ * aren't replaced, so number of cached maps should be more than FXFER_CHANNELS_NUM */
+#define FXFER_POSIX_FS                    0
+#define FXFER_POSIX_MAPS_NUM              8
+#define FXFER_POSIX_PATH_MAX              256
+
+/* Linux epoll reactor (fileXferEpoll.h), off by default: one thread runs parsers of up to
+ * FXFER_EPOLL_LINKS_MAX sessions over non-blocking fds and their fxfer_poll() every
+ * FXFER_EPOLL_POLL_MS by timerfd. Packets formed while a link is handled are batched
+ * in its output buffer and written by one writev() */
+#define FXFER_EPOLL_REACTOR               0
+#define FXFER_EPOLL_LINKS_MAX             16
+#define FXFER_EPOLL_POLL_MS               10
 
 /* File name defines */
 #define FXFER_FILE_NAME_LEN_MAX           16
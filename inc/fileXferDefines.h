@@ -3,21 +3,96 @@
 
 #define FXFER_PACK_PREAMBLE                 0xDEADBEEF
 
+/* MSG_ID field: message id in the low bits, logical channel in the high bits */
+#define FXFER_PACK_ID_MASK                  0x1F
+#define FXFER_PACK_CHAN_SHIFT               5
+
+/* Channel id: the side of device that opened the channel, and its index */
+#define FXFER_CHAN_SIDE_SHIFT               2
+#define FXFER_CHAN_IND_MASK                 0x03
+#define FXFER_CHANS_PER_SIDE_MAX            4
+
 /* Packet fields indexes */
 #define FXFER_PACK_MSGID_IND                4
 #define FXFER_PACK_LEN_IND                  5
 #define FXFER_PACK_PAYLOAD_IND              7
+#define FXFER_PACK_EXT_LEN_IND              7
+#define FXFER_PACK_EXT_PAYLOAD_IND          11
 
 /* Packet field lengths */
 #define FXFER_PACK_PREAM_FIELD_LEN          4
 #define FXFER_PACK_MSGID_FIELD_LEN          1
 #define FXFER_PACK_LEN_FIELD_LEN            2
 #define FXFER_PACK_CRC_FIELD_LEN            4
+#define FXFER_PACK_EXT_LEN_FIELD_LEN        4
+
+/* LEN value of extended header, 32-bit EXT_LEN follows it (jumbo frames) */
+#define FXFER_PACK_LEN_EXT                  0xFFFF
+#define FXFER_PACK_LEN_MAX                  0xFFFE
+
+/* HANDSHAKE_REQ/HANDSHAKE_RES payload */
+#define FXFER_HANDSHAKE_LEN_LEGACY          2
+#define FXFER_HANDSHAKE_SEGS_LEN            3
+#define FXFER_HANDSHAKE_CAPS_LEN            4
+#define FXFER_HANDSHAKE_CHANS_LEN           5
+#define FXFER_HANDSHAKE_FEC_LEN             6
+#define FXFER_HANDSHAKE_JUMBO_LEN           10
+#define FXFER_HANDSHAKE_LEN                 12
+
+/* Protocol extensions flags, CAPS field of handshake */
+#define FXFER_CAP_WIDE_OFFSETS              0x01
+#define FXFER_CAP_COMPRESS_LZ               0x02
+#define FXFER_CAP_DELTA                     0x04
+#define FXFER_CAP_RESUME                    0x08
+#define FXFER_CAP_FEC                       0x10
+#define FXFER_CAP_JUMBO                     0x20
+#define FXFER_CAP_HASH_TREE                 0x40
+#define FXFER_CAP_FILE_CRC                  0x80
+
+/* CODEC field of FILE_DATA, if compression is negotiated */
+#define FXFER_CODEC_RAW                     0
+#define FXFER_CODEC_LZ                      1
+#define FXFER_CODEC_DELTA                   2
+
+/* FILE_SIGS_REQ payload following the file name: FIRST_BLOCK + BLOCKS_MAX */
+#define FXFER_SIGS_REQ_INFO_LEN             8
+
+/* FILE_SIGS_RES payload: BASIS_SIZE + BLOCK_SIZE + FIRST_BLOCK + BLOCKS_TOTAL + SIGS */
+#define FXFER_SIGS_RES_HDR_LEN              20
+#define FXFER_SIG_LEN                       8
+
+/* FILE_TREE_REQ payload following the file name: BLOCK_SIZE + LEVEL + FIRST_NODE + NODES_MAX */
+#define FXFER_TREE_REQ_INFO_LEN             13
+
+/* FILE_TREE_RES payload: FILE_SIZE + LEVEL + FIRST_NODE + NODES_TOTAL + HASHES */
+#define FXFER_TREE_RES_HDR_LEN              17
+#define FXFER_TREE_HASH_LEN                 8
+
+/* FILE_SEND_REQ payload following the file name */
+#define FXFER_FILE_INFO_LEN                 6
+#define FXFER_FILE_INFO_WIDE_LEN            12
+/* START_OFFSET that follows FILE_SEND_REQ file info if RESUME is negotiated */
+#define FXFER_FILE_INFO_START_LEN           8
+
+/* FILE_RESUME_RES payload: COMMITTED_SIZE + PREFIX_HASH */
+#define FXFER_RESUME_RES_LEN                12
+
+/* ACK payload of FILE_DATA segment: SEG_IND + CUM_SEG_IND */
+#define FXFER_DATA_ACK_LEN                  4
+#define FXFER_DATA_ACK_WIDE_LEN             8
+
+/* FILE_CRC that follows CODEC of the last FILE_DATA segment if FILE_CRC is negotiated */
+#define FXFER_FILE_CRC_LEN                  4
+
+/* FILE_PARITY payload: GROUP_SEG_IND + XOR of { LEN (uint16_t), FILE_DATA payload
+ * following the segment index } of the group segments */
+#define FXFER_FEC_LEN_FIELD_LEN             2
+#define FXFER_FEC_GROUP_MAX                 32
 
 /* Packets IDs */
-#define FXFER_PACKS_NUM                     12
+#define FXFER_PACKS_NUM                     19
 #define FXFER_PACK_ID_MIN                   1
-#define FXFER_PACK_ID_MAX                   11
+#define FXFER_PACK_ID_MAX                   18
 #define FXFER_PACK_HANDSHAKE_REQ            1
 #define FXFER_PACK_HANDSHAKE_RES            2
 #define FXFER_PACK_FILES_LIST_REQ           3
@@ -29,6 +104,13 @@
 #define FXFER_PACK_FILE_DATA                9
 #define FXFER_PACK_ACK                      10
 #define FXFER_PACK_NACK                     11
+#define FXFER_PACK_FILE_SIGS_REQ            12
+#define FXFER_PACK_FILE_SIGS_RES            13
+#define FXFER_PACK_FILE_RESUME_REQ          14
+#define FXFER_PACK_FILE_RESUME_RES          15
+#define FXFER_PACK_FILE_PARITY              16
+#define FXFER_PACK_FILE_TREE_REQ            17
+#define FXFER_PACK_FILE_TREE_RES            18
 
 /* NACK error codes */
 #define FXFER_NACK_ERR_NO_HANDSHAKE         1
@@ -36,5 +118,7 @@
 #define FXFER_NACK_ERR_UNEXPECTED_PACKET    3
 #define FXFER_NACK_ERR_BAD_REQUEST          4
 #define FXFER_NACK_ERR_NO_MEMORY            5
+/* 6 and 7 are local errors of the requester (timeout and platform) */
+#define FXFER_NACK_ERR_WRONG_FILE_CRC       8
 
 #endif /* FILE_XFER_DEFINES_H */
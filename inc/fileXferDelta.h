@@ -0,0 +1,35 @@
+#ifndef FILE_XFER_DELTA_H
+#define FILE_XFER_DELTA_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Signature of one block of receiver's file version */
+struct fxfer_delta_sig {
+    uint32_t weak;
+    uint32_t strong;
+    uint32_t block;
+};
+
+/* Delta operations of FILE_DATA segment */
+#define FXFER_DELTA_OP_LITERAL          0
+#define FXFER_DELTA_OP_COPY             1
+#define FXFER_DELTA_LITERAL_HDR_LEN     3
+#define FXFER_DELTA_COPY_LEN            13
+
+uint32_t delta_weak_update(uint32_t weak, const uint8_t *data, uint32_t len);
+uint32_t delta_weak_roll(uint32_t weak, uint8_t out_byte, uint8_t in_byte, uint32_t block_size);
+void delta_sort_sigs(struct fxfer_delta_sig *sigs, uint32_t sig_num);
+uint32_t delta_encode_seg(const uint8_t *data, uint64_t data_len, uint64_t *raw_off,
+        const struct fxfer_delta_sig *sigs, uint32_t sig_num, uint32_t block_size,
+        uint8_t *out, uint32_t out_size);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* FILE_XFER_DELTA_H */
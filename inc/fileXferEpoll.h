@@ -0,0 +1,69 @@
+#ifndef FILE_XFER_EPOLL_H
+#define FILE_XFER_EPOLL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "fileXferConf.h"
+#include "fileXferPlatform.h"
+#include "fileXfer.h"
+#if FXFER_POSIX_FS
+#include "fileXferPosix.h"
+#endif
+
+/* One link of the reactor: session context and non-blocking fd (socket, pipe or serial
+ * TTY configured by application). Platform functions take user_data given to fxfer_init()
+ * as pointer to this struct. If POSIX file backend is enabled the link begins with it,
+ * so the same user_data is given to its callbacks. Packets sent while the link is handled
+ * by the reactor are batched in output buffer given by application, the rest that fd
+ * doesn't take is written when it's writable, out_drops counts packets that didn't fit
+ * it. closed_flag is set when peer closes fd or on error, link is removed then */
+struct fxfer_epoll_link {
+#if FXFER_POSIX_FS
+    struct fxfer_posix_fs fs;
+#endif
+    struct fxfer_ctx *ctx;
+    struct fxfer_epoll *reactor;
+    int fd;
+    pthread_mutex_t mtx;
+    uint8_t *out_buf;
+    uint32_t out_size;
+    uint32_t out_pos;
+    uint32_t out_fill;
+    uint32_t out_drops;
+    bool batch_flag;
+    bool out_wait_flag;
+    bool rx_flag;
+    bool closed_flag;
+};
+
+/* Reactor of one thread: epoll of links fds, timerfd that runs fxfer_poll() of all the
+ * links every FXFER_EPOLL_POLL_MS and eventfd that wakes it up to stop */
+struct fxfer_epoll {
+    int epoll_fd;
+    int timer_fd;
+    int event_fd;
+    struct fxfer_epoll_link *links[FXFER_EPOLL_LINKS_MAX];
+    uint16_t link_num;
+    volatile bool stop_flag;
+};
+
+bool fxfer_epoll_init(struct fxfer_epoll *reactor);
+void fxfer_epoll_close(struct fxfer_epoll *reactor);
+void fxfer_epoll_platform(struct fxfer_platform *platform);
+bool fxfer_epoll_link_init(struct fxfer_epoll_link *link, int fd, uint8_t *out_buf, uint32_t out_size);
+bool fxfer_epoll_add(struct fxfer_epoll *reactor, struct fxfer_epoll_link *link, struct fxfer_ctx *ctx);
+void fxfer_epoll_remove(struct fxfer_epoll *reactor, struct fxfer_epoll_link *link);
+int fxfer_epoll_run_once(struct fxfer_epoll *reactor, int timeout_ms);
+void fxfer_epoll_run(struct fxfer_epoll *reactor);
+void fxfer_epoll_stop(struct fxfer_epoll *reactor);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* FILE_XFER_EPOLL_H */
@@ -0,0 +1,42 @@
+#ifndef FILE_XFER_INDEX_H
+#define FILE_XFER_INDEX_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "fileXferConf.h"
+
+/* Hash of the whole file (crc32, as crc32_compute_file() gives it) keyed by name,
+ * size and stamp (mtime or generation counter of the file), use_seq is 0 if entry is free */
+struct fxfer_hash_entry {
+    char name[FXFER_FILE_NAME_LEN_MAX + 1];
+    uint64_t size;
+    uint64_t stamp;
+    uint32_t hash;
+    uint32_t use_seq;
+};
+
+/* Hash index of entries given by application, the least recently used entry is replaced */
+struct fxfer_hash_index {
+    struct fxfer_hash_entry *entries;
+    uint16_t entry_num;
+    uint32_t use_seq;
+};
+
+void hash_index_init(struct fxfer_hash_index *index, struct fxfer_hash_entry *entries, uint16_t entry_num);
+bool hash_index_find(struct fxfer_hash_index *index, const char *name, uint64_t size, uint64_t stamp,
+        uint32_t *hash);
+void hash_index_store(struct fxfer_hash_index *index, const char *name, uint64_t size, uint64_t stamp,
+        uint32_t hash);
+void hash_index_drop(struct fxfer_hash_index *index, const char *name);
+uint32_t hash_index_save(const struct fxfer_hash_index *index, uint8_t *buf, uint32_t buf_size);
+bool hash_index_load(struct fxfer_hash_index *index, const uint8_t *buf, uint32_t len);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* FILE_XFER_INDEX_H */
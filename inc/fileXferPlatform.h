@@ -5,10 +5,35 @@
 extern "C" {
 #endif /* __cplusplus */
 
-void platform_send(uint8_t* data, uint16_t len);
-uint16_t platform_read(uint8_t* data, uint16_t len);
-void platform_sleep(uint32_t ms);
-uint32_t platform_get_tick();
+#include <stdint.h>
+
+/* One piece of the packet given to sendv() */
+struct fxfer_iovec {
+    const uint8_t *data;
+    uint32_t len;
+};
+
+/* Platform specific functions of one link, user_data is the one given to fxfer_init().
+ * read() returns exactly len bytes, less is a link error which fails the requests in
+ * progress with FXFER_ERR_PLATFORM. read_some() is optional, it returns up to len bytes
+ * available at the moment (0 if there are no data), if it's set read() isn't used.
+ * notify() is optional, it's called when request is completed (e.g. to write eventfd).
+ * sendv() is optional, it sends the packet given by pieces as a whole (e.g. by writev()).
+ * lock() and unlock() are optional (e.g. recursive mutex), they're needed if requests are
+ * started in other thread than the parser, as packets of all the channels are formed
+ * in one tx buffer. Callbacks are called with the lock taken */
+struct fxfer_platform {
+    void (*send)(void *user_data, uint8_t* data, uint32_t len);
+    void (*sendv)(void *user_data, const struct fxfer_iovec *iov, uint8_t iov_cnt);
+    uint32_t (*read)(void *user_data, uint8_t* data, uint32_t len);
+    uint32_t (*read_some)(void *user_data, uint8_t* data, uint32_t len);
+    void (*sleep)(void *user_data, uint32_t ms);
+    uint32_t (*get_tick)(void *user_data);
+    void (*notify)(void *user_data);
+    void (*lock)(void *user_data);
+    void (*unlock)(void *user_data);
+};
+
 void log_info(const char* str, ...);
 void log_debug(const char* str, ...);
 void log_error(const char* str, ...);
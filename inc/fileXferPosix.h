@@ -0,0 +1,55 @@
+#ifndef FILE_XFER_POSIX_H
+#define FILE_XFER_POSIX_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "fileXferConf.h"
+#include "fileXferCallbacks.h"
+
+/* Cached read-only mmap of the file being sent, it's checked by size and mtime (stamp)
+ * when the file size is asked, use_seq is 0 if entry is free. pins counts the sends
+ * that use the map, pinned map isn't replaced or unmapped: the one of changed file
+ * is stale, it isn't given any more and it's unmapped when its last send is done */
+struct fxfer_posix_map {
+    char name[FXFER_FILE_NAME_LEN_MAX + 1];
+    const uint8_t *data;
+    uint64_t size;
+    uint64_t stamp;
+    uint32_t use_seq;
+    uint16_t pins;
+    bool stale_flag;
+};
+
+/* Temporary file being received: written by offset and renamed to the file name
+ * when the last part is written, fd is -1 if entry is free. users counts receivings
+ * of the file in progress, the file is closed when the last of them is finished */
+struct fxfer_posix_out {
+    char name[FXFER_FILE_NAME_LEN_MAX + 1];
+    int fd;
+    uint16_t users;
+    uint32_t use_seq;
+};
+
+/* Built-in POSIX file backend of one directory. Its callbacks take user_data given
+ * to fxfer_init() as pointer to this struct, so application which needs its own
+ * user_data puts this struct at the beginning of it */
+struct fxfer_posix_fs {
+    char dir[FXFER_POSIX_PATH_MAX];
+    struct fxfer_posix_map maps[FXFER_POSIX_MAPS_NUM];
+    uint32_t use_seq;
+    struct fxfer_posix_out outs[FXFER_CHANNELS_NUM];
+};
+
+bool fxfer_posix_fs_init(struct fxfer_posix_fs *fs, const char *dir);
+void fxfer_posix_fs_close(struct fxfer_posix_fs *fs);
+void fxfer_posix_fs_callbacks(struct fxfer_callbacks *callbacks);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* FILE_XFER_POSIX_H */
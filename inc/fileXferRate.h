@@ -0,0 +1,35 @@
+#ifndef FILE_XFER_RATE_H
+#define FILE_XFER_RATE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Token bucket of tx bandwidth limiter, rate is bytes per second (0 is unlimited),
+ * burst is the bucket size in bytes. Throughput is measured sent bytes per second */
+struct fxfer_rate_limit {
+    uint32_t rate;
+    uint32_t burst;
+    int32_t tokens;
+    uint32_t credit_rem;
+    uint32_t last_tick;
+    bool sync_flag;
+    bool meas_flag;
+    uint32_t meas_tick;
+    uint32_t meas_bytes;
+    uint32_t throughput;
+};
+
+void fxfer_rate_limit_set(struct fxfer_rate_limit *lim, uint32_t rate, uint32_t burst);
+bool rate_limit_allow(struct fxfer_rate_limit *lim, uint32_t tick);
+void rate_limit_consume(struct fxfer_rate_limit *lim, uint32_t len, uint32_t tick);
+uint32_t rate_limit_throughput(struct fxfer_rate_limit *lim, uint32_t tick);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* FILE_XFER_RATE_H */
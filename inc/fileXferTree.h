@@ -0,0 +1,67 @@
+#ifndef FILE_XFER_TREE_H
+#define FILE_XFER_TREE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "fileXferConf.h"
+
+/* Hash tree of file: nodes of level 0 are xxHash64 of file blocks of the same size
+ * (the last one may be shorter, empty file has one empty block), node i of the next
+ * level is xxHash64 of nodes 2i and 2i + 1 (little endian), or node 2i if it's the
+ * last odd one. The top level has one node, it's the hash of the whole file */
+#define FXFER_TREE_LEVEL_MAX            32
+
+/* Nodes of one level received from the peer, hashes is storage given by application */
+struct fxfer_tree_nodes {
+    uint64_t file_size;
+    uint32_t nodes_total;
+    uint32_t node_num;
+    uint64_t *hashes;
+    uint32_t hashes_max;
+};
+
+/* Hash tree of one file cached in hashes given by application: all levels one after
+ * another from level 0, keyed by name, size, stamp and block size. node_total is the
+ * number of stored nodes, 0 if the cache is empty */
+struct fxfer_tree_cache {
+    char name[FXFER_FILE_NAME_LEN_MAX + 1];
+    uint64_t file_size;
+    uint64_t stamp;
+    uint32_t block_size;
+    uint64_t *hashes;
+    uint32_t hashes_max;
+    uint32_t node_total;
+};
+
+/* Streaming xxHash64 state */
+struct fxfer_xxh64 {
+    uint64_t v[4];
+    uint64_t total_len;
+    uint8_t mem[32];
+    uint32_t mem_len;
+};
+
+void xxh64_init(struct fxfer_xxh64 *state, uint64_t seed);
+void xxh64_update(struct fxfer_xxh64 *state, const uint8_t *data, uint32_t len);
+uint64_t xxh64_digest(const struct fxfer_xxh64 *state);
+uint64_t xxh64_compute_buf(const uint8_t *data, uint32_t len, uint64_t seed);
+uint64_t tree_level_nodes(uint64_t file_size, uint32_t block_size, uint8_t level);
+uint8_t tree_top_level(uint64_t file_size, uint32_t block_size);
+uint64_t tree_parent_hash(uint64_t left, uint64_t right);
+uint64_t tree_level_first(uint64_t file_size, uint32_t block_size, uint8_t level);
+void tree_cache_init(struct fxfer_tree_cache *cache, uint64_t *hashes, uint32_t hashes_max);
+bool tree_cache_find(const struct fxfer_tree_cache *cache, const char *name, uint64_t file_size,
+        uint64_t stamp, uint32_t block_size);
+bool tree_cache_store(struct fxfer_tree_cache *cache, const char *name, uint64_t file_size,
+        uint64_t stamp, uint32_t block_size);
+void tree_cache_drop(struct fxfer_tree_cache *cache, const char *name);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* FILE_XFER_TREE_H */
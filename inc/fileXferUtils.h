@@ -11,9 +11,14 @@ extern "C" {
 #define CRC_BUFFER_SIZE  8192
 
 uint32_t crc32_compute_buf(uint32_t in_crc32, const void *buf, size_t len);
+uint32_t crc32_combine(uint32_t crc32_first, uint32_t crc32_second, uint64_t len_second);
 int crc32_compute_file(FILE *file, uint32_t *out_crc32);
+uint32_t lz_compress_buf(const uint8_t *src, uint32_t src_len, uint8_t *dst, uint32_t dst_size);
+uint32_t lz_decompress_buf(const uint8_t *src, uint32_t src_len, uint8_t *dst, uint32_t dst_size);
+void write_uint64_le(uint64_t num, uint8_t *ptr);
 void write_uint32_le(uint32_t num, uint8_t *ptr);
 void write_uint16_le(uint16_t num, uint8_t *ptr);
+uint64_t get_uint64_by_ptr(void *ptr);
 uint32_t get_uint32_by_ptr(void *ptr);
 uint16_t get_uint16_by_ptr(void *ptr);
 void hexdump(void *mem, unsigned int len, int (*print_fp)(const char *fmt, ...));
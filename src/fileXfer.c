@@ -1,62 +1,261 @@
 #include <string.h>
+#include <inttypes.h>
 #include "fileXfer.h"
 #include "fileXferUtils.h"
 #include "fileXferDefines.h"
 #include "fileXferPlatform.h"
 #include "fileXferCallbacks.h"
 
-/* Tx/Rx buffers */
-static uint8_t tx_buf[FXFER_TX_BUF_SIZE];
-static uint8_t rx_buf[FXFER_RX_BUF_SIZE];
-
-/* State structure */
-static struct file_xfer_stat fxfer_status = {
-    .handshake_done_flag = false,
-    .parse_state = FXFER_PSTATE_WAIT_PREAMBLE,
-    .session_state = FXFER_SSTATE_IDLE,
-    .last_error = FXFER_NO_ERROR
-};
+#if FXFER_RX_RING_SIZE < FXFER_RX_BUF_SIZE
+#error "FXFER_RX_RING_SIZE should be not less than FXFER_RX_BUF_SIZE"
+#endif
+#if FXFER_CHANNELS_NUM < 1 || FXFER_CHANNELS_NUM > FXFER_CHANS_PER_SIDE_MAX
+#error "FXFER_CHANNELS_NUM should be 1 to 4"
+#endif
+#if FXFER_FEC_GROUP < 1 || FXFER_FEC_GROUP > FXFER_FEC_GROUP_MAX
+#error "FXFER_FEC_GROUP should be 1 to 32"
+#endif
+
+/* buf_id of segment that isn't held in rx pool */
+#define FXFER_RX_POOL_NO_BUF            0xFF
+
+/* Number of ACKs after the gap in window that triggers its resend */
+#define FXFER_DUP_ACK_MAX               3
+
+/* Piece of mapped file that indexed file crc is counted by */
+#define FXFER_INDEX_MAP_PIECE           65536
+
+/* Protocol extensions offered in handshake */
+#if FXFER_WIDE_OFFSETS
+#define FXFER_CAPS_WIDE                 FXFER_CAP_WIDE_OFFSETS
+#else
+#define FXFER_CAPS_WIDE                 0
+#endif
+#if FXFER_COMPRESSION
+#define FXFER_CAPS_COMPRESS             FXFER_CAP_COMPRESS_LZ
+#else
+#define FXFER_CAPS_COMPRESS             0
+#endif
+#if FXFER_DELTA
+#define FXFER_CAPS_DELTA                FXFER_CAP_DELTA
+#else
+#define FXFER_CAPS_DELTA                0
+#endif
+#if FXFER_RESUME
+#define FXFER_CAPS_RESUME               FXFER_CAP_RESUME
+#else
+#define FXFER_CAPS_RESUME               0
+#endif
+#if FXFER_FEC
+#define FXFER_CAPS_FEC                  FXFER_CAP_FEC
+#else
+#define FXFER_CAPS_FEC                  0
+#endif
+#if FXFER_JUMBO
+#define FXFER_CAPS_JUMBO                FXFER_CAP_JUMBO
+#else
+#define FXFER_CAPS_JUMBO                0
+#endif
+#if FXFER_HASH_TREE
+#define FXFER_CAPS_TREE                 FXFER_CAP_HASH_TREE
+#else
+#define FXFER_CAPS_TREE                 0
+#endif
+#if FXFER_FILE_CRC
+#define FXFER_CAPS_FILE_CRC             FXFER_CAP_FILE_CRC
+#else
+#define FXFER_CAPS_FILE_CRC             0
+#endif
+#define FXFER_LOCAL_CAPS                (FXFER_CAPS_WIDE | FXFER_CAPS_COMPRESS | FXFER_CAPS_DELTA \
+                                        | FXFER_CAPS_RESUME | FXFER_CAPS_FEC | FXFER_CAPS_JUMBO \
+                                        | FXFER_CAPS_TREE | FXFER_CAPS_FILE_CRC)
+/* FEC group offered in handshake, 0 if FEC isn't offered */
+#define FXFER_LOCAL_FEC_GROUP           (FXFER_CAPS_FEC != 0 ? FXFER_FEC_GROUP : 0)
 
 /* Utility functions for forming message */
-static void fill_preamble();
-static void fill_msg_id(uint8_t msg_id);
-static void fill_len(uint16_t msg_len);
-static void fill_payload(uint8_t *data, uint16_t len);
-static void fill_msg_crc();
-static void send_msg();
+static void fill_preamble(struct fxfer_ctx *ctx);
+static void fill_msg_id(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, uint8_t msg_id);
+static void fill_len(struct fxfer_ctx *ctx, uint32_t msg_len);
+static void fill_payload(struct fxfer_ctx *ctx, uint8_t *data, uint32_t len);
+static void fill_msg_crc(struct fxfer_ctx *ctx);
+static void send_msg(struct fxfer_ctx *ctx);
+static uint8_t get_tx_payload_ind(struct fxfer_ctx *ctx);
+static uint32_t get_tx_payload_max(struct fxfer_ctx *ctx);
+static uint32_t get_seg_payload_max(struct fxfer_ctx *ctx, bool zero_copy);
+static uint32_t get_rx_window(struct fxfer_ctx *ctx);
+static uint32_t get_msg_len_max(uint8_t msg_id);
+static bool is_tx_zero_copy(struct fxfer_ctx *ctx);
+static uint8_t get_seg_ind_len(struct fxfer_ctx *ctx);
+static uint8_t get_data_hdr_len(struct fxfer_ctx *ctx);
+static uint8_t get_seg_crc_len(struct fxfer_ctx *ctx, uint32_t seg_ind);
+static uint32_t get_seg_ind(struct fxfer_ctx *ctx, uint8_t *ptr);
+static void put_seg_ind(struct fxfer_ctx *ctx, uint32_t seg_ind, uint8_t *ptr);
 
 /* Functions used for parsing incoming messages */
-static void parser_wait_preamble();
-static void parser_wait_body();
-static void parser_process_message();
+static bool rx_fill(struct fxfer_ctx *ctx);
+static bool parser_wait_preamble(struct fxfer_ctx *ctx);
+static bool parser_wait_body(struct fxfer_ctx *ctx);
+static bool parser_process_message(struct fxfer_ctx *ctx);
 
 /* Functions for make responses */
-static void report_nack(uint8_t error_code);
-static void report_ack();
+static void report_nack(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, uint8_t error_code);
+static void report_ack(struct fxfer_ctx *ctx, struct file_xfer_channel *ch);
+static void report_data_ack(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, uint32_t seg_ind, uint32_t cum_seg_ind);
+static void fill_handshake_req(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, uint32_t window_size);
+static void fill_file_name_req(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, uint8_t msg_id,
+        const char *filename);
+
+/* Requests are started under the session lock by public API wrappers */
+static uint32_t handshake_start(struct fxfer_ctx *ctx, uint32_t window_size,
+        fxfer_done_cb done_cb, void *done_arg);
+static uint32_t files_list_start(struct fxfer_ctx *ctx, fxfer_done_cb done_cb, void *done_arg);
+static uint32_t file_hash_start(struct fxfer_ctx *ctx, const char* filename,
+        fxfer_done_cb done_cb, void *done_arg);
+static uint32_t file_send_start(struct fxfer_ctx *ctx, const char* filename, uint32_t req_id,
+        fxfer_done_cb done_cb, void *done_arg);
+static uint32_t file_delta_start(struct fxfer_ctx *ctx, const char* filename,
+        struct fxfer_delta_sig *sigs, uint32_t sigs_max, fxfer_done_cb done_cb, void *done_arg);
+static uint32_t file_tree_start(struct fxfer_ctx *ctx, const char* filename, uint8_t level,
+        uint32_t first_node, struct fxfer_tree_nodes *nodes, fxfer_done_cb done_cb, void *done_arg);
+static void ctx_lock(struct fxfer_ctx *ctx);
+static void ctx_unlock(struct fxfer_ctx *ctx);
+
+/* Requests state */
+static uint32_t new_req_id(struct fxfer_ctx *ctx);
+static bool request_start(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, enum file_xfer_session_states state,
+        uint32_t req_id, fxfer_done_cb done_cb, void *done_arg);
+static void request_complete(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, enum file_xfer_err_states err);
+static uint32_t request_rto(struct fxfer_ctx *ctx, uint8_t retries);
+static void request_retransmit(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, enum file_xfer_err_states err);
+static void request_wait_done(struct fxfer_ctx *ctx, uint32_t req_id, enum file_xfer_err_states err, void *arg);
+static bool request_wait(struct fxfer_ctx *ctx, uint32_t req_id, struct file_xfer_wait *wait,
+        const char *req_name);
+
+/* Sliding window helpers */
+static uint8_t negotiate_segs_in_flight(uint8_t peer_segs);
+static uint8_t get_rx_segs_in_flight(struct fxfer_ctx *ctx, uint32_t window_size);
+static void tx_window_start(struct fxfer_ctx *ctx, struct file_xfer_channel *ch);
+static void tx_window_pump(struct fxfer_ctx *ctx, struct file_xfer_channel *ch);
+static bool tx_window_open(struct fxfer_ctx *ctx, struct file_xfer_channel *ch);
+static bool tx_window_resend_one(struct fxfer_ctx *ctx, struct file_xfer_channel *ch);
+static void tx_schedule(struct fxfer_ctx *ctx);
+static bool tx_rate_allow(struct fxfer_ctx *ctx);
+static void tx_rate_consume(struct fxfer_ctx *ctx, uint32_t len);
+static bool send_file_segment(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, uint32_t seq);
+static bool fill_file_send_req(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, uint64_t seg_num);
+static uint64_t get_seg_num(struct file_xfer_tx_window *win);
+static bool tx_prefix_hash(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, uint64_t size, uint32_t *hash);
+static uint8_t *tx_read_part(struct fxfer_ctx *ctx, struct file_xfer_channel *ch);
+static bool tx_read(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, uint32_t seq, uint64_t offset,
+        uint32_t len, uint8_t *out);
+static bool rx_commit_segment(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, uint8_t *data, uint32_t len, uint8_t buf_id,
+        uint8_t codec);
+static bool rx_append(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, uint8_t *data, uint32_t len, bool *eof_flag);
+static bool rx_file_crc_check(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, const uint8_t *data,
+        uint32_t len, bool eof_flag);
+static void rx_data_segment(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, uint32_t seg_ind,
+        uint8_t *seg, uint32_t seg_len, bool held_flag);
+
+/* Delta transfer helpers */
+static void fill_file_sigs_req(struct fxfer_ctx *ctx, struct file_xfer_channel *ch);
+static void tx_delta_start(struct fxfer_ctx *ctx, struct file_xfer_channel *ch);
+static bool rx_block_sig(struct fxfer_ctx *ctx, const char *file_name, uint64_t offset,
+        uint32_t block_size, uint8_t *out);
+static bool rx_delta_apply(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, uint8_t *data, uint32_t len, bool *eof_flag);
+
+/* Hash tree helpers */
+static void fill_file_tree_req(struct fxfer_ctx *ctx, struct file_xfer_channel *ch);
+static bool tree_node_hash(struct fxfer_ctx *ctx, const char *file_name, uint64_t file_size,
+        uint32_t block_size, uint8_t level, uint64_t node, uint8_t *buf, uint64_t *hash);
+static bool tree_cache_get(struct fxfer_ctx *ctx, const char *file_name, uint64_t file_size,
+        uint32_t block_size, uint8_t *buf);
+
+/* Channels helpers */
+static struct file_xfer_channel *get_chan(struct fxfer_ctx *ctx, uint8_t chan_id);
+static struct file_xfer_channel *chan_alloc(struct fxfer_ctx *ctx);
+static struct file_xfer_channel *get_req_chan(struct fxfer_ctx *ctx, uint32_t req_id);
+static uint8_t negotiate_chans(uint8_t peer_chans);
+
+/* Forward error correction */
+static uint8_t negotiate_fec_group(uint8_t caps, uint8_t peer_group);
+static void fec_xor(uint8_t *acc, uint16_t *acc_len, const uint8_t *data, uint16_t len);
+static void tx_fec_add(struct file_xfer_channel *ch, const uint8_t *fields, uint8_t fields_len,
+        const uint8_t *data, uint16_t data_len);
+static void tx_fec_send(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, uint32_t seq);
+static struct file_xfer_rx_fec *rx_fec_group(struct file_xfer_channel *ch, uint32_t group,
+        uint8_t **acc);
+static void rx_fec_add(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, uint32_t seq, uint8_t *seg, uint32_t seg_len);
+static uint32_t rx_fec_rebuild(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, uint32_t group);
+static bool rx_fec_pending(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, uint8_t *payload, uint32_t len);
+static void rx_fec_sent(struct file_xfer_channel *ch, uint32_t seq);
+
+/* Adaptive window */
+static void link_rtt_sample(struct fxfer_ctx *ctx, uint32_t rtt);
+static uint32_t adapt_window(uint32_t winsize, uint32_t winsize_max, uint32_t packs,
+        uint32_t errors, bool grow_flag);
+static void adapt_tx_update(struct fxfer_ctx *ctx, bool timeout_flag);
+static void adapt_rx_update(struct fxfer_ctx *ctx);
+static void adapt_renegotiate(struct fxfer_ctx *ctx);
+
+/* Transfer queue */
+static struct file_xfer_job *queue_next(struct fxfer_ctx *ctx);
+static void queue_dispatch(struct fxfer_ctx *ctx);
+
+/* File open helpers */
+static bool file_open(struct fxfer_ctx *ctx, const char *file_name, bool write_flag, bool *open_flag);
+static void file_close(struct fxfer_ctx *ctx, const char *file_name, bool write_flag, bool *open_flag);
+
+/* Hash index helpers */
+static bool file_hash_get(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, const char *file_name,
+        uint32_t *hash);
+static bool file_crc_count(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, const char *file_name,
+        uint64_t size, uint32_t *hash);
+static bool file_stamp_get(struct fxfer_ctx *ctx, const char *file_name, uint64_t *stamp);
+static void rx_index_file(struct fxfer_ctx *ctx, struct file_xfer_channel *ch);
+
+/* Write-behind helpers */
+static uint8_t *rx_write_part(struct fxfer_ctx *ctx, struct file_xfer_channel *ch);
+static bool rx_write_append(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, const uint8_t *data,
+        uint32_t len, bool eof_flag);
+static bool rx_write_flush(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, bool eof_flag, bool sync_flag);
+static void rx_write_interrupt(struct fxfer_ctx *ctx, struct file_xfer_channel *ch);
+
+/* Rx pool helpers */
+static bool is_rx_zero_copy(struct fxfer_ctx *ctx);
+static uint8_t rx_pool_hold(struct fxfer_ctx *ctx);
+static void rx_pool_drop_slots(struct fxfer_ctx *ctx, struct file_xfer_channel *ch);
 
 /* Message handlers */
-static void handshake_req_handler(void* arg);
-static void handshake_res_handler(void* arg);
-static void files_list_req_handler(void* arg);
-static void files_list_res_handler(void* arg);
-static void file_hash_req_handler(void* arg);
-static void file_hash_res_handler(void* arg);
-static void file_send_req_handler(void* arg);
-static void file_receive_req_handler(void* arg);
-static void file_data_handler(void* arg);
-static void ack_handler(void* arg);
-static void nack_handler(void* arg);
-static void default_handler(void* arg);
+static void handshake_req_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg);
+static void handshake_res_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg);
+static void files_list_req_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg);
+static void files_list_res_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg);
+static void file_hash_req_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg);
+static void file_hash_res_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg);
+static void file_send_req_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg);
+static void file_receive_req_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg);
+static void file_data_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg);
+static void ack_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg);
+static void nack_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg);
+static void file_sigs_req_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg);
+static void file_sigs_res_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg);
+static void file_resume_req_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg);
+static void file_resume_res_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg);
+static void file_parity_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg);
+static void file_tree_req_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg);
+static void file_tree_res_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg);
+static void default_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg);
 
 /* Array of parser functions */
-static void (*parse_func_arr[FXFER_PARSE_STATES_NUM])() = {
+static bool (*parse_func_arr[FXFER_PARSE_STATES_NUM])(struct fxfer_ctx *ctx) = {
         parser_wait_preamble,
         parser_wait_body,
         parser_process_message
 };
 
 /* Array of on-receive msg handlers */
-static void (*msg_handlers_arr[FXFER_PACKS_NUM])(void*) = {
+static void (*msg_handlers_arr[FXFER_PACKS_NUM])(struct fxfer_ctx *ctx,
+        struct file_xfer_channel *ch, void*) = {
         default_handler,
         handshake_req_handler,
         handshake_res_handler,
@@ -68,653 +267,3458 @@ static void (*msg_handlers_arr[FXFER_PACKS_NUM])(void*) = {
         file_receive_req_handler,
         file_data_handler,
         ack_handler,
-        nack_handler
+        nack_handler,
+        file_sigs_req_handler,
+        file_sigs_res_handler,
+        file_resume_req_handler,
+        file_resume_res_handler,
+        file_parity_handler,
+        file_tree_req_handler,
+        file_tree_res_handler
 };
 
-void fxfer_parser() {
-    /* Call parser function that corresponds to current state */
-    parse_func_arr[fxfer_status.parse_state]();
+void fxfer_init(struct fxfer_ctx *ctx, const struct fxfer_platform *platform,
+        const struct fxfer_callbacks *callbacks, void *user_data) {
+    memset(ctx, 0, sizeof(struct fxfer_ctx));
+    ctx->platform = platform;
+    ctx->callbacks = callbacks;
+    ctx->user_data = user_data;
+    ctx->tx_data = ctx->tx_buf;
+    ctx->tx_data_size = FXFER_TX_BUF_SIZE;
+    ctx->rx_data = ctx->rx_buf;
+    ctx->rx_data_size = FXFER_RX_RING_SIZE;
+    ctx->rx_pack_max = FXFER_RX_BUF_SIZE;
+
+    /* Initial state */
+    ctx->status.handshake_done_flag = false;
+    ctx->status.segs_in_flight = 1;
+    ctx->status.parse_state = FXFER_PSTATE_WAIT_PREAMBLE;
+    ctx->status.rx_need = FXFER_PACK_PREAM_FIELD_LEN;
+    ctx->status.chans_num = 1;
+    ctx->status.chan_side = 0;
+
+    /* The first half of channels is opened by the device that made the handshake */
+    for (uint8_t i = 0; i < 2 * FXFER_CHANNELS_NUM; i++) {
+        struct file_xfer_channel *ch = &ctx->chans[i];
+        ch->id = (uint8_t)((i / FXFER_CHANNELS_NUM) << FXFER_CHAN_SIDE_SHIFT)
+                | (i % FXFER_CHANNELS_NUM);
+        ch->session_state = FXFER_SSTATE_IDLE;
+        ch->last_error = FXFER_NO_ERROR;
+    }
+}
+
+bool fxfer_set_jumbo_bufs(struct fxfer_ctx *ctx, uint8_t *tx_buf, uint32_t tx_size,
+        uint8_t *rx_buf, uint32_t rx_size) {
+    if ((tx_buf != NULL && tx_size < FXFER_TX_BUF_SIZE) || (rx_buf != NULL && rx_size < FXFER_RX_BUF_SIZE)) {
+        log_error("Wrong jumbo buffers: tx %u bytes, rx %u bytes\n", tx_size, rx_size);
+        return false;
+    }
+
+    if (tx_buf != NULL) {
+        ctx->tx_data = tx_buf;
+        ctx->tx_data_size = tx_size;
+    }
+    if (rx_buf != NULL) {
+        /* Packets are received to jumbo buffer from now, it holds one packet of the window */
+        ctx->rx_data = rx_buf;
+        ctx->rx_data_size = rx_size;
+        ctx->rx_pack_max = rx_size;
+        ctx->status.rx_buf_fill_size = 0;
+        ctx->status.rx_buf_pos = 0;
+        ctx->status.rx_need = FXFER_PACK_PREAM_FIELD_LEN;
+        ctx->status.parse_state = FXFER_PSTATE_WAIT_PREAMBLE;
+    }
+    return true;
 }
 
-/* Waiting for preamble, and switch state when it's found */
-static void parser_wait_preamble() {
-    static uint32_t preamble = FXFER_PACK_PREAMBLE;
-    static uint8_t pream_ind = 0;
-    fxfer_status.rx_buf_fill_size = 0;
+bool fxfer_set_rx_pool(struct fxfer_ctx *ctx, uint8_t **bufs, uint8_t buf_num, uint32_t buf_size) {
+    if (buf_num == 0 || buf_num > FXFER_RX_POOL_BUFS_MAX || buf_size < ctx->rx_pack_max) {
+        log_error("Wrong rx pool: %u buffers of %u bytes\n", buf_num, buf_size);
+        return false;
+    }
 
-    /* Read the byte and compare it with expected value */
-    uint8_t data = 0;
-    uint16_t res = platform_read(&data, sizeof(data));
+    struct file_xfer_rx_pool *pool = &ctx->rx_pool;
+    pool->bufs = bufs;
+    pool->buf_num = buf_num;
+    pool->buf_size = buf_size;
+    pool->cur_buf = 0;
+    memset(pool->refs, 0, sizeof(pool->refs));
+
+    /* Packets are received to pool buffers from now */
+    ctx->rx_data = bufs[0];
+    ctx->rx_data_size = buf_size;
+    ctx->status.rx_buf_fill_size = 0;
+    ctx->status.rx_buf_pos = 0;
+    ctx->status.rx_need = FXFER_PACK_PREAM_FIELD_LEN;
+    ctx->status.parse_state = FXFER_PSTATE_WAIT_PREAMBLE;
+    return true;
+}
 
-    if (res != sizeof(data)) {
-        /* Some read error */
-        fxfer_status.parse_state = FXFER_PSTATE_WAIT_PREAMBLE;
-        fxfer_status.session_state = FXFER_SSTATE_IDLE;
-        log_error("platform_read() error, read %u bytes instead of %u\n", res, sizeof(data));
-        return;
+void fxfer_rx_buf_release(struct fxfer_ctx *ctx, uint8_t buf_id) {
+    struct file_xfer_rx_pool *pool = &ctx->rx_pool;
+    if (buf_id < pool->buf_num && pool->refs[buf_id] > 0) {
+        pool->refs[buf_id]--;
+    }
+}
+
+bool fxfer_set_write_buf(struct fxfer_ctx *ctx, uint8_t *buf, uint32_t size, uint32_t sync_size) {
+    uint32_t part_size = size / FXFER_CHANNELS_NUM / FXFER_WRITE_ALIGN * FXFER_WRITE_ALIGN;
+    if (buf != NULL && part_size == 0) {
+        log_error("Wrong write buffer: %u bytes\n", size);
+        return false;
     }
 
-    if (data == ((uint8_t*)&preamble)[pream_ind]) {
-        if (pream_ind == 0) {
-            /* The first byte of preamble received */
-            pream_ind++;
-        } else if (pream_ind == 1) {
-            /* The second byte of preamble received */
-            pream_ind++;
-        } else if (pream_ind == 2) {
-            /* The third byte of preamble received */
-            pream_ind++;
-        } else if (pream_ind == 3) {
-            /* The fourth byte of preamble received */
-            pream_ind = 0;
+    struct file_xfer_write_buf *wb = &ctx->write_buf;
+    wb->buf = buf;
+    wb->part_size = buf != NULL ? part_size : 0;
+    wb->sync_size = sync_size;
+    return true;
+}
+
+bool fxfer_set_read_buf(struct fxfer_ctx *ctx, uint8_t *buf, uint32_t size) {
+    uint32_t part_size = size / FXFER_CHANNELS_NUM;
+    if (buf != NULL && part_size == 0) {
+        log_error("Wrong read buffer: %u bytes\n", size);
+        return false;
+    }
 
-            /* Place it to the receive storage */
-            write_uint32_le(FXFER_PACK_PREAMBLE, rx_buf);
-            fxfer_status.rx_buf_fill_size += FXFER_PACK_PREAM_FIELD_LEN;
+    ctx_lock(ctx);
+    ctx->read_buf.buf = buf;
+    ctx->read_buf.part_size = buf != NULL ? part_size : 0;
+    for (uint8_t i = 0; i < 2 * FXFER_CHANNELS_NUM; i++) {
+        ctx->chans[i].tx_win.read_fill = 0;
+    }
+    ctx_unlock(ctx);
+    return true;
+}
 
-            /* Change parse state */
-            fxfer_status.parse_state = FXFER_PSTATE_WAIT_BODY;
+void fxfer_flush_writes(struct fxfer_ctx *ctx) {
+    ctx_lock(ctx);
+    for (uint8_t i = 0; i < 2 * FXFER_CHANNELS_NUM; i++) {
+        struct file_xfer_channel *ch = &ctx->chans[i];
+        if (ch->session_state == FXFER_SSTATE_WAIT_FILE && rx_write_part(ctx, ch) != NULL
+                && rx_write_flush(ctx, ch, false, true) != true) {
+            log_error("File %s write error\n", ch->file_name_temp);
         }
-    } else {
-        pream_ind = 0;
     }
+    ctx_unlock(ctx);
 }
 
-/* Accumulates other part of packet and check it's validity */
-static void parser_wait_body() {
-    /* Get MSG_ID and LEN */
-    uint16_t read_len = FXFER_PACK_MSGID_FIELD_LEN + FXFER_PACK_LEN_FIELD_LEN;
-    uint16_t res = platform_read(&rx_buf[fxfer_status.rx_buf_fill_size], read_len);
-    if (res != read_len) {
-        /* Some read error */
-        fxfer_status.parse_state = FXFER_PSTATE_WAIT_PREAMBLE;
-        fxfer_status.session_state = FXFER_SSTATE_IDLE;
-        log_error("platform_read() error, read %u bytes instead of %u\n", res, read_len);
-        return;
+void fxfer_set_hash_index(struct fxfer_ctx *ctx, struct fxfer_hash_entry *entries, uint16_t entry_num) {
+    ctx_lock(ctx);
+    hash_index_init(&ctx->hash_index, entries, entry_num);
+    ctx_unlock(ctx);
+}
+
+uint32_t fxfer_hash_index_save(struct fxfer_ctx *ctx, uint8_t *buf, uint32_t buf_size) {
+    ctx_lock(ctx);
+    uint32_t len = hash_index_save(&ctx->hash_index, buf, buf_size);
+    ctx_unlock(ctx);
+    if (len == 0) {
+        log_error("Hash index doesn't fit %u bytes\n", buf_size);
     }
-    fxfer_status.rx_buf_fill_size += read_len;
+    return len;
+}
 
-    /* Get payload */
-    uint16_t len = get_uint16_by_ptr(&rx_buf[FXFER_PACK_LEN_IND]);
+bool fxfer_hash_index_load(struct fxfer_ctx *ctx, const uint8_t *buf, uint32_t len) {
+    ctx_lock(ctx);
+    bool res = hash_index_load(&ctx->hash_index, buf, len);
+    ctx_unlock(ctx);
+    if (res != true) {
+        log_error("Saved hash index is broken\n");
+    }
+    return res;
+}
 
-    /* Check if it's not enough place in rx buffer */
-    uint16_t free_space = FXFER_RX_BUF_SIZE - fxfer_status.rx_buf_fill_size;
-    uint16_t needed_space = len + FXFER_PACK_CRC_FIELD_LEN;
-    if (free_space < needed_space) {
-        /* Not enough memory in rx buffer */
-        fxfer_status.parse_state = FXFER_PSTATE_WAIT_PREAMBLE;
-        fxfer_status.session_state = FXFER_SSTATE_IDLE;
-        log_error("Not enough space in rx buffer. %u bytes is available, "
-                "while %u needed to store the packet\n", free_space, needed_space);
-        report_nack(FXFER_NACK_ERR_NO_MEMORY);
+void fxfer_hash_index_drop(struct fxfer_ctx *ctx, const char* filename) {
+    ctx_lock(ctx);
+    hash_index_drop(&ctx->hash_index, filename);
+    tree_cache_drop(&ctx->tree_cache, filename);
+    ctx_unlock(ctx);
+}
+
+void fxfer_set_tree_cache(struct fxfer_ctx *ctx, uint64_t *hashes, uint32_t hashes_max) {
+    ctx_lock(ctx);
+    tree_cache_init(&ctx->tree_cache, hashes, hashes_max);
+    ctx_unlock(ctx);
+}
+
+void fxfer_parser(struct fxfer_ctx *ctx) {
+    /* Get the next block of data */
+    if (rx_fill(ctx) != true) {
         return;
     }
 
-    /* Get the rest part of data */
-    read_len = len + FXFER_PACK_CRC_FIELD_LEN;
-    res = platform_read(&rx_buf[fxfer_status.rx_buf_fill_size], read_len);
+    /* Call parser functions that correspond to current state,
+     * while there are complete packets in rx buffer */
+    ctx_lock(ctx);
+    while (parse_func_arr[ctx->status.parse_state](ctx) == true) {
+    }
+    ctx_unlock(ctx);
+}
+
+/* Reads as much data as transport gives, or exact number of bytes needed
+ * for the current parse state if transport can't do partial reads */
+static bool rx_fill(struct fxfer_ctx *ctx) {
+    struct file_xfer_stat *st = &ctx->status;
+    struct file_xfer_rx_pool *pool = &ctx->rx_pool;
+
+    /* Move unparsed data to the beginning of rx buffer. Pool buffer that holds
+     * segments given to application isn't touched, the data is moved to a free one */
+    if (st->rx_buf_pos > 0 && pool->buf_num > 0 && pool->refs[pool->cur_buf] > 0) {
+        for (uint8_t i = 0; i < pool->buf_num; i++) {
+            if (i != pool->cur_buf && pool->refs[i] == 0) {
+                memcpy(pool->bufs[i], &ctx->rx_data[st->rx_buf_pos],
+                        st->rx_buf_fill_size - st->rx_buf_pos);
+                pool->cur_buf = i;
+                ctx->rx_data = pool->bufs[i];
+                st->rx_buf_fill_size -= st->rx_buf_pos;
+                st->rx_buf_pos = 0;
+                break;
+            }
+        }
+    } else if (st->rx_buf_pos > 0) {
+        memmove(ctx->rx_data, &ctx->rx_data[st->rx_buf_pos], st->rx_buf_fill_size - st->rx_buf_pos);
+        st->rx_buf_fill_size -= st->rx_buf_pos;
+        st->rx_buf_pos = 0;
+    }
+
+    /* All the pool buffers are held by application, wait for release */
+    uint32_t free_space = ctx->rx_data_size - st->rx_buf_fill_size;
+    uint32_t read_len = st->rx_need > 0 ? st->rx_need : 1;
+    if (free_space < read_len) {
+        return false;
+    }
+
+    if (ctx->platform->read_some != NULL) {
+        uint32_t res = ctx->platform->read_some(ctx->user_data,
+                &ctx->rx_data[st->rx_buf_fill_size], free_space);
+        st->rx_buf_fill_size += res;
+        return res > 0 ? true : false;
+    }
+
+    uint32_t res = ctx->platform->read(ctx->user_data,
+            &ctx->rx_data[st->rx_buf_fill_size], read_len);
     if (res != read_len) {
-        /* Some read error */
-        fxfer_status.parse_state = FXFER_PSTATE_WAIT_PREAMBLE;
-        fxfer_status.session_state = FXFER_SSTATE_IDLE;
-        log_error("platform_read() error, read %u bytes instead of %u\n", res, read_len);
-        return;
+        /* Some read error, requests in progress fail. Only the requests active before
+         * the error are completed, the queued ones started by completion aren't touched */
+        log_error("platform read() error, read %u bytes instead of %u\n", res, read_len);
+        ctx_lock(ctx);
+        st->rx_buf_fill_size = 0;
+        st->rx_need = FXFER_PACK_PREAM_FIELD_LEN;
+        st->parse_state = FXFER_PSTATE_WAIT_PREAMBLE;
+        bool active_flags[2 * FXFER_CHANNELS_NUM];
+        for (uint8_t i = 0; i < 2 * FXFER_CHANNELS_NUM; i++) {
+            active_flags[i] = ctx->chans[i].request.active_flag;
+            rx_write_interrupt(ctx, &ctx->chans[i]);
+            if (active_flags[i] != true) {
+                ctx->chans[i].session_state = FXFER_SSTATE_IDLE;
+            }
+        }
+        for (uint8_t i = 0; i < 2 * FXFER_CHANNELS_NUM; i++) {
+            if (active_flags[i] == true) {
+                request_complete(ctx, &ctx->chans[i], FXFER_ERR_PLATFORM);
+            }
+        }
+        ctx_unlock(ctx);
+        return false;
+    }
+    st->rx_buf_fill_size += read_len;
+    return true;
+}
+
+/* Searching for preamble, and switch state when it's found */
+static bool parser_wait_preamble(struct fxfer_ctx *ctx) {
+    static const uint8_t preamble[FXFER_PACK_PREAM_FIELD_LEN] = {
+        FXFER_PACK_PREAMBLE & 0xFF,
+        (FXFER_PACK_PREAMBLE >> 8) & 0xFF,
+        (FXFER_PACK_PREAMBLE >> 16) & 0xFF,
+        (FXFER_PACK_PREAMBLE >> 24) & 0xFF
+    };
+    struct file_xfer_stat *st = &ctx->status;
+    uint32_t pos = st->rx_buf_pos;
+
+    while (pos < st->rx_buf_fill_size) {
+        /* Look for the first byte of preamble */
+        uint8_t *found = memchr(&ctx->rx_data[pos], preamble[0], st->rx_buf_fill_size - pos);
+        if (found == NULL) {
+            pos = st->rx_buf_fill_size;
+            break;
+        }
+        pos = (uint32_t)(found - ctx->rx_data);
+
+        /* Compare the rest part, it may be not received yet */
+        uint32_t avail = st->rx_buf_fill_size - pos;
+        uint32_t cmp_len = avail < FXFER_PACK_PREAM_FIELD_LEN ? avail : FXFER_PACK_PREAM_FIELD_LEN;
+        if (memcmp(found, preamble, cmp_len) == 0) {
+            if (cmp_len == FXFER_PACK_PREAM_FIELD_LEN) {
+                /* Change parse state */
+                st->rx_buf_pos = pos;
+                st->parse_state = FXFER_PSTATE_WAIT_BODY;
+                st->body_tick = ctx->platform->get_tick(ctx->user_data);
+                return true;
+            }
+            break;
+        }
+        pos++;
+    }
+
+    st->rx_buf_pos = pos;
+    st->rx_need = FXFER_PACK_PREAM_FIELD_LEN - (st->rx_buf_fill_size - pos);
+    return false;
+}
+
+/* Waits for other part of packet and check it's validity */
+static bool parser_wait_body(struct fxfer_ctx *ctx) {
+    struct file_xfer_stat *st = &ctx->status;
+    uint8_t *pack = &ctx->rx_data[st->rx_buf_pos];
+    uint32_t avail = st->rx_buf_fill_size - st->rx_buf_pos;
+
+    /* Get MSG_ID and LEN, extended header has 32-bit EXT_LEN after it */
+    if (avail < FXFER_PACK_PAYLOAD_IND) {
+        st->rx_need = FXFER_PACK_PAYLOAD_IND - avail;
+        return false;
+    }
+    uint32_t len = get_uint16_by_ptr(&pack[FXFER_PACK_LEN_IND]);
+    uint8_t payload_ind = FXFER_PACK_PAYLOAD_IND;
+    if (len == FXFER_PACK_LEN_EXT) {
+        if (avail < FXFER_PACK_EXT_PAYLOAD_IND) {
+            st->rx_need = FXFER_PACK_EXT_PAYLOAD_IND - avail;
+            return false;
+        }
+        len = get_uint32_by_ptr(&pack[FXFER_PACK_EXT_LEN_IND]);
+        payload_ind = FXFER_PACK_EXT_PAYLOAD_IND;
+    }
+
+    /* Errors are reported to the channel of the packet, it's the best guess for broken one */
+    struct file_xfer_channel *ch = get_chan(ctx, pack[FXFER_PACK_MSGID_IND] >> FXFER_PACK_CHAN_SHIFT);
+    if (ch == NULL) {
+        ch = &ctx->chans[0];
+    }
+
+    /* Longer request, ACK or NACK has corrupted header, don't wait for its body */
+    if (len > get_msg_len_max(pack[FXFER_PACK_MSGID_IND] & FXFER_PACK_ID_MASK)) {
+        log_error("Gotten packet with wrong header. Message id: %u, length: %u\n",
+                pack[FXFER_PACK_MSGID_IND] & FXFER_PACK_ID_MASK, len);
+        ctx->link_stat.rx_crc_errors++;
+        report_nack(ctx, ch, FXFER_NACK_ERR_WRONG_CRC);
+        st->rx_buf_pos++;
+        st->parse_state = FXFER_PSTATE_WAIT_PREAMBLE;
+        return true;
+    }
+
+    /* Check if it's not enough place in rx buffer */
+    if (len > ctx->rx_pack_max - payload_ind - FXFER_PACK_CRC_FIELD_LEN) {
+        /* Not enough memory in rx buffer, or corrupted LEN,
+         * look for the next preamble after this one */
+        log_error("Not enough space in rx buffer. %u bytes is available, "
+                "while %u needed to store the packet\n", ctx->rx_pack_max,
+                len + payload_ind + FXFER_PACK_CRC_FIELD_LEN);
+        report_nack(ctx, ch, FXFER_NACK_ERR_NO_MEMORY);
+        st->rx_buf_pos++;
+        st->parse_state = FXFER_PSTATE_WAIT_PREAMBLE;
+        return true;
+    }
+    uint32_t pack_len = payload_ind + len + FXFER_PACK_CRC_FIELD_LEN;
+
+    /* Get the rest part of data. The body that isn't received within retransmission
+     * timeout has corrupted LEN, so resync from the next byte after preamble and
+     * don't swallow the packets that follow it */
+    if (avail < pack_len) {
+        if (ctx->platform->get_tick(ctx->user_data) - st->body_tick >= request_rto(ctx, 0)) {
+            log_error("Packet body of %u bytes isn't received in time, resync\n", len);
+            ctx->link_stat.rx_crc_errors++;
+            st->rx_buf_pos++;
+            st->parse_state = FXFER_PSTATE_WAIT_PREAMBLE;
+            return true;
+        }
+        st->rx_need = pack_len - avail;
+        /* Exact read of jumbo body is split by default packets, so the timeout
+         * is checked while the peer repeats the packets swallowed by it */
+        if (ctx->platform->read_some == NULL && st->rx_need > FXFER_RX_BUF_SIZE) {
+            st->rx_need = FXFER_RX_BUF_SIZE;
+        }
+        return false;
     }
-    fxfer_status.rx_buf_fill_size += read_len;
 
     /* Gotten full packet, check it's validity */
-    uint16_t msg_len_without_crc = fxfer_status.rx_buf_fill_size - FXFER_PACK_CRC_FIELD_LEN;
-    uint32_t pack_crc32 = get_uint32_by_ptr(&rx_buf[msg_len_without_crc]);
-    uint32_t calc_crc32 = crc32_compute_buf(0, rx_buf, msg_len_without_crc);
+    uint32_t msg_len_without_crc = pack_len - FXFER_PACK_CRC_FIELD_LEN;
+    uint32_t pack_crc32 = get_uint32_by_ptr(&pack[msg_len_without_crc]);
+    uint32_t calc_crc32 = crc32_compute_buf(0, pack, msg_len_without_crc);
     if (pack_crc32 != calc_crc32) {
-        /* Packet with wrong crc32 */
-        fxfer_status.parse_state = FXFER_PSTATE_WAIT_PREAMBLE;
+        /* Packet with wrong crc32, resync from the next byte after preamble,
+         * so the packet that follows corrupted one isn't lost */
         log_error("Gotten packet with wrong crc. Given: 0x%08X, calculated: 0x%08X\n",
                 pack_crc32, calc_crc32);
-        report_nack(FXFER_NACK_ERR_WRONG_CRC);
-        return;
+        ctx->link_stat.rx_crc_errors++;
+        ctx->adapt.rx_errors++;
+        adapt_rx_update(ctx);
+
+        /* Broken segment which FEC parity is still awaited for is rebuilt by parity,
+         * segments that parity can't rebuild are NACKed when it's received. If parity
+         * is broken, NACKs of the broken segments are sent instead */
+        uint8_t msg_id = pack[FXFER_PACK_MSGID_IND] & FXFER_PACK_ID_MASK;
+        if (msg_id == FXFER_PACK_FILE_DATA
+                && rx_fec_pending(ctx, ch, &pack[payload_ind], len) == true) {
+            ch->rx_win.fec_broken++;
+        } else if (msg_id == FXFER_PACK_FILE_PARITY && (ctx->status.caps & FXFER_CAP_FEC) != 0
+                && ch->session_state == FXFER_SSTATE_WAIT_FILE) {
+            if (rx_fec_pending(ctx, ch, &pack[payload_ind], len) == true) {
+                rx_fec_sent(ch, ch->rx_win.seg_num - 1 - get_seg_ind(ctx, &pack[payload_ind])
+                        + ctx->status.fec_group - 1);
+            }
+            for (; ch->rx_win.fec_broken > 0; ch->rx_win.fec_broken--) {
+                report_nack(ctx, ch, FXFER_NACK_ERR_WRONG_CRC);
+            }
+        } else {
+            report_nack(ctx, ch, FXFER_NACK_ERR_WRONG_CRC);
+        }
+        st->rx_buf_pos++;
+        st->parse_state = FXFER_PSTATE_WAIT_PREAMBLE;
+        return true;
     }
 
     /* Packet is valid, switch state */
-    fxfer_status.parse_state = FXFER_PSTATE_PROCESS_MSG;
+    ctx->link_stat.rx_packs++;
+    ctx->adapt.rx_packs++;
+    adapt_rx_update(ctx);
+    st->rx_payload_len = len;
+    st->rx_payload_ind = payload_ind;
+    st->parse_state = FXFER_PSTATE_PROCESS_MSG;
+    return true;
 }
 
-static void parser_process_message() {
-    /* Gotten MSG_ID, check it */
-    uint8_t msg_id = rx_buf[FXFER_PACK_MSGID_IND];
+static bool parser_process_message(struct fxfer_ctx *ctx) {
+    struct file_xfer_stat *st = &ctx->status;
+    uint8_t *pack = &ctx->rx_data[st->rx_buf_pos];
+
+    /* The packet is handled here, parse the next one after it */
+    st->rx_buf_pos += st->rx_payload_ind + st->rx_payload_len + FXFER_PACK_CRC_FIELD_LEN;
+    st->parse_state = FXFER_PSTATE_WAIT_PREAMBLE;
+
+    /* Gotten MSG_ID, check it and its channel */
+    uint8_t msg_id = pack[FXFER_PACK_MSGID_IND] & FXFER_PACK_ID_MASK;
+    uint8_t chan_id = pack[FXFER_PACK_MSGID_IND] >> FXFER_PACK_CHAN_SHIFT;
+    struct file_xfer_channel *ch = get_chan(ctx, chan_id);
+    if (ch == NULL) {
+        log_error("Gotten message id: %u of unknown channel: %u\n", msg_id, chan_id);
+        return true;
+    }
     if (msg_id < FXFER_PACK_ID_MIN || msg_id > FXFER_PACK_ID_MAX) {
         /* Unrecognized message ID */
-        fxfer_status.parse_state = FXFER_PSTATE_WAIT_PREAMBLE;
-        fxfer_status.session_state = FXFER_SSTATE_IDLE;
+        ch->session_state = FXFER_SSTATE_IDLE;
         log_error("Gotten unrecognized message id: %u\n", msg_id);
-        return;
+        return true;
     }
 
     /* Call corresponding msg handler */
-    uint16_t payload_ind = FXFER_PACK_PREAM_FIELD_LEN + FXFER_PACK_MSGID_FIELD_LEN
-            + FXFER_PACK_LEN_FIELD_LEN;
-    msg_handlers_arr[msg_id](&rx_buf[payload_ind]);
-    fxfer_status.parse_state = FXFER_PSTATE_WAIT_PREAMBLE;
+    msg_handlers_arr[msg_id](ctx, ch, &pack[st->rx_payload_ind]);
+    return true;
 }
 
-static void report_nack(uint8_t error_code) {
-    fill_preamble();
-    fill_msg_id(FXFER_PACK_NACK);
-    fill_len(sizeof(uint8_t));
-    fill_payload((uint8_t *)&error_code, sizeof(uint8_t));
-    fill_msg_crc();
-    send_msg();
+static void report_nack(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, uint8_t error_code) {
+    fill_preamble(ctx);
+    fill_msg_id(ctx, ch, FXFER_PACK_NACK);
+    fill_len(ctx, sizeof(uint8_t));
+    fill_payload(ctx, (uint8_t *)&error_code, sizeof(uint8_t));
+    fill_msg_crc(ctx);
+    send_msg(ctx);
 }
 
-static void report_ack() {
-    fill_preamble();
-    fill_msg_id(FXFER_PACK_ACK);
-    fill_len(0);
-    fill_msg_crc();
-    send_msg();
+static void report_ack(struct fxfer_ctx *ctx, struct file_xfer_channel *ch) {
+    fill_preamble(ctx);
+    fill_msg_id(ctx, ch, FXFER_PACK_ACK);
+    fill_len(ctx, 0);
+    fill_msg_crc(ctx);
+    send_msg(ctx);
 }
 
-bool make_handshake(uint16_t window_size) {
-    /* Form HANDSHAKE_REQ */
-    fill_preamble();
-    fill_msg_id(FXFER_PACK_HANDSHAKE_REQ);
-    fill_len(sizeof(uint16_t));
-    fill_payload((uint8_t *)&window_size, sizeof(uint16_t));
-    fill_msg_crc();
+static void report_data_ack(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, uint32_t seg_ind, uint32_t cum_seg_ind) {
+    uint8_t payload[FXFER_DATA_ACK_WIDE_LEN];
+    uint8_t ind_len = get_seg_ind_len(ctx);
+    put_seg_ind(ctx, seg_ind, &payload[0]);
+    put_seg_ind(ctx, cum_seg_ind, &payload[ind_len]);
+
+    fill_preamble(ctx);
+    fill_msg_id(ctx, ch, FXFER_PACK_ACK);
+    fill_len(ctx, 2 * ind_len);
+    fill_payload(ctx, payload, 2 * ind_len);
+    fill_msg_crc(ctx);
+    send_msg(ctx);
+}
 
-    /* Switch session state */
-    fxfer_status.session_state = FXFER_SSTATE_WAIT_HANDSHAKE;
-    fxfer_status.last_error = FXFER_NO_ERROR;
+static void fill_handshake_req(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, uint32_t window_size) {
+    uint8_t payload[FXFER_HANDSHAKE_LEN];
+    write_uint16_le(window_size < FXFER_PACK_LEN_MAX ? (uint16_t)window_size : FXFER_PACK_LEN_MAX, &payload[0]);
+    payload[sizeof(uint16_t)] = get_rx_segs_in_flight(ctx, window_size);
+    payload[FXFER_HANDSHAKE_SEGS_LEN] = FXFER_LOCAL_CAPS;
+    payload[FXFER_HANDSHAKE_CAPS_LEN] = FXFER_CHANNELS_NUM;
+    payload[FXFER_HANDSHAKE_CHANS_LEN] = FXFER_LOCAL_FEC_GROUP;
+    write_uint32_le(window_size, &payload[FXFER_HANDSHAKE_FEC_LEN]);
+    write_uint16_le(FXFER_RX_SEG_DATA_MAX, &payload[FXFER_HANDSHAKE_JUMBO_LEN]);
+
+    fill_preamble(ctx);
+    fill_msg_id(ctx, ch, FXFER_PACK_HANDSHAKE_REQ);
+    fill_len(ctx, FXFER_HANDSHAKE_LEN);
+    fill_payload(ctx, payload, FXFER_HANDSHAKE_LEN);
+    fill_msg_crc(ctx);
+}
 
-    /* Send message */
-    send_msg();
-
-    /* Wait cycle with short sleep */
-    uint32_t start_tick = platform_get_tick();
-    bool timeout_flag = false;
-    while (fxfer_status.session_state == FXFER_SSTATE_WAIT_HANDSHAKE) {
-        if (platform_get_tick() - start_tick >= FXFER_RESPONSE_TIMEOUT_TICKS) {
-            timeout_flag = true;
-            break;
-        }
-        platform_sleep(10);
-    }
+/* Forms request which payload is file name only */
+static void fill_file_name_req(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, uint8_t msg_id,
+        const char *filename) {
+    uint16_t len = (uint16_t)strlen(filename);
+    fill_preamble(ctx);
+    fill_msg_id(ctx, ch, msg_id);
+    fill_len(ctx, len + 1); //+1 to count \0
+    fill_payload(ctx, (uint8_t *)filename, len + 1);
+    fill_msg_crc(ctx);
+}
 
-    /* Handle timeout */
-    if (timeout_flag == true) {
-        log_error("make_handshake() timeout\n");
-        fxfer_status.session_state = FXFER_SSTATE_IDLE;
-        fxfer_status.last_error = FXFER_NO_ERROR;
-        return false;
-    }
+/* Requests are sent at once and completed by response handlers, NACK or timeout */
+uint32_t make_handshake_async(struct fxfer_ctx *ctx, uint32_t window_size,
+        fxfer_done_cb done_cb, void *done_arg) {
+    ctx_lock(ctx);
+    /* Window given by application is the most one adaptive window gives to the peer */
+    ctx->adapt.rx_winsize_max = window_size;
+    ctx->link_stat.rx_winsize = window_size;
+    uint32_t req_id = handshake_start(ctx, window_size, done_cb, done_arg);
+    ctx_unlock(ctx);
+    return req_id;
+}
 
-    /* Handle possible errors */
-    if (fxfer_status.session_state == FXFER_SSTATE_ERR_RECEIVED) {
-        log_error("make_handshake() error: %u\n", fxfer_status.last_error);
-        fxfer_status.session_state = FXFER_SSTATE_IDLE;
-        fxfer_status.last_error = FXFER_NO_ERROR;
-        return false;
-    }
+uint32_t request_files_list_async(struct fxfer_ctx *ctx, fxfer_done_cb done_cb, void *done_arg) {
+    ctx_lock(ctx);
+    uint32_t req_id = files_list_start(ctx, done_cb, done_arg);
+    ctx_unlock(ctx);
+    return req_id;
+}
 
-    log_debug("Handshake done\n");
-    return true;
+uint32_t request_file_hash_async(struct fxfer_ctx *ctx, const char* filename,
+        fxfer_done_cb done_cb, void *done_arg) {
+    ctx_lock(ctx);
+    uint32_t req_id = file_hash_start(ctx, filename, done_cb, done_arg);
+    ctx_unlock(ctx);
+    return req_id;
 }
 
-bool request_files_list() {
-    /* Form FXFER_PACK_FILES_LIST_REQ */
-    fill_preamble();
-    fill_msg_id(FXFER_PACK_FILES_LIST_REQ);
-    fill_len(0);
-    fill_msg_crc();
+uint32_t send_file_async(struct fxfer_ctx *ctx, const char* filename,
+        fxfer_done_cb done_cb, void *done_arg) {
+    ctx_lock(ctx);
+    uint32_t req_id = file_send_start(ctx, filename, new_req_id(ctx), done_cb, done_arg);
+    ctx_unlock(ctx);
+    return req_id;
+}
+
+uint32_t send_file_delta_async(struct fxfer_ctx *ctx, const char* filename,
+        struct fxfer_delta_sig *sigs, uint32_t sigs_max, fxfer_done_cb done_cb, void *done_arg) {
+    ctx_lock(ctx);
+    uint32_t req_id = file_delta_start(ctx, filename, sigs, sigs_max, done_cb, done_arg);
+    ctx_unlock(ctx);
+    return req_id;
+}
+
+uint32_t request_file_tree_async(struct fxfer_ctx *ctx, const char* filename, uint8_t level,
+        uint32_t first_node, struct fxfer_tree_nodes *nodes, fxfer_done_cb done_cb, void *done_arg) {
+    ctx_lock(ctx);
+    uint32_t req_id = file_tree_start(ctx, filename, level, first_node, nodes, done_cb, done_arg);
+    ctx_unlock(ctx);
+    return req_id;
+}
+
+static uint32_t handshake_start(struct fxfer_ctx *ctx, uint32_t window_size,
+        fxfer_done_cb done_cb, void *done_arg) {
+    struct file_xfer_channel *ch = chan_alloc(ctx);
+    if (ch == NULL) {
+        return 0;
+    }
+
+    ctx->adapt.rx_winsize_sent = window_size;
+    fill_handshake_req(ctx, ch, window_size);
 
     /* Switch session state */
-    fxfer_status.session_state = FXFER_SSTATE_WAIT_FILESLIST;
-    fxfer_status.last_error = FXFER_NO_ERROR;
+    if (request_start(ctx, ch, FXFER_SSTATE_WAIT_HANDSHAKE, new_req_id(ctx), done_cb, done_arg) != true) {
+        return 0;
+    }
 
     /* Send message */
-    send_msg();
-
-    /* Wait cycle with short sleep */
-    uint32_t start_tick = platform_get_tick();
-    bool timeout_flag = false;
-    while (fxfer_status.session_state == FXFER_SSTATE_WAIT_FILESLIST) {
-        if (platform_get_tick() - start_tick >= FXFER_RESPONSE_TIMEOUT_TICKS) {
-            timeout_flag = true;
-            break;
-        }
-        platform_sleep(10);
-    }
+    send_msg(ctx);
+    return ch->request.id;
+}
 
-    /* Handle timeout */
-    if (timeout_flag == true) {
-        log_error("request_files_list() timeout\n");
-        fxfer_status.session_state = FXFER_SSTATE_IDLE;
-        fxfer_status.last_error = FXFER_NO_ERROR;
-        return false;
+static uint32_t files_list_start(struct fxfer_ctx *ctx, fxfer_done_cb done_cb, void *done_arg) {
+    struct file_xfer_channel *ch = chan_alloc(ctx);
+    if (ch == NULL) {
+        return 0;
     }
 
-    /* Handle possible errors */
-    if (fxfer_status.session_state == FXFER_SSTATE_ERR_RECEIVED) {
-        log_error("request_files_list() error: %u\n", fxfer_status.last_error);
-        fxfer_status.session_state = FXFER_SSTATE_IDLE;
-        fxfer_status.last_error = FXFER_NO_ERROR;
-        return false;
+    /* Form FXFER_PACK_FILES_LIST_REQ */
+    fill_preamble(ctx);
+    fill_msg_id(ctx, ch, FXFER_PACK_FILES_LIST_REQ);
+    fill_len(ctx, 0);
+    fill_msg_crc(ctx);
+
+    /* Switch session state */
+    if (request_start(ctx, ch, FXFER_SSTATE_WAIT_FILESLIST, new_req_id(ctx), done_cb, done_arg) != true) {
+        return 0;
     }
 
-    log_debug("Files list requested\n");
-    return true;
+    /* Send message */
+    send_msg(ctx);
+    return ch->request.id;
 }
 
-bool request_file_hash(const char* filename) {
+static uint32_t file_hash_start(struct fxfer_ctx *ctx, const char* filename,
+        fxfer_done_cb done_cb, void *done_arg) {
+    struct file_xfer_channel *ch = chan_alloc(ctx);
+    if (ch == NULL) {
+        return 0;
+    }
+
     /* Form FXFER_PACK_FILE_HASH_REQ */
-    fill_preamble();
-    fill_msg_id(FXFER_PACK_FILE_HASH_REQ);
-    uint16_t len = (uint16_t)strlen(filename);
-    fill_len(len + 1); //+1 to count \0
-    fill_payload((uint8_t *)filename, len + 1);
-    fill_msg_crc();
+    ch->request.file_name = filename;
+    fill_file_name_req(ctx, ch, FXFER_PACK_FILE_HASH_REQ, filename);
 
     /* Switch session state */
-    fxfer_status.session_state = FXFER_SSTATE_WAIT_FILEHASH;
-    fxfer_status.last_error = FXFER_NO_ERROR;
+    if (request_start(ctx, ch, FXFER_SSTATE_WAIT_FILEHASH, new_req_id(ctx), done_cb, done_arg) != true) {
+        return 0;
+    }
 
     /* Send message */
-    send_msg();
-
-    /* Wait cycle with short sleep */
-    uint32_t start_tick = platform_get_tick();
-    bool timeout_flag = false;
-    while (fxfer_status.session_state == FXFER_SSTATE_WAIT_FILEHASH) {
-        if (platform_get_tick() - start_tick >= FXFER_RESPONSE_TIMEOUT_TICKS) {
-            timeout_flag = true;
-            break;
-        }
-        platform_sleep(10);
+    send_msg(ctx);
+    return ch->request.id;
+}
+
+static uint32_t file_send_start(struct fxfer_ctx *ctx, const char* filename, uint32_t req_id,
+        fxfer_done_cb done_cb, void *done_arg) {
+    struct file_xfer_channel *ch = chan_alloc(ctx);
+    if (ch == NULL) {
+        return 0;
     }
+    struct file_xfer_tx_window *win = &ch->tx_win;
 
-    /* Handle timeout */
-    if (timeout_flag == true) {
-        log_error("request_file_hash() timeout\n");
-        fxfer_status.session_state = FXFER_SSTATE_IDLE;
-        fxfer_status.last_error = FXFER_NO_ERROR;
-        return false;
+    /* Get file size */
+    uint64_t file_size = 0;
+    bool res = ctx->callbacks->get_file_size_cb(ctx->user_data, filename, &file_size);
+    if (res != true) {
+        /* Get file size error */
+        log_error("Get size of file %s error\n", filename);
+        return 0;
     }
 
-    /* Handle possible errors */
-    if (fxfer_status.session_state == FXFER_SSTATE_ERR_RECEIVED) {
-        log_error("request_file_hash() error: %u\n", fxfer_status.last_error);
-        fxfer_status.session_state = FXFER_SSTATE_IDLE;
-        fxfer_status.last_error = FXFER_NO_ERROR;
-        return false;
+    log_debug("Size of file %s is %" PRIu64 " bytes\n", filename, file_size);
+
+    win->file_name = filename;
+    win->file_size = file_size;
+    win->start_offset = 0;
+    ctx->status.last_tx_chan = (uint8_t)(ch - ctx->chans);
+    win->seg_data_max = get_seg_payload_max(ctx, is_tx_zero_copy(ctx)) - get_data_hdr_len(ctx)
+            - get_seg_crc_len(ctx, 0);
+    win->file_hash = 0;
+    win->read_fill = 0;
+    win->delta.sigs = NULL;
+    if (file_open(ctx, filename, false, &win->open_flag) != true) {
+        return 0;
     }
 
-    log_debug("File hash requested\n");
-    return true;
+    /* Ask receiver for the part of file it already has, otherwise
+     * request file send procedure, segments are sent after the request is accepted */
+    enum file_xfer_session_states state = FXFER_SSTATE_WAIT_ACK;
+    if ((ctx->status.caps & FXFER_CAP_RESUME) != 0 && file_size > 0) {
+        fill_file_name_req(ctx, ch, FXFER_PACK_FILE_RESUME_REQ, filename);
+        state = FXFER_SSTATE_WAIT_FILERESUME;
+    } else if (fill_file_send_req(ctx, ch, get_seg_num(win)) != true) {
+        file_close(ctx, filename, false, &win->open_flag);
+        return 0;
+    }
+
+    /* Switch session state */
+    if (request_start(ctx, ch, state, req_id, done_cb, done_arg) != true) {
+        file_close(ctx, filename, false, &win->open_flag);
+        return 0;
+    }
+
+    /* Send message */
+    send_msg(ctx);
+    return ch->request.id;
 }
 
-bool send_file(const char* filename) {
-    /* Request file send procedure */
-    fill_preamble();
-    fill_msg_id(FXFER_PACK_FILE_SEND_REQ);
-    uint16_t len = (uint16_t)strlen(filename);
-    fill_len(len + 1); //+1 to count \0
-    fill_payload((uint8_t *)filename, len + 1);
-    fill_msg_crc();
+static uint32_t file_delta_start(struct fxfer_ctx *ctx, const char* filename,
+        struct fxfer_delta_sig *sigs, uint32_t sigs_max, fxfer_done_cb done_cb, void *done_arg) {
+    /* Delta encoder needs the whole file mapped and peer's support */
+    if ((ctx->status.caps & FXFER_CAP_DELTA) == 0 || ctx->callbacks->file_map_partial_cb == NULL
+            || sigs == NULL || sigs_max == 0) {
+        log_debug("Delta transfer isn't available, file %s is sent as is\n", filename);
+        return file_send_start(ctx, filename, new_req_id(ctx), done_cb, done_arg);
+    }
+
+    struct file_xfer_channel *ch = chan_alloc(ctx);
+    if (ch == NULL) {
+        return 0;
+    }
+    struct file_xfer_tx_window *win = &ch->tx_win;
+
+    /* Get file size and map the file */
+    uint64_t file_size = 0;
+    if (ctx->callbacks->get_file_size_cb(ctx->user_data, filename, &file_size) != true) {
+        log_error("Get size of file %s error\n", filename);
+        return 0;
+    }
+    if (file_size > UINT32_MAX) {
+        log_debug("File %s is too big for delta transfer, it's sent as is\n", filename);
+        return file_send_start(ctx, filename, new_req_id(ctx), done_cb, done_arg);
+    }
+    const uint8_t *data = NULL;
+    if (file_open(ctx, filename, false, &win->open_flag) != true) {
+        return 0;
+    }
+    if (file_size > 0 && ctx->callbacks->file_map_partial_cb(ctx->user_data, filename, 0,
+            (uint32_t)file_size, &data) != true) {
+        log_error("File %s map error\n", filename);
+        file_close(ctx, filename, false, &win->open_flag);
+        return 0;
+    }
+
+    /* Request signatures of receiver's file version, the file is sent after all of them */
+    win->file_name = filename;
+    win->file_size = file_size;
+    win->start_offset = 0;
+    win->file_hash = 0;
+    ctx->status.last_tx_chan = (uint8_t)(ch - ctx->chans);
+    win->delta.data = data;
+    win->delta.sigs = sigs;
+    win->delta.sigs_max = sigs_max;
+    win->delta.sig_num = 0;
+    win->delta.block_size = 0;
+    fill_file_sigs_req(ctx, ch);
 
     /* Switch session state */
-    fxfer_status.session_state = FXFER_SSTATE_WAIT_ACK;
-    fxfer_status.last_error = FXFER_NO_ERROR;
+    if (request_start(ctx, ch, FXFER_SSTATE_WAIT_FILESIGS, new_req_id(ctx), done_cb, done_arg) != true) {
+        file_close(ctx, filename, false, &win->open_flag);
+        return 0;
+    }
 
     /* Send message */
-    send_msg();
-
-    /* Wait cycle with short sleep */
-    uint32_t start_tick = platform_get_tick();
-    bool timeout_flag = false;
-    while (fxfer_status.session_state == FXFER_SSTATE_WAIT_ACK) {
-        if (platform_get_tick() - start_tick >= FXFER_RESPONSE_TIMEOUT_TICKS) {
-            timeout_flag = true;
-            break;
-        }
-        platform_sleep(10);
+    send_msg(ctx);
+    return ch->request.id;
+}
+
+static uint32_t file_tree_start(struct fxfer_ctx *ctx, const char* filename, uint8_t level,
+        uint32_t first_node, struct fxfer_tree_nodes *nodes, fxfer_done_cb done_cb, void *done_arg) {
+    if ((ctx->status.caps & FXFER_CAP_HASH_TREE) == 0 || nodes == NULL || nodes->hashes == NULL
+            || nodes->hashes_max == 0 || level > FXFER_TREE_LEVEL_MAX) {
+        log_error("Hash tree of file %s can't be requested\n", filename);
+        return 0;
     }
 
-    /* Handle timeout */
-    if (timeout_flag == true) {
-        log_error("Request file send timeout\n");
-        fxfer_status.session_state = FXFER_SSTATE_IDLE;
-        fxfer_status.last_error = FXFER_NO_ERROR;
-        return false;
+    struct file_xfer_channel *ch = chan_alloc(ctx);
+    if (ch == NULL) {
+        return 0;
     }
 
-    /* Handle possible errors */
-    if (fxfer_status.session_state == FXFER_SSTATE_ERR_RECEIVED) {
-        log_error("Request file send error: %u\n", fxfer_status.last_error);
-        fxfer_status.session_state = FXFER_SSTATE_IDLE;
-        fxfer_status.last_error = FXFER_NO_ERROR;
-        return false;
+    /* Form FXFER_PACK_FILE_TREE_REQ */
+    ch->request.file_name = filename;
+    ch->tree.nodes = nodes;
+    ch->tree.level = level;
+    ch->tree.first_node = first_node;
+    nodes->node_num = 0;
+    fill_file_tree_req(ctx, ch);
+
+    /* Switch session state */
+    if (request_start(ctx, ch, FXFER_SSTATE_WAIT_FILETREE, new_req_id(ctx), done_cb, done_arg) != true) {
+        return 0;
     }
 
-    log_debug("File send request accepted, start sending the file\n");
+    /* Send message */
+    send_msg(ctx);
+    return ch->request.id;
+}
 
-    /* Get file size */
-    uint32_t file_size = 0;
-    bool res = get_file_size_cb(filename, &file_size);
-    if (res != true) {
-        /* Get file size error */
+bool fxfer_file_tree_hash(struct fxfer_ctx *ctx, const char* filename, uint8_t level,
+        uint32_t first_node, uint32_t node_num, uint64_t *hashes) {
+    uint8_t buf[FXFER_TREE_READ_SIZE];
+    uint64_t file_size = 0;
+    if (level > FXFER_TREE_LEVEL_MAX
+            || ctx->callbacks->get_file_size_cb(ctx->user_data, filename, &file_size) != true) {
         log_error("Get size of file %s error\n", filename);
-        fxfer_status.session_state = FXFER_SSTATE_IDLE;
         return false;
     }
-
-    log_debug("Size of file %s is %u bytes\n", filename, file_size);
-
-    /* Calc segments number for file */
-    uint16_t seg_num = file_size % (fxfer_status.respondent_winsize - 2) > 0
-                    ? (file_size / (fxfer_status.respondent_winsize - 2)) + 1
-                    : file_size / (fxfer_status.respondent_winsize - 2);
-    uint16_t current_seg_ind = seg_num - 1;
-    uint16_t current_offset = 0;
-    log_debug("Segments total: %u, the first seg_ind: %u\n", seg_num, current_seg_ind);
-
-    for (uint16_t i = 0; i < seg_num; i++) {
-        /* Calculate current chunc size */
-        uint16_t current_chunc_size = current_seg_ind > 0 ? fxfer_status.respondent_winsize - 2
-                : file_size % (fxfer_status.respondent_winsize - 2);
-
-        /* Form data packet */
-        fill_preamble();
-        fill_msg_id(FXFER_PACK_FILE_DATA);
-        fill_len(sizeof(uint16_t) + current_chunc_size); //seg_ind + seg_data
-        write_uint16_le(current_seg_ind, &tx_buf[FXFER_PACK_PAYLOAD_IND]);
-        if (file_read_partial_cb(filename, current_offset, current_chunc_size,
-                &tx_buf[sizeof(uint16_t) + FXFER_PACK_PAYLOAD_IND]) != true) {
-            /* Platform error */
-            log_error("File read partial error. Filename: %s, total size: %u, "
-                    "offset: %u, chunk size: %u\n",
-                    filename, file_size, current_offset, current_chunc_size);
-            fxfer_status.session_state = FXFER_SSTATE_IDLE;
+    uint64_t nodes_total = tree_level_nodes(file_size, FXFER_TREE_BLOCK_SIZE, level);
+    if ((uint64_t)first_node + node_num > nodes_total) {
+        log_error("Level %u of hash tree of file %s has %" PRIu64 " nodes only\n",
+                level, filename, nodes_total);
+        return false;
+    }
+    for (uint32_t i = 0; i < node_num; i++) {
+        if (tree_node_hash(ctx, filename, file_size, FXFER_TREE_BLOCK_SIZE, level,
+                (uint64_t)first_node + i, buf, &hashes[i]) != true) {
             return false;
         }
-        fxfer_status.tx_buf_fill_size += sizeof(uint16_t) + current_chunc_size;
-        fill_msg_crc();
+    }
+    return true;
+}
 
-        /* Switch session state */
-        fxfer_status.session_state = FXFER_SSTATE_WAIT_ACK;
-        fxfer_status.last_error = FXFER_NO_ERROR;
+uint32_t fxfer_get_compress_ratio(struct fxfer_ctx *ctx) {
+    struct file_xfer_tx_window *win = &ctx->chans[ctx->status.last_tx_chan].tx_win;
+    if (win->payload_bytes == 0) {
+        return 100;
+    }
+    return (uint32_t)(win->data_bytes * 100 / win->payload_bytes);
+}
 
-        /* Send message */
-        send_msg();
+uint32_t fxfer_queue_file(struct fxfer_ctx *ctx, const char* filename, enum file_xfer_prio prio,
+        uint8_t weight, fxfer_done_cb done_cb, void *done_arg) {
+    if (prio >= FXFER_PRIO_NUM) {
+        log_error("Wrong priority class %u\n", prio);
+        return 0;
+    }
 
-        /* Wait for ACK */
-        /* Wait cycle with short sleep */
-        uint32_t start_tick = platform_get_tick();
-        bool timeout_flag = false;
-        while (fxfer_status.session_state == FXFER_SSTATE_WAIT_ACK) {
-            if (platform_get_tick() - start_tick >= FXFER_RESPONSE_TIMEOUT_TICKS) {
-                timeout_flag = true;
-                break;
-            }
-            platform_sleep(1);
+    ctx_lock(ctx);
+    struct file_xfer_job *job = NULL;
+    for (uint8_t i = 0; i < FXFER_QUEUE_LEN && job == NULL; i++) {
+        if (ctx->queue[i].used_flag != true) {
+            job = &ctx->queue[i];
         }
+    }
+    if (job == NULL) {
+        log_error("Transfer queue is full, file %s isn't queued\n", filename);
+        ctx_unlock(ctx);
+        return 0;
+    }
 
-        /* Handle timeout */
-        if (timeout_flag == true) {
-            log_error("ACK wait timeout\n");
-            fxfer_status.session_state = FXFER_SSTATE_IDLE;
-            fxfer_status.last_error = FXFER_NO_ERROR;
-            return false;
+    job->id = new_req_id(ctx);
+    job->used_flag = true;
+    job->seq = ctx->status.queue_seq++;
+    job->file_name = filename;
+    job->prio = prio;
+    job->weight = weight > 0 ? weight : 1;
+    job->enqueue_tick = ctx->platform->get_tick(ctx->user_data);
+    job->done_cb = done_cb;
+    job->done_arg = done_arg;
+
+    struct fxfer_queue_stat *stat = &ctx->queue_stat;
+    stat->depth++;
+    if (stat->depth > stat->depth_max) {
+        stat->depth_max = stat->depth;
+    }
+    log_debug("File %s is queued with priority %u, queue depth %u\n", filename, prio, stat->depth);
+
+    uint32_t req_id = job->id;
+    queue_dispatch(ctx);
+    ctx_unlock(ctx);
+    return req_id;
+}
+
+void fxfer_get_queue_stat(struct fxfer_ctx *ctx, struct fxfer_queue_stat *stat) {
+    ctx_lock(ctx);
+    *stat = ctx->queue_stat;
+    ctx_unlock(ctx);
+}
+
+void fxfer_set_rate_limit(struct fxfer_ctx *ctx, uint32_t rate, uint32_t burst) {
+    ctx_lock(ctx);
+    fxfer_rate_limit_set(&ctx->rate_limit, rate, burst);
+    tx_schedule(ctx);
+    ctx_unlock(ctx);
+}
+
+void fxfer_set_link_limit(struct fxfer_ctx *ctx, struct fxfer_rate_limit *link) {
+    ctx_lock(ctx);
+    ctx->link_limit = link;
+    tx_schedule(ctx);
+    ctx_unlock(ctx);
+}
+
+void fxfer_set_adaptive_window(struct fxfer_ctx *ctx, bool enable) {
+    ctx_lock(ctx);
+    struct file_xfer_adapt *adapt = &ctx->adapt;
+    if (enable == true && adapt->enabled_flag != true) {
+        /* Windows start from the negotiated ones */
+        ctx->link_stat.tx_winsize = ctx->status.respondent_winsize > 0
+                ? ctx->status.respondent_winsize : FXFER_DEFAULT_WINDOW_SIZE;
+        if (adapt->rx_winsize_max == 0) {
+            adapt->rx_winsize_max = get_rx_window(ctx);
+            adapt->rx_winsize_sent = adapt->rx_winsize_max;
         }
+        ctx->link_stat.rx_winsize = adapt->rx_winsize_sent;
+        adapt->tx_segs = 0;
+        adapt->tx_errors = 0;
+        adapt->rx_packs = 0;
+        adapt->rx_errors = 0;
+    }
+    adapt->enabled_flag = enable;
+    ctx_unlock(ctx);
+}
 
-        /* Handle possible errors */
-        if (fxfer_status.session_state == FXFER_SSTATE_ERR_RECEIVED) {
-            log_error("File send error: %u\n", fxfer_status.last_error);
-            fxfer_status.session_state = FXFER_SSTATE_IDLE;
-            fxfer_status.last_error = FXFER_NO_ERROR;
-            return false;
+void fxfer_get_link_stat(struct fxfer_ctx *ctx, struct fxfer_link_stat *stat) {
+    ctx_lock(ctx);
+    *stat = ctx->link_stat;
+    ctx_unlock(ctx);
+}
+
+uint32_t fxfer_get_throughput(struct fxfer_ctx *ctx) {
+    ctx_lock(ctx);
+    uint32_t throughput = rate_limit_throughput(&ctx->rate_limit,
+            ctx->platform->get_tick(ctx->user_data));
+    ctx_unlock(ctx);
+    return throughput;
+}
+
+void fxfer_poll(struct fxfer_ctx *ctx) {
+    /* Handle timeouts of requests of all the channels, requests are sent again
+     * until retries are exhausted */
+    ctx_lock(ctx);
+    uint32_t tick = ctx->platform->get_tick(ctx->user_data);
+    for (uint8_t i = 0; i < 2 * FXFER_CHANNELS_NUM; i++) {
+        struct file_xfer_channel *ch = &ctx->chans[i];
+        struct file_xfer_request *req = &ch->request;
+        if (req->active_flag == true && tick - req->start_tick >= request_rto(ctx, req->retries)) {
+            log_debug("Request %u timeout, retries: %u\n", req->id, req->retries);
+            ctx->link_stat.timeouts++;
+            adapt_tx_update(ctx, true);
+            request_retransmit(ctx, ch, FXFER_ERR_TIMEOUT);
         }
 
-        log_debug("Sent seg_in: %u, with offset %u\n", current_seg_ind, current_offset);
-        current_seg_ind--;
-        current_offset += current_chunc_size;
+        /* File which sender is gone isn't kept open, the next segment opens it again */
+        if (ch->rx_win.open_flag == true && tick - ch->rx_win.rx_tick >= FXFER_RX_IDLE_TICKS) {
+            log_debug("No segments of file %s for %u ticks, it's closed\n", ch->file_name_temp,
+                    tick - ch->rx_win.rx_tick);
+            rx_write_interrupt(ctx, ch);
+        }
     }
+    queue_dispatch(ctx);
+    adapt_renegotiate(ctx);
 
-    fxfer_status.session_state = FXFER_SSTATE_IDLE;
-    log_debug("File %s, with size %u bytes sent successfully\n", filename, file_size);
-    return true;
+    /* Send segments which waited for rate limiter tokens */
+    tx_schedule(ctx);
+    ctx_unlock(ctx);
 }
 
-/* Message handlers */
-static void handshake_req_handler(void* arg) {
-    uint16_t win_size = get_uint16_by_ptr(arg);
-    log_debug("Handshake request received, with window size: %u\n", win_size);
+/* Blocking requests, wait for completion of the corresponding async request */
+bool make_handshake(struct fxfer_ctx *ctx, uint32_t window_size) {
+    struct file_xfer_wait wait = { false, FXFER_NO_ERROR };
+    uint32_t req_id = make_handshake_async(ctx, window_size, request_wait_done, &wait);
+    return request_wait(ctx, req_id, &wait, "make_handshake()");
+}
 
-    /* Save handshake result */
-    fxfer_status.respondent_winsize = win_size;
-    fxfer_status.handshake_done_flag = true;
+bool request_files_list(struct fxfer_ctx *ctx) {
+    struct file_xfer_wait wait = { false, FXFER_NO_ERROR };
+    uint32_t req_id = request_files_list_async(ctx, request_wait_done, &wait);
+    return request_wait(ctx, req_id, &wait, "request_files_list()");
+}
 
-    /* Respond with FXFER_PACK_HANDSHAKE_RES */
-    fill_preamble();
-    fill_msg_id(FXFER_PACK_HANDSHAKE_RES);
-    fill_len(sizeof(uint16_t));
-    uint16_t window_size = FXFER_DEFAULT_WINDOW_SIZE;
-    fill_payload((uint8_t *)&window_size, sizeof(uint16_t));
-    fill_msg_crc();
-    send_msg();
-    log_debug("Handshake response sent, with window size: %u\n", window_size);
+bool request_file_hash(struct fxfer_ctx *ctx, const char* filename) {
+    struct file_xfer_wait wait = { false, FXFER_NO_ERROR };
+    uint32_t req_id = request_file_hash_async(ctx, filename, request_wait_done, &wait);
+    return request_wait(ctx, req_id, &wait, "request_file_hash()");
 }
 
-static void handshake_res_handler(void* arg) {
-    uint16_t win_size = get_uint16_by_ptr(arg);
-    log_debug("Handshake response received, with window size: %u\n", win_size);
-    if (fxfer_status.session_state == FXFER_SSTATE_WAIT_HANDSHAKE) {
-        fxfer_status.respondent_winsize = win_size;
-        fxfer_status.handshake_done_flag = true;
-        fxfer_status.session_state = FXFER_SSTATE_IDLE;
-    } else {
-        log_error("Packet wasn't awaited\n");
-        report_nack(FXFER_NACK_ERR_UNEXPECTED_PACKET);
+bool send_file(struct fxfer_ctx *ctx, const char* filename) {
+    struct file_xfer_wait wait = { false, FXFER_NO_ERROR };
+    uint32_t req_id = send_file_async(ctx, filename, request_wait_done, &wait);
+    return request_wait(ctx, req_id, &wait, "send_file()");
+}
+
+bool send_file_delta(struct fxfer_ctx *ctx, const char* filename,
+        struct fxfer_delta_sig *sigs, uint32_t sigs_max) {
+    struct file_xfer_wait wait = { false, FXFER_NO_ERROR };
+    uint32_t req_id = send_file_delta_async(ctx, filename, sigs, sigs_max, request_wait_done, &wait);
+    return request_wait(ctx, req_id, &wait, "send_file_delta()");
+}
+
+bool request_file_tree(struct fxfer_ctx *ctx, const char* filename, uint8_t level,
+        uint32_t first_node, struct fxfer_tree_nodes *nodes) {
+    struct file_xfer_wait wait = { false, FXFER_NO_ERROR };
+    uint32_t req_id = request_file_tree_async(ctx, filename, level, first_node, nodes,
+            request_wait_done, &wait);
+    return request_wait(ctx, req_id, &wait, "request_file_tree()");
+}
+
+/* Request id 0 is reserved for errors */
+static uint32_t new_req_id(struct fxfer_ctx *ctx) {
+    ctx->status.last_req_id++;
+    if (ctx->status.last_req_id == 0) {
+        ctx->status.last_req_id++;
     }
+    return ctx->status.last_req_id;
 }
 
-static void files_list_req_handler(void* arg) {
-    log_debug("Files list request received\n");
+static bool request_start(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, enum file_xfer_session_states state,
+        uint32_t req_id, fxfer_done_cb done_cb, void *done_arg) {
+    struct file_xfer_request *req = &ch->request;
+    if (req->active_flag == true) {
+        log_error("Request %u is in progress\n", req->id);
+        return false;
+    }
 
-    /* Check if handshake wasn't yet */
-    if (fxfer_status.handshake_done_flag == false) {
-        log_error("There was no handshake yet\n");
-        report_nack(FXFER_NACK_ERR_NO_HANDSHAKE);
+    req->id = req_id;
+    req->done_cb = done_cb;
+    req->done_arg = done_arg;
+    req->result = FXFER_NO_ERROR;
+    req->start_tick = ctx->platform->get_tick(ctx->user_data);
+    req->retries = 0;
+    req->active_flag = true;
+
+    ch->session_state = state;
+    ch->last_error = FXFER_NO_ERROR;
+    ch->prio = FXFER_PRIO_NORMAL;
+    ch->weight = 1;
+    ch->deficit = 0;
+    return true;
+}
+
+static void request_complete(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, enum file_xfer_err_states err) {
+    struct file_xfer_request *req = &ch->request;
+    if (req->active_flag != true) {
         return;
     }
 
-    /* Respond with FXFER_PACK_FILES_LIST_RES */
-    fill_preamble();
-    fill_msg_id(FXFER_PACK_FILES_LIST_RES);
+    ch->session_state = FXFER_SSTATE_IDLE;
+    ch->last_error = err;
+    req->result = err;
+    req->active_flag = false;
+    log_debug("Request %u completed with result: %u\n", req->id, err);
+    file_close(ctx, ch->tx_win.file_name, false, &ch->tx_win.open_flag);
 
-    uint16_t free_space_in_tx_buf = FXFER_TX_BUF_SIZE - FXFER_PACK_PREAM_FIELD_LEN
-            - FXFER_PACK_MSGID_FIELD_LEN - FXFER_PACK_LEN_FIELD_LEN
-            - FXFER_PACK_CRC_FIELD_LEN;
-    uint16_t free_space = fxfer_status.respondent_winsize > free_space_in_tx_buf
-            ? free_space_in_tx_buf : fxfer_status.respondent_winsize;
-    uint8_t *payload_ptr = &tx_buf[FXFER_PACK_PAYLOAD_IND];
-    uint16_t payload_len;
+    if (req->done_cb != NULL) {
+        req->done_cb(ctx, req->id, err, req->done_arg);
+    }
+    if (ctx->platform->notify != NULL) {
+        ctx->platform->notify(ctx->user_data);
+    }
 
-    form_files_list_cb(payload_ptr, free_space, &payload_len);
-    fxfer_status.tx_buf_fill_size += payload_len;
+    /* The channel is free, start the next queued file send */
+    queue_dispatch(ctx);
+}
 
-    fill_len(payload_len);
-    fill_msg_crc();
-    send_msg();
-    log_debug("Files list response sent\n");
+/* Retransmission timeout as in TCP (RFC 6298): initial one until RTT is measured,
+ * then smoothed RTT + 4 * RTT variation, doubled for every retry */
+static uint32_t request_rto(struct fxfer_ctx *ctx, uint8_t retries) {
+    struct fxfer_link_stat *stat = &ctx->link_stat;
+    uint32_t rto = FXFER_RESPONSE_TIMEOUT_TICKS;
+    if (ctx->adapt.rtt_samples > 0) {
+        rto = stat->srtt + (stat->rttvar > 0 ? 4 * stat->rttvar : 1);
+    }
+    if (rto < FXFER_RTO_MIN_TICKS) {
+        rto = FXFER_RTO_MIN_TICKS;
+    }
+    for (uint8_t i = 0; i < retries && rto < FXFER_RTO_MAX_TICKS; i++) {
+        rto *= 2;
+    }
+    return rto < FXFER_RTO_MAX_TICKS ? rto : FXFER_RTO_MAX_TICKS;
 }
 
-static void files_list_res_handler(void* arg) {
-    /* Get file numbers and filenames array */
-    uint8_t *payload = (uint8_t *)arg;
-    uint8_t files_num = payload[0];
-    uint8_t *filenames_arr = &payload[1];
-    log_debug("Files list response received, with files num: %u\n", files_num);
-    if (fxfer_status.session_state == FXFER_SSTATE_WAIT_FILESLIST) {
-        fxfer_status.session_state = FXFER_SSTATE_IDLE;
-        files_list_gotten_cb(files_num, filenames_arr);
+/* Smoothed RTT and its variation as in TCP (RFC 6298) */
+static void link_rtt_sample(struct fxfer_ctx *ctx, uint32_t rtt) {
+    struct fxfer_link_stat *stat = &ctx->link_stat;
+    if (ctx->adapt.rtt_samples == 0) {
+        stat->srtt = rtt;
+        stat->rttvar = rtt / 2;
+        stat->rtt_min = rtt;
     } else {
-        log_error("Packet wasn't awaited\n");
-        report_nack(FXFER_NACK_ERR_UNEXPECTED_PACKET);
+        uint32_t delta = stat->srtt > rtt ? stat->srtt - rtt : rtt - stat->srtt;
+        stat->rttvar = (3 * stat->rttvar + delta) / 4;
+        stat->srtt = (7 * stat->srtt + rtt) / 8;
+        if (rtt < stat->rtt_min) {
+            stat->rtt_min = rtt;
+        }
     }
+    ctx->adapt.rtt_samples++;
 }
 
-static void file_hash_req_handler(void* arg) {
+/* Window is halved if more than 1/16 of packets of the epoch were broken,
+ * and grown by a quarter if not more than 1/64 were */
+static uint32_t adapt_window(uint32_t winsize, uint32_t winsize_max, uint32_t packs,
+        uint32_t errors, bool grow_flag) {
+    if (winsize > winsize_max) {
+        winsize = winsize_max;
+    }
+    if (errors * 16 > packs) {
+        winsize /= 2;
+    } else if (errors * 64 <= packs && grow_flag == true) {
+        winsize = winsize_max - winsize > winsize / 4 ? winsize + winsize / 4 : winsize_max;
+    }
+    return winsize < FXFER_ADAPT_WINDOW_MIN ? FXFER_ADAPT_WINDOW_MIN : winsize;
+}
+
+/* Tx window is reduced at once on timeout, otherwise it's checked every epoch.
+ * It isn't grown while RTT is much more than the least one, the link is loaded */
+static void adapt_tx_update(struct fxfer_ctx *ctx, bool timeout_flag) {
+    struct file_xfer_adapt *adapt = &ctx->adapt;
+    struct fxfer_link_stat *stat = &ctx->link_stat;
+    if (adapt->enabled_flag != true || (timeout_flag != true
+            && adapt->tx_segs + adapt->tx_errors < FXFER_ADAPT_EPOCH_PACKS)) {
+        return;
+    }
+
+    uint32_t prev_winsize = stat->tx_winsize;
+    bool grow_flag = stat->srtt <= 2 * stat->rtt_min + 1;
+    stat->tx_winsize = adapt_window(stat->tx_winsize, ctx->status.respondent_winsize,
+            adapt->tx_segs, timeout_flag == true ? adapt->tx_segs + 1 : adapt->tx_errors, grow_flag);
+    if (stat->tx_winsize != prev_winsize) {
+        log_debug("Adaptive tx window: %u, srtt: %u, errors: %u of %u\n", stat->tx_winsize,
+                stat->srtt, adapt->tx_errors, adapt->tx_segs);
+    }
+    adapt->tx_segs = 0;
+    adapt->tx_errors = 0;
+}
+
+static void adapt_rx_update(struct fxfer_ctx *ctx) {
+    struct file_xfer_adapt *adapt = &ctx->adapt;
+    struct fxfer_link_stat *stat = &ctx->link_stat;
+    if (adapt->enabled_flag != true || adapt->rx_packs + adapt->rx_errors < FXFER_ADAPT_EPOCH_PACKS) {
+        return;
+    }
+
+    uint32_t prev_winsize = stat->rx_winsize;
+    stat->rx_winsize = adapt_window(stat->rx_winsize, adapt->rx_winsize_max,
+            adapt->rx_packs + adapt->rx_errors, adapt->rx_errors, true);
+    if (stat->rx_winsize != prev_winsize) {
+        log_debug("Adaptive rx window: %u, errors: %u of %u\n", stat->rx_winsize,
+                adapt->rx_errors, adapt->rx_packs + adapt->rx_errors);
+    }
+    adapt->rx_packs = 0;
+    adapt->rx_errors = 0;
+}
+
+/* Gives the new rx window to the peer by handshake, when this device has no requests
+ * in progress, so handshake that is sent again doesn't hold channel application needs */
+static void adapt_renegotiate(struct fxfer_ctx *ctx) {
+    if (ctx->adapt.enabled_flag != true || ctx->status.handshake_done_flag != true
+            || ctx->link_stat.rx_winsize == ctx->adapt.rx_winsize_sent) {
+        return;
+    }
+    for (uint8_t i = 0; i < 2 * FXFER_CHANNELS_NUM; i++) {
+        if (ctx->chans[i].session_state == FXFER_SSTATE_WAIT_HANDSHAKE) {
+            return;
+        }
+    }
+    for (uint8_t i = 0; i < ctx->status.chans_num; i++) {
+        struct file_xfer_channel *ch = get_chan(ctx,
+                (uint8_t)(ctx->status.chan_side << FXFER_CHAN_SIDE_SHIFT) | i);
+        if (ch->request.active_flag == true) {
+            return;
+        }
+    }
+    log_debug("Window is renegotiated: %u\n", ctx->link_stat.rx_winsize);
+    handshake_start(ctx, ctx->link_stat.rx_winsize, NULL, NULL);
+}
+
+/* Sends the request of the current stage again, FILE_DATA segments which aren't
+ * ACKed while file sending. The request fails with err when retries are exhausted */
+static void request_retransmit(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, enum file_xfer_err_states err) {
+    struct file_xfer_request *req = &ch->request;
+    if (req->retries >= FXFER_RETRIES_MAX) {
+        log_error("Request %u failed after %u retries\n", req->id, req->retries);
+        request_complete(ctx, ch, err);
+        return;
+    }
+    req->retries++;
+    req->start_tick = ctx->platform->get_tick(ctx->user_data);
+
+    struct file_xfer_tx_window *win = &ch->tx_win;
+    switch (ch->session_state) {
+    case FXFER_SSTATE_WAIT_HANDSHAKE:
+        fill_handshake_req(ctx, ch, ctx->adapt.rx_winsize_sent);
+        break;
+    case FXFER_SSTATE_WAIT_FILESLIST:
+        fill_preamble(ctx);
+        fill_msg_id(ctx, ch, FXFER_PACK_FILES_LIST_REQ);
+        fill_len(ctx, 0);
+        fill_msg_crc(ctx);
+        break;
+    case FXFER_SSTATE_WAIT_FILEHASH:
+        fill_file_name_req(ctx, ch, FXFER_PACK_FILE_HASH_REQ, req->file_name);
+        break;
+    case FXFER_SSTATE_WAIT_FILERESUME:
+        fill_file_name_req(ctx, ch, FXFER_PACK_FILE_RESUME_REQ, win->file_name);
+        break;
+    case FXFER_SSTATE_WAIT_FILESIGS:
+        fill_file_sigs_req(ctx, ch);
+        break;
+    case FXFER_SSTATE_WAIT_FILETREE:
+        fill_file_tree_req(ctx, ch);
+        break;
+    case FXFER_SSTATE_WAIT_ACK:
+        if (fill_file_send_req(ctx, ch, win->seg_num) != true) {
+            request_complete(ctx, ch, FXFER_ERR_BAD_REQUEST);
+            return;
+        }
+        break;
+    case FXFER_SSTATE_WAIT_FILESEND_ACK:
+        win->retransmit_flag = true;
+        tx_window_pump(ctx, ch);
+        return;
+    default:
+        request_complete(ctx, ch, err);
+        return;
+    }
+    log_debug("Request %u is sent again\n", req->id);
+    send_msg(ctx);
+}
+
+/* Wait cycle with short sleep, the parser runs in another thread */
+static void request_wait_done(struct fxfer_ctx *ctx, uint32_t req_id, enum file_xfer_err_states err, void *arg) {
+    struct file_xfer_wait *wait = (struct file_xfer_wait *)arg;
+    wait->result = err;
+    wait->done_flag = true;
+}
+
+static bool request_wait(struct fxfer_ctx *ctx, uint32_t req_id, struct file_xfer_wait *wait,
+        const char *req_name) {
+    if (req_id == 0) {
+        return false;
+    }
+
+    /* The result is written by the parser thread with the lock taken */
+    ctx_lock(ctx);
+    while (wait->done_flag != true) {
+        ctx_unlock(ctx);
+        fxfer_poll(ctx);
+        ctx->platform->sleep(ctx->user_data, 1);
+        ctx_lock(ctx);
+    }
+    enum file_xfer_err_states err = wait->result;
+    ctx_unlock(ctx);
+
+    /* Handle timeout and possible errors */
+    if (err == FXFER_ERR_TIMEOUT) {
+        log_error("%s timeout\n", req_name);
+        return false;
+    } else if (err != FXFER_NO_ERROR) {
+        log_error("%s error: %u\n", req_name, err);
+        return false;
+    }
+
+    log_debug("%s done\n", req_name);
+    return true;
+}
+
+/* File send request is accepted, start sending the file */
+static void tx_window_start(struct fxfer_ctx *ctx, struct file_xfer_channel *ch) {
+    struct file_xfer_tx_window *win = &ch->tx_win;
+    log_debug("File send request accepted, start sending the file\n");
+
+    /* Reset sliding window, segments are ACKed by receiver selectively
+     * and cumulatively, so up to segs_in_flight segments are on the wire */
+    win->next_seq = 0;
+    win->acked_num = 0;
+    win->sacked_mask = 0;
+    win->dup_ack_cnt = 0;
+    win->retransmit_flag = false;
+    win->resend_seq = 0;
+    win->timed_mask = 0;
+    win->fec_len = 0;
+    memset(win->fec_parity, 0, sizeof(win->fec_parity));
+    win->data_bytes = 0;
+    win->payload_bytes = 0;
+    ch->session_state = FXFER_SSTATE_WAIT_FILESEND_ACK;
+    tx_window_pump(ctx, ch);
+}
+
+/* Sends segments which are allowed by window, completes the request if all are ACKed */
+static void tx_window_pump(struct fxfer_ctx *ctx, struct file_xfer_channel *ch) {
+    struct file_xfer_tx_window *win = &ch->tx_win;
+
+    if (win->acked_num == win->seg_num) {
+        log_debug("File %s, with size %" PRIu64 " bytes sent successfully, "
+                "compress ratio: %u%%\n", win->file_name, win->file_size,
+                fxfer_get_compress_ratio(ctx));
+        request_complete(ctx, ch, FXFER_NO_ERROR);
+        return;
+    }
+
+    /* Resend segments which weren't ACKed yet, if receiver reported an error */
+    if (win->retransmit_flag == true) {
+        win->retransmit_flag = false;
+        for (uint32_t seq = win->acked_num; seq < win->next_seq; seq++) {
+            if (seq - win->acked_num < 32
+                    && (win->sacked_mask & (1UL << (seq - win->acked_num))) != 0) {
+                continue;
+            }
+            log_debug("Resend seg_ind: %" PRIu32 "\n", win->seg_num - 1 - seq);
+            win->timed_mask &= ~(1UL << (seq % FXFER_MAX_SEGS_IN_FLIGHT));
+            if (send_file_segment(ctx, ch, seq) != true) {
+                request_complete(ctx, ch, FXFER_ERR_PLATFORM);
+                return;
+            }
+        }
+    }
+
+    /* Fill the windows of this and other file sends */
+    tx_schedule(ctx);
+}
+
+/* NACK reports one broken packet, so one segment that isn't ACKed is resent,
+ * the next NACK resends the next one. Resending the whole window on every NACK
+ * floods noisy link with duplicates */
+static bool tx_window_resend_one(struct fxfer_ctx *ctx, struct file_xfer_channel *ch) {
+    struct file_xfer_tx_window *win = &ch->tx_win;
+    uint32_t in_flight = win->next_seq - win->acked_num;
+    uint32_t start = win->resend_seq > win->acked_num && win->resend_seq < win->next_seq
+            ? win->resend_seq - win->acked_num : 0;
+    for (uint32_t i = 0; i < in_flight; i++) {
+        uint32_t seq = win->acked_num + (start + i) % in_flight;
+        if (seq - win->acked_num < 32 && (win->sacked_mask & (1UL << (seq - win->acked_num))) != 0) {
+            continue;
+        }
+        log_debug("Resend seg_ind: %" PRIu32 "\n", win->seg_num - 1 - seq);
+        win->timed_mask &= ~(1UL << (seq % FXFER_MAX_SEGS_IN_FLIGHT));
+        win->resend_seq = seq + 1;
+        return send_file_segment(ctx, ch, seq);
+    }
+    return true;
+}
+
+/* True if window of the file send allows to send a new segment */
+static bool tx_window_open(struct fxfer_ctx *ctx, struct file_xfer_channel *ch) {
+    struct file_xfer_tx_window *win = &ch->tx_win;
+    return ch->session_state == FXFER_SSTATE_WAIT_FILESEND_ACK && win->next_seq < win->seg_num
+            && win->next_seq - win->acked_num < ctx->status.segs_in_flight;
+}
+
+/* Segments are sent if both session and link buckets have tokens */
+static bool tx_rate_allow(struct fxfer_ctx *ctx) {
+    uint32_t tick = ctx->platform->get_tick(ctx->user_data);
+    if (rate_limit_allow(&ctx->rate_limit, tick) != true) {
+        return false;
+    }
+    return ctx->link_limit == NULL || rate_limit_allow(ctx->link_limit, tick) == true;
+}
+
+static void tx_rate_consume(struct fxfer_ctx *ctx, uint32_t len) {
+    uint32_t tick = ctx->platform->get_tick(ctx->user_data);
+    rate_limit_consume(&ctx->rate_limit, len, tick);
+    if (ctx->link_limit != NULL) {
+        rate_limit_consume(ctx->link_limit, len, tick);
+    }
+}
+
+/* Sends new segments of all file sends while their windows allow. The highest priority
+ * class goes first, file sends of one class share the link by deficit round robin:
+ * every round a channel gets weight segments of credit, the credit isn't kept while
+ * the channel waits for ACKs */
+static void tx_schedule(struct fxfer_ctx *ctx) {
+    const uint8_t chans_max = 2 * FXFER_CHANNELS_NUM;
+
+    while (true) {
+        int8_t prio = -1;
+        for (uint8_t i = 0; i < chans_max; i++) {
+            if (tx_window_open(ctx, &ctx->chans[i]) == true && (int8_t)ctx->chans[i].prio > prio) {
+                prio = (int8_t)ctx->chans[i].prio;
+            }
+        }
+        if (prio < 0) {
+            return;
+        }
+
+        /* Rate limiter holds the segments, timeout of file sends waiting for it
+         * counts only when their segments are in flight */
+        if (tx_rate_allow(ctx) != true) {
+            uint32_t tick = ctx->platform->get_tick(ctx->user_data);
+            for (uint8_t i = 0; i < chans_max; i++) {
+                struct file_xfer_channel *ch = &ctx->chans[i];
+                if (tx_window_open(ctx, ch) == true && ch->tx_win.next_seq == ch->tx_win.acked_num) {
+                    ch->request.start_tick = tick;
+                }
+            }
+            return;
+        }
+
+        /* One round over channels of this class */
+        for (uint8_t k = 0; k < chans_max; k++) {
+            uint8_t i = (uint8_t)((ctx->status.sched_next + k) % chans_max);
+            struct file_xfer_channel *ch = &ctx->chans[i];
+            struct file_xfer_tx_window *win = &ch->tx_win;
+            if ((int8_t)ch->prio != prio || tx_window_open(ctx, ch) != true) {
+                continue;
+            }
+            if (tx_rate_allow(ctx) != true) {
+                break;
+            }
+
+            ch->deficit += (uint32_t)ch->weight * win->seg_data_max;
+            while (tx_window_open(ctx, ch) == true && ch->deficit >= win->seg_data_max
+                    && tx_rate_allow(ctx) == true) {
+                if (send_file_segment(ctx, ch, win->next_seq) != true) {
+                    request_complete(ctx, ch, FXFER_ERR_PLATFORM);
+                    break;
+                }
+                win->seg_tick[win->next_seq % FXFER_MAX_SEGS_IN_FLIGHT] =
+                        ctx->platform->get_tick(ctx->user_data);
+                win->timed_mask |= 1UL << (win->next_seq % FXFER_MAX_SEGS_IN_FLIGHT);
+                win->next_seq++;
+                ctx->link_stat.tx_segs++;
+                ctx->adapt.tx_segs++;
+                adapt_tx_update(ctx, false);
+                ch->deficit -= win->seg_data_max;
+            }
+            if (tx_window_open(ctx, ch) != true) {
+                ch->deficit = 0;
+            }
+            ctx->status.sched_next = (uint8_t)((i + 1) % chans_max);
+        }
+    }
+}
+
+static bool send_file_segment(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, uint32_t seq) {
+    struct file_xfer_tx_window *win = &ch->tx_win;
+    uint32_t seg_ind = win->seg_num - 1 - seq;
+    uint64_t offset = win->start_offset + (uint64_t)seq * win->seg_data_max;
+    uint32_t chunc_size = win->file_size - offset > win->seg_data_max
+            ? win->seg_data_max : (uint32_t)(win->file_size - offset);
+    uint8_t payload_ind = get_tx_payload_ind(ctx);
+    uint8_t ind_len = get_seg_ind_len(ctx);
+    uint8_t hdr_len = get_data_hdr_len(ctx);
+    uint8_t crc_len = get_seg_crc_len(ctx, seg_ind);
+    uint8_t *payload = &ctx->tx_data[payload_ind + hdr_len + crc_len];
+    uint8_t raw_buf[FXFER_TX_BUF_SIZE];
+    /* Segments that don't fit raw_buf or respondent's unpack buffer (its size is given
+     * in handshake) are sent uncompressed */
+    bool pack_flag = (ctx->status.caps & FXFER_CAP_COMPRESS_LZ) != 0 && chunc_size <= sizeof(raw_buf)
+            && chunc_size <= ctx->status.respondent_unpack_max;
+    uint8_t codec = FXFER_CODEC_RAW;
+    uint32_t payload_len = chunc_size;
+    uint64_t data_len = chunc_size;
+    const uint8_t *data = pack_flag == true ? raw_buf : payload;
+
+    if (win->delta.sigs != NULL) {
+        /* Delta segment starts where the previous one ends */
+        struct file_xfer_tx_delta *delta = &win->delta;
+        uint8_t slot = seq % (FXFER_MAX_SEGS_IN_FLIGHT + 1);
+        if (seq == win->next_seq) {
+            delta->seg_off[slot] = delta->next_off;
+        }
+        offset = delta->seg_off[slot];
+        uint64_t end_off = offset;
+        payload_len = delta_encode_seg(delta->data, win->file_size, &end_off,
+                delta->sigs, delta->sig_num, delta->block_size, payload, win->seg_data_max);
+        if (seq == win->next_seq) {
+            delta->next_off = end_off;
+        }
+        codec = FXFER_CODEC_DELTA;
+        data_len = end_off - offset;
+        data = payload;
+    } else {
+        /* Get segment data: mapped one isn't copied to tx_buf,
+         * the one that will be compressed is read to separate buffer */
+        bool res = true;
+        if (chunc_size > 0 && is_tx_zero_copy(ctx) == true) {
+            res = ctx->callbacks->file_map_partial_cb(ctx->user_data, win->file_name,
+                    offset, chunc_size, &data);
+        } else if (chunc_size > 0) {
+            res = tx_read(ctx, ch, seq, offset, chunc_size, (uint8_t *)data);
+        }
+        if (res != true) {
+            /* Platform error */
+            log_error("File read partial error. Filename: %s, total size: %" PRIu64 ", "
+                    "offset: %" PRIu64 ", chunk size: %u\n",
+                    win->file_name, win->file_size, offset, chunc_size);
+            return false;
+        }
+    }
+
+    /* Crc of the whole file is counted as new segments are sent, the last one carries it */
+    if ((ctx->status.caps & FXFER_CAP_FILE_CRC) != 0 && seq == win->next_seq) {
+        const uint8_t *file_data = win->delta.sigs != NULL ? &win->delta.data[offset] : data;
+        win->file_hash = crc32_compute_buf(win->file_hash, file_data, (size_t)data_len);
+    }
+
+    /* Compress segment to tx_buf, it's sent as is if it's not compressible */
+    if (pack_flag == true && codec == FXFER_CODEC_RAW && chunc_size > 0) {
+        uint32_t space = ctx->tx_data_size - payload_ind - hdr_len - crc_len - FXFER_PACK_CRC_FIELD_LEN;
+        uint32_t packed_len = lz_compress_buf(data, chunc_size, payload,
+                space < chunc_size ? space : chunc_size - 1U);
+        if (packed_len > 0) {
+            codec = FXFER_CODEC_LZ;
+            payload_len = packed_len;
+            data = payload;
+        }
+    }
+    if (data == raw_buf) {
+        memcpy(payload, raw_buf, chunc_size);
+        data = payload;
+    }
+    win->data_bytes += data_len;
+    win->payload_bytes += payload_len;
+
+    /* CODEC and FILE_CRC fields follow the segment index */
+    uint8_t fields[1 + FXFER_FILE_CRC_LEN];
+    uint8_t fields_len = hdr_len - ind_len;
+    fields[0] = codec;
+    if (crc_len > 0) {
+        write_uint32_le(win->file_hash, &fields[fields_len]);
+        fields_len += crc_len;
+    }
+
+    /* New segment is added to parity of its FEC group, resent one is already there */
+    bool fec_flag = (ctx->status.caps & FXFER_CAP_FEC) != 0 && seq == win->next_seq;
+    if (fec_flag == true) {
+        tx_fec_add(ch, fields, fields_len, data, payload_len);
+    }
+
+    /* Form data packet */
+    fill_preamble(ctx);
+    fill_msg_id(ctx, ch, FXFER_PACK_FILE_DATA);
+    fill_len(ctx, ind_len + fields_len + payload_len); //seg_ind + [codec] + [file_crc] + seg_data
+    put_seg_ind(ctx, seg_ind, &ctx->tx_data[payload_ind]);
+    memcpy(&ctx->tx_data[payload_ind + ind_len], fields, fields_len);
+    ctx->status.tx_buf_fill_size += ind_len + fields_len;
+
+    /* Segment data isn't in tx_buf, packet is sent by header, data and crc */
+    if (data != payload) {
+        uint32_t pack_hdr_len = ctx->status.tx_buf_fill_size;
+        uint32_t crc32 = crc32_compute_buf(0, ctx->tx_data, pack_hdr_len);
+        crc32 = crc32_compute_buf(crc32, data, payload_len);
+        write_uint32_le(crc32, &ctx->tx_data[pack_hdr_len]);
+
+        struct fxfer_iovec iov[3] = {
+            { ctx->tx_data, pack_hdr_len },
+            { data, payload_len },
+            { &ctx->tx_data[pack_hdr_len], FXFER_PACK_CRC_FIELD_LEN }
+        };
+        ctx->platform->sendv(ctx->user_data, iov, 3);
+        tx_rate_consume(ctx, pack_hdr_len + payload_len + FXFER_PACK_CRC_FIELD_LEN);
+    } else {
+        ctx->status.tx_buf_fill_size += payload_len;
+        fill_msg_crc(ctx);
+        send_msg(ctx);
+    }
+    log_debug("Sent seg_ind: %" PRIu32 ", with offset %" PRIu64 ", %u bytes of %" PRIu64 "\n",
+            seg_ind, offset, payload_len, data_len);
+
+    /* Parity follows the last segment of the group */
+    if (fec_flag == true && ((seq + 1) % ctx->status.fec_group == 0 || seq + 1 == win->seg_num)) {
+        tx_fec_send(ctx, ch, seq - seq % ctx->status.fec_group);
+    }
+    return true;
+}
+
+/* Read-ahead buffer part of the channel, NULL if there is no buffer */
+static uint8_t *tx_read_part(struct fxfer_ctx *ctx, struct file_xfer_channel *ch) {
+    struct file_xfer_read_buf *rb = &ctx->read_buf;
+    if (rb->buf == NULL) {
+        return NULL;
+    }
+    return &rb->buf[(uint32_t)((ch - ctx->chans) % FXFER_CHANNELS_NUM) * rb->part_size];
+}
+
+/* Reads segment data through read-ahead buffer: new segment that isn't there refills it
+ * by one read from its offset, resent one that isn't there any more is read directly */
+static bool tx_read(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, uint32_t seq, uint64_t offset,
+        uint32_t len, uint8_t *out) {
+    struct file_xfer_tx_window *win = &ch->tx_win;
+    uint8_t *part = tx_read_part(ctx, ch);
+    uint32_t part_size = ctx->read_buf.part_size;
+    bool hit_flag = part != NULL && offset >= win->read_off
+            && offset + len <= win->read_off + win->read_fill;
+
+    if (hit_flag != true && (part == NULL || seq != win->next_seq || len > part_size)) {
+        return ctx->callbacks->file_read_partial_cb(ctx->user_data, win->file_name, offset, len, out);
+    }
+    if (hit_flag != true) {
+        uint64_t rest = win->file_size - offset;
+        uint32_t fill = rest < part_size ? (uint32_t)rest : part_size;
+        win->read_fill = 0;
+        if (ctx->callbacks->file_read_partial_cb(ctx->user_data, win->file_name, offset, fill, part) != true) {
+            return false;
+        }
+        win->read_off = offset;
+        win->read_fill = fill;
+        log_debug("File %s: %u bytes read ahead from offset %" PRIu64 "\n", win->file_name, fill, offset);
+
+        /* Application may start reading the next range while this one is sent */
+        rest -= fill;
+        if (rest > 0 && ctx->callbacks->file_prefetch_cb != NULL) {
+            ctx->callbacks->file_prefetch_cb(ctx->user_data, win->file_name, offset + fill,
+                    rest < part_size ? (uint32_t)rest : part_size);
+        }
+    }
+    memcpy(out, &part[offset - win->read_off], len);
+    return true;
+}
+
+/* Segments number of the file part from start_offset, empty part is sent as one empty segment */
+static uint64_t get_seg_num(struct file_xfer_tx_window *win) {
+    uint64_t size = win->file_size - win->start_offset;
+    uint64_t seg_num = (size + win->seg_data_max - 1) / win->seg_data_max;
+    return seg_num > 0 ? seg_num : 1;
+}
+
+/* Forms FILE_SEND_REQ, announces file size, segments number and the offset of the first one */
+static bool fill_file_send_req(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, uint64_t seg_num) {
+    struct file_xfer_tx_window *win = &ch->tx_win;
+    bool wide_flag = (ctx->status.caps & FXFER_CAP_WIDE_OFFSETS) != 0;
+    if (seg_num > (wide_flag ? UINT32_MAX : UINT16_MAX)
+            || (wide_flag != true && win->file_size > UINT32_MAX)) {
+        log_error("File %s is too big to be sent: %" PRIu64 " bytes, %" PRIu64 " segments\n",
+                win->file_name, win->file_size, seg_num);
+        return false;
+    }
+    log_debug("Segments total: %" PRIu64 ", the first seg_ind: %" PRIu64 "\n",
+            seg_num, seg_num - 1);
+
+    uint16_t len = (uint16_t)strlen(win->file_name);
+    uint8_t file_info[FXFER_FILE_INFO_WIDE_LEN];
+    uint16_t file_info_len;
+    if (wide_flag == true) {
+        write_uint64_le(win->file_size, &file_info[0]);
+        write_uint32_le((uint32_t)seg_num, &file_info[sizeof(uint64_t)]);
+        file_info_len = FXFER_FILE_INFO_WIDE_LEN;
+    } else {
+        write_uint32_le((uint32_t)win->file_size, &file_info[0]);
+        write_uint16_le((uint16_t)seg_num, &file_info[sizeof(uint32_t)]);
+        file_info_len = FXFER_FILE_INFO_LEN;
+    }
+
+    uint16_t start_len = (ctx->status.caps & FXFER_CAP_RESUME) != 0 ? FXFER_FILE_INFO_START_LEN : 0;
+
+    fill_preamble(ctx);
+    fill_msg_id(ctx, ch, FXFER_PACK_FILE_SEND_REQ);
+    fill_len(ctx, len + 1 + file_info_len + start_len); //+1 to count \0
+    fill_payload(ctx, (uint8_t *)win->file_name, len + 1);
+    memcpy(&ctx->tx_data[ctx->status.tx_buf_fill_size], file_info, file_info_len);
+    ctx->status.tx_buf_fill_size += file_info_len;
+    if (start_len > 0) {
+        write_uint64_le(win->start_offset, &ctx->tx_data[ctx->status.tx_buf_fill_size]);
+        ctx->status.tx_buf_fill_size += start_len;
+    }
+    fill_msg_crc(ctx);
+
+    win->seg_num = (uint32_t)seg_num;
+    return true;
+}
+
+/* Hash of the first size bytes of the file being sent, the same as receiver's
+ * partial file should have. Read-ahead buffer, or tx_buf if it isn't set, is used
+ * as read buffer, nothing is sent yet */
+static bool tx_prefix_hash(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, uint64_t size, uint32_t *hash) {
+    struct file_xfer_tx_window *win = &ch->tx_win;
+    uint8_t *buf = tx_read_part(ctx, ch) != NULL ? tx_read_part(ctx, ch) : ctx->tx_data;
+    uint32_t buf_size = buf != ctx->tx_data ? ctx->read_buf.part_size : ctx->tx_data_size;
+    uint64_t offset = 0;
+    *hash = 0;
+    win->read_fill = 0;
+    while (offset < size) {
+        uint32_t piece = size - offset > buf_size ? buf_size : (uint32_t)(size - offset);
+        if (ctx->callbacks->file_read_partial_cb(ctx->user_data, win->file_name, offset,
+                piece, buf) != true) {
+            log_error("File %s read error, offset: %" PRIu64 "\n", win->file_name, offset);
+            return false;
+        }
+        *hash = crc32_compute_buf(*hash, buf, piece);
+        offset += piece;
+    }
+    return true;
+}
+
+/* Forms FILE_SIGS_REQ for the signatures that aren't received yet */
+static void fill_file_sigs_req(struct fxfer_ctx *ctx, struct file_xfer_channel *ch) {
+    struct file_xfer_tx_window *win = &ch->tx_win;
+    uint16_t len = (uint16_t)strlen(win->file_name);
+    uint8_t sigs_info[FXFER_SIGS_REQ_INFO_LEN];
+    write_uint32_le(win->delta.sig_num, &sigs_info[0]);
+    write_uint32_le(win->delta.sigs_max, &sigs_info[sizeof(uint32_t)]);
+
+    fill_preamble(ctx);
+    fill_msg_id(ctx, ch, FXFER_PACK_FILE_SIGS_REQ);
+    fill_len(ctx, len + 1 + FXFER_SIGS_REQ_INFO_LEN); //+1 to count \0
+    fill_payload(ctx, (uint8_t *)win->file_name, len + 1);
+    memcpy(&ctx->tx_data[ctx->status.tx_buf_fill_size], sigs_info, FXFER_SIGS_REQ_INFO_LEN);
+    ctx->status.tx_buf_fill_size += FXFER_SIGS_REQ_INFO_LEN;
+    fill_msg_crc(ctx);
+}
+
+/* All the signatures are received, count delta segments and request file send */
+static void tx_delta_start(struct fxfer_ctx *ctx, struct file_xfer_channel *ch) {
+    struct file_xfer_tx_window *win = &ch->tx_win;
+    struct file_xfer_tx_delta *delta = &win->delta;
+    delta_sort_sigs(delta->sigs, delta->sig_num);
+
+    /* Segments are encoded to tx_buf to be counted, it's done again while sending */
+    uint64_t seg_num = 0;
+    uint64_t offset = 0;
+    win->seg_data_max = get_seg_payload_max(ctx, false) - get_data_hdr_len(ctx) - get_seg_crc_len(ctx, 0);
+    do {
+        delta_encode_seg(delta->data, win->file_size, &offset, delta->sigs, delta->sig_num,
+                delta->block_size, &ctx->tx_data[get_tx_payload_ind(ctx)], win->seg_data_max);
+        seg_num++;
+    } while (offset < win->file_size);
+    delta->next_off = 0;
+    log_debug("Delta of file %s: %u blocks of %u bytes are known by receiver\n",
+            win->file_name, delta->sig_num, delta->block_size);
+
+    if (fill_file_send_req(ctx, ch, seg_num) != true) {
+        request_complete(ctx, ch, FXFER_ERR_BAD_REQUEST);
+        return;
+    }
+    ch->session_state = FXFER_SSTATE_WAIT_ACK;
+    send_msg(ctx);
+}
+
+/* Forms FILE_TREE_REQ of the channel's hash tree request */
+static void fill_file_tree_req(struct fxfer_ctx *ctx, struct file_xfer_channel *ch) {
+    struct file_xfer_tree_req *tree = &ch->tree;
+    uint16_t len = (uint16_t)strlen(ch->request.file_name);
+    uint8_t tree_info[FXFER_TREE_REQ_INFO_LEN];
+    write_uint32_le(FXFER_TREE_BLOCK_SIZE, &tree_info[0]);
+    tree_info[sizeof(uint32_t)] = tree->level;
+    write_uint32_le(tree->first_node, &tree_info[sizeof(uint32_t) + 1]);
+    write_uint32_le(tree->nodes->hashes_max, &tree_info[2 * sizeof(uint32_t) + 1]);
+
+    fill_preamble(ctx);
+    fill_msg_id(ctx, ch, FXFER_PACK_FILE_TREE_REQ);
+    fill_len(ctx, len + 1 + FXFER_TREE_REQ_INFO_LEN); //+1 to count \0
+    fill_payload(ctx, (uint8_t *)ch->request.file_name, len + 1);
+    memcpy(&ctx->tx_data[ctx->status.tx_buf_fill_size], tree_info, FXFER_TREE_REQ_INFO_LEN);
+    ctx->status.tx_buf_fill_size += FXFER_TREE_REQ_INFO_LEN;
+    fill_msg_crc(ctx);
+}
+
+/* Hash of the node of file's hash tree, children are hashed first, so the blocks
+ * are read in order. buf is FXFER_TREE_READ_SIZE bytes, it isn't used if block is mapped */
+static bool tree_node_hash(struct fxfer_ctx *ctx, const char *file_name, uint64_t file_size,
+        uint32_t block_size, uint8_t level, uint64_t node, uint8_t *buf, uint64_t *hash) {
+    if (level > 0) {
+        uint64_t left;
+        uint64_t right;
+        if (tree_node_hash(ctx, file_name, file_size, block_size, level - 1, 2 * node, buf, &left) != true) {
+            return false;
+        }
+        if (2 * node + 1 >= tree_level_nodes(file_size, block_size, level - 1)) {
+            *hash = left;
+            return true;
+        }
+        if (tree_node_hash(ctx, file_name, file_size, block_size, level - 1, 2 * node + 1, buf, &right) != true) {
+            return false;
+        }
+        *hash = tree_parent_hash(left, right);
+        return true;
+    }
+
+    /* Leaf is the hash of file block */
+    uint64_t offset = node * block_size;
+    uint32_t len = file_size - offset < block_size ? (uint32_t)(file_size - offset) : block_size;
+    const uint8_t *data = NULL;
+    if (len > 0 && ctx->callbacks->file_map_partial_cb != NULL
+            && ctx->callbacks->file_map_partial_cb(ctx->user_data, file_name, offset, len, &data) == true) {
+        *hash = xxh64_compute_buf(data, len, 0);
+        return true;
+    }
+    struct fxfer_xxh64 state;
+    xxh64_init(&state, 0);
+    while (len > 0) {
+        uint32_t piece = len < FXFER_TREE_READ_SIZE ? len : FXFER_TREE_READ_SIZE;
+        if (ctx->callbacks->file_read_partial_cb(ctx->user_data, file_name, offset, piece, buf) != true) {
+            log_error("File %s read error, offset: %" PRIu64 "\n", file_name, offset);
+            return false;
+        }
+        xxh64_update(&state, buf, piece);
+        offset += piece;
+        len -= piece;
+    }
+    *hash = xxh64_digest(&state);
+    return true;
+}
+
+/* Tree of the file is taken from the cache, or hashed to it if it fits: leaves are
+ * hashed in order, upper levels are made of them. False if nodes should be hashed
+ * from the file */
+static bool tree_cache_get(struct fxfer_ctx *ctx, const char *file_name, uint64_t file_size,
+        uint32_t block_size, uint8_t *buf) {
+    struct fxfer_tree_cache *cache = &ctx->tree_cache;
+    uint64_t stamp = 0;
+    if (cache->hashes_max == 0 || file_stamp_get(ctx, file_name, &stamp) != true) {
+        return false;
+    }
+    if (tree_cache_find(cache, file_name, file_size, stamp, block_size) == true) {
+        return true;
+    }
+    uint64_t leaves = tree_level_nodes(file_size, block_size, 0);
+    uint8_t top = tree_top_level(file_size, block_size);
+    cache->node_total = 0;
+    if (tree_level_first(file_size, block_size, top + 1) > cache->hashes_max) {
+        return false;
+    }
+    for (uint64_t node = 0; node < leaves; node++) {
+        if (tree_node_hash(ctx, file_name, file_size, block_size, 0, node, buf, &cache->hashes[node]) != true) {
+            return false;
+        }
+    }
+    if (tree_cache_store(cache, file_name, file_size, stamp, block_size) != true) {
+        return false;
+    }
+    log_debug("Hash tree of file %s is cached, %u nodes\n", file_name, cache->node_total);
+    return true;
+}
+
+/* Message handlers */
+static void handshake_req_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg) {
+    uint8_t *payload = (uint8_t *)arg;
+    uint32_t len = ctx->status.rx_payload_len;
+    uint32_t win_size = get_uint16_by_ptr(payload);
+    uint8_t peer_segs = len >= FXFER_HANDSHAKE_SEGS_LEN ? payload[sizeof(uint16_t)] : 1;
+    uint8_t peer_caps = len >= FXFER_HANDSHAKE_CAPS_LEN ? payload[FXFER_HANDSHAKE_SEGS_LEN] : 0;
+    uint8_t peer_chans = len >= FXFER_HANDSHAKE_CHANS_LEN ? payload[FXFER_HANDSHAKE_CAPS_LEN] : 1;
+    uint8_t peer_fec = len >= FXFER_HANDSHAKE_FEC_LEN ? payload[FXFER_HANDSHAKE_CHANS_LEN] : 0;
+    uint16_t peer_unpack = len >= FXFER_HANDSHAKE_LEN ? get_uint16_by_ptr(&payload[FXFER_HANDSHAKE_JUMBO_LEN]) : 0;
+    if ((peer_caps & FXFER_LOCAL_CAPS & FXFER_CAP_JUMBO) != 0 && len >= FXFER_HANDSHAKE_JUMBO_LEN) {
+        win_size = get_uint32_by_ptr(&payload[FXFER_HANDSHAKE_FEC_LEN]);
+    } else if (win_size > FXFER_PACK_LEN_MAX) {
+        /* LEN of 16 bits, its max value is extended header mark */
+        win_size = FXFER_PACK_LEN_MAX;
+    }
+    log_debug("Handshake request received, with window size: %u, segments in flight: %u, "
+            "caps: 0x%02X, channels: %u, FEC group: %u\n", win_size, peer_segs, peer_caps,
+            peer_chans, peer_fec);
+
+    /* Save handshake result, the peer opens its channels on the side it made
+     * the handshake from, so this device uses another one */
+    ctx->status.respondent_winsize = win_size;
+    ctx->status.respondent_unpack_max = peer_unpack;
+    ctx->status.segs_in_flight = negotiate_segs_in_flight(peer_segs);
+    ctx->status.caps = peer_caps & FXFER_LOCAL_CAPS;
+    ctx->status.chans_num = negotiate_chans(peer_chans);
+    ctx->status.chan_side = ctx->status.chans_num > 1 ? !(ch->id >> FXFER_CHAN_SIDE_SHIFT) : 0;
+    ctx->status.fec_group = negotiate_fec_group(ctx->status.caps, peer_fec);
+    if (ctx->status.fec_group == 0) {
+        ctx->status.caps &= (uint8_t)~FXFER_CAP_FEC;
+    }
+    ctx->status.handshake_done_flag = true;
+
+    /* Respond with FXFER_PACK_HANDSHAKE_RES */
+    uint32_t window_size = ctx->adapt.enabled_flag == true
+            ? ctx->link_stat.rx_winsize : get_rx_window(ctx);
+    ctx->adapt.rx_winsize_sent = window_size;
+    if (ctx->status.segs_in_flight > get_rx_segs_in_flight(ctx, window_size)) {
+        ctx->status.segs_in_flight = get_rx_segs_in_flight(ctx, window_size);
+    }
+    uint8_t res_payload[FXFER_HANDSHAKE_LEN];
+    write_uint16_le(window_size < FXFER_PACK_LEN_MAX ? (uint16_t)window_size : FXFER_PACK_LEN_MAX,
+            &res_payload[0]);
+    res_payload[sizeof(uint16_t)] = ctx->status.segs_in_flight;
+    res_payload[FXFER_HANDSHAKE_SEGS_LEN] = ctx->status.caps;
+    res_payload[FXFER_HANDSHAKE_CAPS_LEN] = ctx->status.chans_num;
+    res_payload[FXFER_HANDSHAKE_CHANS_LEN] = ctx->status.fec_group;
+    write_uint32_le(window_size, &res_payload[FXFER_HANDSHAKE_FEC_LEN]);
+    write_uint16_le(FXFER_RX_SEG_DATA_MAX, &res_payload[FXFER_HANDSHAKE_JUMBO_LEN]);
+
+    fill_preamble(ctx);
+    fill_msg_id(ctx, ch, FXFER_PACK_HANDSHAKE_RES);
+    fill_len(ctx, FXFER_HANDSHAKE_LEN);
+    fill_payload(ctx, res_payload, FXFER_HANDSHAKE_LEN);
+    fill_msg_crc(ctx);
+    send_msg(ctx);
+    log_debug("Handshake response sent, with window size: %u\n", window_size);
+}
+
+static void handshake_res_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg) {
+    uint8_t *payload = (uint8_t *)arg;
+    uint32_t len = ctx->status.rx_payload_len;
+    uint32_t win_size = get_uint16_by_ptr(payload);
+    uint8_t peer_segs = len >= FXFER_HANDSHAKE_SEGS_LEN ? payload[sizeof(uint16_t)] : 1;
+    uint8_t peer_caps = len >= FXFER_HANDSHAKE_CAPS_LEN ? payload[FXFER_HANDSHAKE_SEGS_LEN] : 0;
+    uint8_t peer_chans = len >= FXFER_HANDSHAKE_CHANS_LEN ? payload[FXFER_HANDSHAKE_CAPS_LEN] : 1;
+    uint8_t peer_fec = len >= FXFER_HANDSHAKE_FEC_LEN ? payload[FXFER_HANDSHAKE_CHANS_LEN] : 0;
+    uint16_t peer_unpack = len >= FXFER_HANDSHAKE_LEN ? get_uint16_by_ptr(&payload[FXFER_HANDSHAKE_JUMBO_LEN]) : 0;
+    if ((peer_caps & FXFER_LOCAL_CAPS & FXFER_CAP_JUMBO) != 0 && len >= FXFER_HANDSHAKE_JUMBO_LEN) {
+        win_size = get_uint32_by_ptr(&payload[FXFER_HANDSHAKE_FEC_LEN]);
+    } else if (win_size > FXFER_PACK_LEN_MAX) {
+        /* LEN of 16 bits, its max value is extended header mark */
+        win_size = FXFER_PACK_LEN_MAX;
+    }
+    log_debug("Handshake response received, with window size: %u, segments in flight: %u, "
+            "caps: 0x%02X, channels: %u, FEC group: %u\n", win_size, peer_segs, peer_caps,
+            peer_chans, peer_fec);
+    if (ch->session_state == FXFER_SSTATE_WAIT_HANDSHAKE) {
+        ctx->status.respondent_winsize = win_size;
+        ctx->status.respondent_unpack_max = peer_unpack;
+        ctx->status.segs_in_flight = negotiate_segs_in_flight(peer_segs);
+        ctx->status.caps = peer_caps & FXFER_LOCAL_CAPS;
+        ctx->status.chans_num = negotiate_chans(peer_chans);
+        ctx->status.chan_side = ctx->status.chans_num > 1 ? ch->id >> FXFER_CHAN_SIDE_SHIFT : 0;
+        ctx->status.fec_group = negotiate_fec_group(ctx->status.caps, peer_fec);
+        if (ctx->status.fec_group == 0) {
+            ctx->status.caps &= (uint8_t)~FXFER_CAP_FEC;
+        }
+        ctx->status.handshake_done_flag = true;
+        request_complete(ctx, ch, FXFER_NO_ERROR);
+    } else {
+        /* Late response of the request that was sent again */
+        log_debug("Packet wasn't awaited, it's ignored\n");
+    }
+}
+
+static void files_list_req_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg) {
+    log_debug("Files list request received\n");
+
+    /* Check if handshake wasn't yet */
+    if (ctx->status.handshake_done_flag == false) {
+        log_error("There was no handshake yet\n");
+        report_nack(ctx, ch, FXFER_NACK_ERR_NO_HANDSHAKE);
+        return;
+    }
+
+    /* Respond with FXFER_PACK_FILES_LIST_RES */
+    fill_preamble(ctx);
+    fill_msg_id(ctx, ch, FXFER_PACK_FILES_LIST_RES);
+
+    uint32_t payload_max = get_tx_payload_max(ctx);
+    uint16_t free_space = payload_max < UINT16_MAX ? (uint16_t)payload_max : UINT16_MAX;
+    uint8_t *payload_ptr = &ctx->tx_data[get_tx_payload_ind(ctx)];
+    uint16_t payload_len;
+
+    ctx->callbacks->form_files_list_cb(ctx->user_data, payload_ptr, free_space, &payload_len);
+    ctx->status.tx_buf_fill_size += payload_len;
+
+    fill_len(ctx, payload_len);
+    fill_msg_crc(ctx);
+    send_msg(ctx);
+    log_debug("Files list response sent\n");
+}
+
+static void files_list_res_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg) {
+    /* Get file numbers and filenames array */
+    uint8_t *payload = (uint8_t *)arg;
+    uint8_t files_num = payload[0];
+    uint8_t *filenames_arr = &payload[1];
+    log_debug("Files list response received, with files num: %u\n", files_num);
+    if (ch->session_state == FXFER_SSTATE_WAIT_FILESLIST) {
+        ctx->callbacks->files_list_gotten_cb(ctx->user_data, files_num, filenames_arr);
+        request_complete(ctx, ch, FXFER_NO_ERROR);
+    } else {
+        /* Late response of the request that was sent again */
+        log_debug("Packet wasn't awaited, it's ignored\n");
+    }
+}
+
+static void file_hash_req_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg) {
     log_debug("File hash request received\n");
 
     /* Check if handshake wasn't yet */
-    if (fxfer_status.handshake_done_flag == false) {
+    if (ctx->status.handshake_done_flag == false) {
+        log_error("There was no handshake yet\n");
+        report_nack(ctx, ch, FXFER_NACK_ERR_NO_HANDSHAKE);
+        return;
+    }
+
+    /* Hash is counted first, tx buffer may be used to read the file */
+    uint32_t file_hash;
+    if (file_hash_get(ctx, ch, (const char *)arg, &file_hash) != true) {
+        log_error("Can't get hash for file %s\n", (const char *)arg);
+        report_nack(ctx, ch, FXFER_NACK_ERR_BAD_REQUEST);
+        return;
+    }
+
+    /* Respond with FXFER_PACK_FILE_HASH_RES */
+    fill_preamble(ctx);
+    fill_msg_id(ctx, ch, FXFER_PACK_FILE_HASH_RES);
+    fill_len(ctx, sizeof(uint32_t));
+    fill_payload(ctx, (uint8_t *)&file_hash, sizeof(uint32_t));
+    fill_msg_crc(ctx);
+    send_msg(ctx);
+    log_debug("File hash response sent, gotten hash 0x%08X for the file %s\n",
+            file_hash, (const char *)arg);
+}
+
+static void file_hash_res_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg) {
+    uint32_t crc32 = get_uint32_by_ptr(arg);
+    log_debug("File hash response received, with crc32: 0x%08X\n", crc32);
+    if (ch->session_state == FXFER_SSTATE_WAIT_FILEHASH) {
+        ctx->callbacks->file_hash_gotten_cb(ctx->user_data, &crc32);
+        request_complete(ctx, ch, FXFER_NO_ERROR);
+    } else {
+        /* Late response of the request that was sent again */
+        log_debug("Packet wasn't awaited, it's ignored\n");
+    }
+}
+
+static void file_send_req_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg) {
+    log_debug("File send request received\n");
+    rx_write_interrupt(ctx, ch);
+    strncpy(ch->file_name_temp, (const char*)arg, FXFER_FILE_NAME_LEN_MAX);
+    log_debug("File name to send: %s\n", (const char*)arg);
+
+    /* Check if handshake wasn't yet */
+    if (ctx->status.handshake_done_flag == false) {
+        log_error("There was no handshake yet\n");
+        report_nack(ctx, ch, FXFER_NACK_ERR_NO_HANDSHAKE);
+        return;
+    }
+
+    /* Get segments number if it's announced after the file name,
+     * otherwise it will be taken from the first segment */
+    uint32_t len = ctx->status.rx_payload_len;
+    uint8_t *name_end = memchr(arg, '\0', len);
+    uint32_t name_len = name_end != NULL ? (uint32_t)(name_end - (uint8_t *)arg) + 1 : len;
+    uint8_t *file_info = &((uint8_t *)arg)[name_len];
+    uint64_t file_size = 0;
+    uint16_t file_info_len = 0;
+    rx_pool_drop_slots(ctx, ch);
+    memset(&ch->rx_win, 0, sizeof(ch->rx_win));
+    if ((ctx->status.caps & FXFER_CAP_WIDE_OFFSETS) != 0
+            && len >= name_len + FXFER_FILE_INFO_WIDE_LEN) {
+        file_size = get_uint64_by_ptr(file_info);
+        ch->rx_win.seg_num = get_uint32_by_ptr(&file_info[sizeof(uint64_t)]);
+        file_info_len = FXFER_FILE_INFO_WIDE_LEN;
+    } else if (len >= name_len + FXFER_FILE_INFO_LEN) {
+        file_size = get_uint32_by_ptr(file_info);
+        ch->rx_win.seg_num = get_uint16_by_ptr(&file_info[sizeof(uint32_t)]);
+        file_info_len = FXFER_FILE_INFO_LEN;
+    }
+    log_debug("Announced file size: %" PRIu64 ", segments: %" PRIu32 "\n",
+            file_size, ch->rx_win.seg_num);
+
+    /* Resumed file is appended to the part that receiver reported */
+    uint64_t start_offset = 0;
+    if ((ctx->status.caps & FXFER_CAP_RESUME) != 0 && file_info_len > 0
+            && len >= name_len + file_info_len + FXFER_FILE_INFO_START_LEN) {
+        start_offset = get_uint64_by_ptr(&file_info[file_info_len]);
+    }
+    if (start_offset > 0) {
+        uint64_t committed_size = 0;
+        uint32_t prefix_hash = 0;
+        if (start_offset > file_size || ctx->callbacks->get_file_partial_cb == NULL
+                || ctx->callbacks->get_file_partial_cb(ctx->user_data, ch->file_name_temp,
+                &committed_size, &prefix_hash) != true || committed_size != start_offset) {
+            log_error("File %s can't be resumed from offset %" PRIu64 "\n",
+                    ch->file_name_temp, start_offset);
+            ch->session_state = FXFER_SSTATE_IDLE;
+            report_nack(ctx, ch, FXFER_NACK_ERR_BAD_REQUEST);
+            return;
+        }
+        ch->rx_win.committed_size = start_offset;
+        ch->rx_win.file_hash = prefix_hash;
+        log_debug("File receiving is resumed from offset %" PRIu64 "\n", start_offset);
+    }
+
+    if (file_open(ctx, ch->file_name_temp, true, &ch->rx_win.open_flag) != true) {
+        ch->session_state = FXFER_SSTATE_IDLE;
+        report_nack(ctx, ch, FXFER_NACK_ERR_BAD_REQUEST);
+        return;
+    }
+    ch->rx_win.rx_tick = ctx->platform->get_tick(ctx->user_data);
+
+    /* Application may prepare the storage, e.g. preallocate the file by its announced size */
+    if (ctx->callbacks->file_alloc_cb != NULL && ctx->callbacks->file_alloc_cb(ctx->user_data,
+            ch->file_name_temp, start_offset, file_size) != true) {
+        log_error("File %s of %" PRIu64 " bytes can't be allocated\n", ch->file_name_temp, file_size);
+        file_close(ctx, ch->file_name_temp, true, &ch->rx_win.open_flag);
+        ch->session_state = FXFER_SSTATE_IDLE;
+        report_nack(ctx, ch, FXFER_NACK_ERR_NO_MEMORY);
+        return;
+    }
+
+    /* Set state 'waiting for file' */
+    ch->session_state = FXFER_SSTATE_WAIT_FILE;
+
+    /* Respond with FXFER_PACK_ACK */
+    report_ack(ctx, ch);
+    log_debug("ACK sent\n");
+}
+
+static void file_receive_req_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg) {
+
+}
+
+static void file_data_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg) {
+    log_debug("File data received\n");
+    uint8_t *payload = (uint8_t *)arg;
+    uint8_t ind_len = get_seg_ind_len(ctx);
+    struct file_xfer_rx_window *win = &ch->rx_win;
+
+    /* Check if handshake wasn't yet */
+    if (ctx->status.handshake_done_flag == false) {
+        log_error("There was no handshake yet\n");
+        report_nack(ctx, ch, FXFER_NACK_ERR_NO_HANDSHAKE);
+        return;
+    }
+
+    /* The last segment is sent again if its ACK was lost, so the file
+     * that is received completely is still ACKed */
+    bool rx_done_flag = ch->session_state == FXFER_SSTATE_IDLE && win->seg_num > 0
+            && win->committed_num == win->seg_num;
+    if (ch->session_state != FXFER_SSTATE_WAIT_FILE && rx_done_flag != true) {
+        log_error("Packet wasn't awaited\n");
+        report_nack(ctx, ch, FXFER_NACK_ERR_UNEXPECTED_PACKET);
+        return;
+    }
+
+    /* File closed while no segments came is opened again */
+    if (ch->session_state == FXFER_SSTATE_WAIT_FILE
+            && file_open(ctx, ch->file_name_temp, true, &win->open_flag) != true) {
+        ch->session_state = FXFER_SSTATE_IDLE;
+        report_nack(ctx, ch, FXFER_NACK_ERR_BAD_REQUEST);
+        return;
+    }
+    win->rx_tick = ctx->platform->get_tick(ctx->user_data);
+
+    uint8_t hdr_len = get_data_hdr_len(ctx);
+    if (ctx->status.rx_payload_len < hdr_len) {
+        log_error("Segment is too short: %u bytes\n", ctx->status.rx_payload_len);
+        report_nack(ctx, ch, FXFER_NACK_ERR_BAD_REQUEST);
+        return;
+    }
+    uint32_t seg_ind = get_seg_ind(ctx, payload);
+
+    /* Segments number wasn't announced, the first segment has the biggest index */
+    if (win->seg_num == 0) {
+        win->seg_num = seg_ind + 1;
+    }
+    if (seg_ind >= win->seg_num) {
+        log_error("Wrong seg_ind: %" PRIu32 ", segments total: %" PRIu32 "\n",
+                seg_ind, win->seg_num);
+        report_nack(ctx, ch, FXFER_NACK_ERR_BAD_REQUEST);
+        return;
+    }
+
+    /* Segment is added to its FEC group as it's on the wire, the lost one of the group
+     * may be rebuilt after that */
+    uint32_t seq = win->seg_num - 1 - seg_ind;
+    bool fec_flag = (ctx->status.caps & FXFER_CAP_FEC) != 0 && rx_done_flag != true;
+    if (fec_flag == true) {
+        rx_fec_sent(ch, seq);
+        rx_fec_add(ctx, ch, seq, &payload[ind_len], ctx->status.rx_payload_len - ind_len);
+    }
+    rx_data_segment(ctx, ch, seg_ind, &payload[ind_len], ctx->status.rx_payload_len - ind_len, true);
+    if (fec_flag == true && ch->session_state == FXFER_SSTATE_WAIT_FILE) {
+        rx_fec_rebuild(ctx, ch, seq / ctx->status.fec_group);
+    }
+}
+
+/* Handles FILE_DATA payload following the segment index: commits the segment or stores
+ * it out of order and ACKs it. held_flag is true if it's in rx buffer, not rebuilt by FEC */
+static void rx_data_segment(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, uint32_t seg_ind,
+        uint8_t *seg, uint32_t seg_len, bool held_flag) {
+    struct file_xfer_rx_window *win = &ch->rx_win;
+    uint8_t codec_len = get_data_hdr_len(ctx) - get_seg_ind_len(ctx);
+    uint8_t crc_len = get_seg_crc_len(ctx, seg_ind);
+    if (seg_len < (uint32_t)codec_len + crc_len) {
+        log_error("seg_ind: %" PRIu32 " is too short: %" PRIu32 " bytes\n", seg_ind, seg_len);
+        report_nack(ctx, ch, FXFER_NACK_ERR_BAD_REQUEST);
+        return;
+    }
+    uint32_t chunc_len = seg_len - codec_len - crc_len;
+    uint8_t *data = &seg[codec_len + crc_len];
+
+    /* The last segment carries crc32 of the whole file, it's checked when the segment is appended */
+    if (crc_len > 0) {
+        win->file_crc = get_uint32_by_ptr(&seg[codec_len]);
+    }
+
+    /* Decompress segment, it isn't held in rx pool then. Delta segment
+     * is applied when it's committed, it needs receiver's file data */
+    uint8_t codec = codec_len > 0 ? seg[0] : FXFER_CODEC_RAW;
+    bool hold_flag = held_flag == true && codec == FXFER_CODEC_RAW ? true : false;
+    if (codec == FXFER_CODEC_LZ && (ctx->status.caps & FXFER_CAP_COMPRESS_LZ) != 0) {
+        uint32_t unpacked_len = lz_decompress_buf(data, chunc_len,
+                ctx->rx_unpack_buf, FXFER_RX_SEG_DATA_MAX);
+        if (unpacked_len == 0) {
+            log_error("seg_ind: %" PRIu32 " decompression error\n", seg_ind);
+            report_nack(ctx, ch, FXFER_NACK_ERR_BAD_REQUEST);
+            return;
+        }
+        data = ctx->rx_unpack_buf;
+        chunc_len = unpacked_len;
+        codec = FXFER_CODEC_RAW;
+    } else if (codec != FXFER_CODEC_RAW
+            && (codec != FXFER_CODEC_DELTA || (ctx->status.caps & FXFER_CAP_DELTA) == 0)) {
+        log_error("seg_ind: %" PRIu32 " unknown codec: %u\n", seg_ind, codec);
+        report_nack(ctx, ch, FXFER_NACK_ERR_BAD_REQUEST);
+        return;
+    }
+
+    uint32_t seq = win->seg_num - 1 - seg_ind;
+    if (seq < win->committed_num) {
+        /* Duplicate, ACK it again in case if previous ACK was lost */
+        log_debug("Duplicate seg_ind: %" PRIu32 "\n", seg_ind);
+    } else if (seq == win->committed_num) {
+        /* Expected segment, append it and the stored ones that follow it.
+         * It isn't held in rx pool if it's copied to write-behind buffer */
+        uint8_t buf_id = hold_flag == true && rx_write_part(ctx, ch) == NULL
+                ? rx_pool_hold(ctx) : FXFER_RX_POOL_NO_BUF;
+        if (rx_commit_segment(ctx, ch, data, chunc_len, buf_id, codec) != true) {
+            return;
+        }
+        while ((win->stored_mask & 1) != 0) {
+            uint8_t slot = win->committed_num % FXFER_MAX_SEGS_IN_FLIGHT;
+            uint8_t *slot_data = win->slot_buf[slot] != FXFER_RX_POOL_NO_BUF
+                    ? &ctx->rx_pool.bufs[win->slot_buf[slot]][win->slot_off[slot]]
+                    : ch->rx_slots[slot];
+            if (rx_commit_segment(ctx, ch, slot_data, win->slot_len[slot],
+                    win->slot_buf[slot], win->slot_codec[slot]) != true) {
+                return;
+            }
+        }
+    } else if (seq - win->committed_num < ctx->status.segs_in_flight
+            && ((is_rx_zero_copy(ctx) == true && hold_flag == true)
+            || chunc_len <= FXFER_RX_SEG_DATA_MAX)) {
+        /* Segment is out of order, store it until the gap is filled,
+         * segment received to rx pool stays in its buffer */
+        uint8_t slot = seq % FXFER_MAX_SEGS_IN_FLIGHT;
+        win->slot_buf[slot] = hold_flag == true ? rx_pool_hold(ctx) : FXFER_RX_POOL_NO_BUF;
+        win->slot_codec[slot] = codec;
+        if (win->slot_buf[slot] != FXFER_RX_POOL_NO_BUF) {
+            win->slot_off[slot] = (uint32_t)(data - ctx->rx_data);
+        } else {
+            memcpy(ch->rx_slots[slot], data, chunc_len);
+        }
+        win->slot_len[slot] = chunc_len;
+        win->stored_mask |= 1UL << (seq - win->committed_num);
+        log_debug("Stored out of order seg_ind: %" PRIu32 "\n", seg_ind);
+    } else {
+        log_error("seg_ind: %" PRIu32 " is out of window, dropped\n", seg_ind);
+        return;
+    }
+
+    if (win->committed_num == win->seg_num) {
+        ch->session_state = FXFER_SSTATE_IDLE;
+    }
+    report_data_ack(ctx, ch, seg_ind, win->seg_num - win->committed_num);
+}
+
+/* Append next in order segment to the file and move the window,
+ * segment held in rx pool buffer buf_id is given to application */
+static bool rx_commit_segment(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, uint8_t *data, uint32_t len, uint8_t buf_id,
+        uint8_t codec) {
+    struct file_xfer_rx_window *win = &ch->rx_win;
+    bool eof_flag = win->committed_num + 1 == win->seg_num ? true : false;
+
+    bool res;
+    if (codec == FXFER_CODEC_DELTA) {
+        res = rx_delta_apply(ctx, ch, data, len, &eof_flag);
+    } else if (buf_id != FXFER_RX_POOL_NO_BUF && rx_write_part(ctx, ch) == NULL) {
+        res = rx_file_crc_check(ctx, ch, data, len, eof_flag)
+                && ctx->callbacks->file_append_buf_cb(ctx->user_data, ch->file_name_temp,
+                win->committed_size, buf_id, (uint32_t)(data - ctx->rx_pool.bufs[buf_id]),
+                len, &eof_flag);
+        if (res != true) {
+            fxfer_rx_buf_release(ctx, buf_id);
+        } else {
+            win->committed_size += len;
+        }
+    } else {
+        res = rx_append(ctx, ch, data, len, &eof_flag);
+        fxfer_rx_buf_release(ctx, buf_id);
+    }
+    if (res != true) {
+        ch->session_state = FXFER_SSTATE_IDLE;
+        log_error("File %s data append error\n", ch->file_name_temp);
+        file_close(ctx, ch->file_name_temp, true, &win->open_flag);
+        return false;
+    }
+    log_debug("File %s: %u bytes of data appended\n", ch->file_name_temp, len);
+
+    win->committed_num++;
+    win->stored_mask >>= 1;
+    if (eof_flag == true) {
+        win->committed_num = win->seg_num;
+        win->stored_mask = 0;
+        rx_index_file(ctx, ch);
+        tree_cache_drop(&ctx->tree_cache, ch->file_name_temp);
+        file_close(ctx, ch->file_name_temp, true, &win->open_flag);
+    }
+    return true;
+}
+
+static bool rx_append(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, uint8_t *data, uint32_t len, bool *eof_flag) {
+    struct file_xfer_rx_window *win = &ch->rx_win;
+    if (rx_file_crc_check(ctx, ch, data, len, *eof_flag) != true) {
+        return false;
+    }
+    if (rx_write_part(ctx, ch) != NULL) {
+        return rx_write_append(ctx, ch, data, len, *eof_flag);
+    }
+    if (ctx->callbacks->file_append_cb(ctx->user_data, ch->file_name_temp,
+            win->committed_size, len, data, eof_flag) != true) {
+        return false;
+    }
+    win->committed_size += len;
+    return true;
+}
+
+/* Counts crc32 of the received data, at the end of file it's checked against the one
+ * given by sender before the last append, so application doesn't commit the broken file */
+static bool rx_file_crc_check(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, const uint8_t *data,
+        uint32_t len, bool eof_flag) {
+    struct file_xfer_rx_window *win = &ch->rx_win;
+    bool crc_flag = (ctx->status.caps & FXFER_CAP_FILE_CRC) != 0;
+    if (ctx->hash_index.entry_num == 0 && crc_flag != true) {
+        return true;
+    }
+    win->file_hash = crc32_compute_buf(win->file_hash, data, len);
+    if (crc_flag == true && eof_flag == true && win->file_hash != win->file_crc) {
+        log_error("File %s has wrong crc. Given: 0x%08X, calculated: 0x%08X\n",
+                ch->file_name_temp, win->file_crc, win->file_hash);
+        report_nack(ctx, ch, FXFER_NACK_ERR_WRONG_FILE_CRC);
+        return false;
+    }
+    return true;
+}
+
+/* Rebuilds segment data from LITERAL and COPY operations, COPY data is read
+ * from receiver's file version, so it should be readable until the last append */
+static bool rx_delta_apply(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, uint8_t *data, uint32_t len, bool *eof_flag) {
+    bool last_seg_flag = *eof_flag;
+    uint32_t pos = 0;
+
+    *eof_flag = last_seg_flag;
+    if (len == 0) {
+        return rx_append(ctx, ch, data, 0, eof_flag);
+    }
+    while (pos < len) {
+        if (data[pos] == FXFER_DELTA_OP_LITERAL && len - pos >= FXFER_DELTA_LITERAL_HDR_LEN) {
+            uint16_t lit_len = get_uint16_by_ptr(&data[pos + 1]);
+            pos += FXFER_DELTA_LITERAL_HDR_LEN;
+            if (lit_len > len - pos) {
+                log_error("Delta literal is out of segment\n");
+                return false;
+            }
+            *eof_flag = last_seg_flag && pos + lit_len == len ? true : false;
+            if (rx_append(ctx, ch, &data[pos], lit_len, eof_flag) != true) {
+                return false;
+            }
+            pos += lit_len;
+        } else if (data[pos] == FXFER_DELTA_OP_COPY && len - pos >= FXFER_DELTA_COPY_LEN) {
+            uint64_t offset = get_uint64_by_ptr(&data[pos + 1]);
+            uint32_t copy_len = get_uint32_by_ptr(&data[pos + 1 + sizeof(uint64_t)]);
+            pos += FXFER_DELTA_COPY_LEN;
+            while (copy_len > 0) {
+                uint32_t piece = copy_len < FXFER_RX_SEG_DATA_MAX ? copy_len : FXFER_RX_SEG_DATA_MAX;
+                if (ctx->callbacks->file_read_partial_cb(ctx->user_data, ch->file_name_temp,
+                        offset, piece, ctx->rx_unpack_buf) != true) {
+                    log_error("File %s read error, offset: %" PRIu64 "\n",
+                            ch->file_name_temp, offset);
+                    return false;
+                }
+                offset += piece;
+                copy_len -= piece;
+                *eof_flag = last_seg_flag && copy_len == 0 && pos == len ? true : false;
+                if (rx_append(ctx, ch, ctx->rx_unpack_buf, piece, eof_flag) != true) {
+                    return false;
+                }
+            }
+        } else {
+            log_error("Wrong delta operation: %u\n", data[pos]);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* File of send or receiving is opened by file_open_cb() if it's given,
+ * file_close_cb() is called once for every opened one */
+static bool file_open(struct fxfer_ctx *ctx, const char *file_name, bool write_flag, bool *open_flag) {
+    if (*open_flag != true && ctx->callbacks->file_open_cb != NULL
+            && ctx->callbacks->file_open_cb(ctx->user_data, file_name, write_flag) != true) {
+        log_error("File %s open error\n", file_name);
+        return false;
+    }
+    *open_flag = true;
+    return true;
+}
+
+static void file_close(struct fxfer_ctx *ctx, const char *file_name, bool write_flag, bool *open_flag) {
+    if (*open_flag != true) {
+        return;
+    }
+    *open_flag = false;
+    if (ctx->callbacks->file_close_cb != NULL) {
+        ctx->callbacks->file_close_cb(ctx->user_data, file_name, write_flag);
+    }
+}
+
+/* File hash by get_file_hash_cb(). If hash index is set, the hash is crc32 counted by the
+ * library as for received files, it's taken from the index if the file isn't changed
+ * since it was indexed, otherwise it's counted and indexed */
+static bool file_hash_get(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, const char *file_name,
+        uint32_t *hash) {
+    uint64_t size = 0;
+    uint64_t stamp = 0;
+    if (ctx->hash_index.entry_num == 0) {
+        return ctx->callbacks->get_file_hash_cb(ctx->user_data, file_name, hash);
+    }
+    if (ctx->callbacks->get_file_size_cb(ctx->user_data, file_name, &size) != true
+            || file_stamp_get(ctx, file_name, &stamp) != true) {
+        return false;
+    }
+    if (hash_index_find(&ctx->hash_index, file_name, size, stamp, hash) == true) {
+        log_debug("Hash of file %s is found in index\n", file_name);
+        return true;
+    }
+    if (file_crc_count(ctx, ch, file_name, size, hash) != true) {
+        return false;
+    }
+    hash_index_store(&ctx->hash_index, file_name, size, stamp, *hash);
+    return true;
+}
+
+/* Crc32 of the whole file, mapped pieces are used if application maps files,
+ * otherwise it's read to read-ahead buffer part of the channel, or to tx_buf if it
+ * isn't set. The part is shared with the channel of the other side, so read-ahead
+ * data of both is dropped */
+static bool file_crc_count(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, const char *file_name,
+        uint64_t size, uint32_t *hash) {
+    uint8_t *buf = tx_read_part(ctx, ch) != NULL ? tx_read_part(ctx, ch) : ctx->tx_data;
+    uint32_t buf_size = buf != ctx->tx_data ? ctx->read_buf.part_size : ctx->tx_data_size;
+    uint8_t ind = (uint8_t)((ch - ctx->chans) % FXFER_CHANNELS_NUM);
+    uint64_t offset = 0;
+    ctx->chans[ind].tx_win.read_fill = 0;
+    ctx->chans[ind + FXFER_CHANNELS_NUM].tx_win.read_fill = 0;
+    *hash = 0;
+    while (offset < size) {
+        const uint8_t *data = buf;
+        uint32_t piece = size - offset < buf_size ? (uint32_t)(size - offset) : buf_size;
+        bool res;
+        if (ctx->callbacks->file_map_partial_cb != NULL) {
+            piece = size - offset < FXFER_INDEX_MAP_PIECE ? (uint32_t)(size - offset) : FXFER_INDEX_MAP_PIECE;
+            res = ctx->callbacks->file_map_partial_cb(ctx->user_data, file_name, offset, piece, &data);
+        } else {
+            res = ctx->callbacks->file_read_partial_cb(ctx->user_data, file_name, offset, piece, buf);
+        }
+        if (res != true) {
+            log_error("File %s read error, offset: %" PRIu64 "\n", file_name, offset);
+            return false;
+        }
+        *hash = crc32_compute_buf(*hash, data, piece);
+        offset += piece;
+    }
+    return true;
+}
+
+/* Stamp is 0 if application doesn't give it */
+static bool file_stamp_get(struct fxfer_ctx *ctx, const char *file_name, uint64_t *stamp) {
+    *stamp = 0;
+    if (ctx->callbacks->get_file_stamp_cb == NULL) {
+        return true;
+    }
+    return ctx->callbacks->get_file_stamp_cb(ctx->user_data, file_name, stamp);
+}
+
+/* Received file is indexed with crc32 counted while it was appended */
+static void rx_index_file(struct fxfer_ctx *ctx, struct file_xfer_channel *ch) {
+    char file_name[FXFER_FILE_NAME_LEN_MAX + 1];
+    uint64_t stamp = 0;
+    if (ctx->hash_index.entry_num == 0) {
+        return;
+    }
+    memcpy(file_name, ch->file_name_temp, FXFER_FILE_NAME_LEN_MAX);
+    file_name[FXFER_FILE_NAME_LEN_MAX] = '\0';
+    if (file_stamp_get(ctx, file_name, &stamp) != true) {
+        hash_index_drop(&ctx->hash_index, file_name);
+        return;
+    }
+    hash_index_store(&ctx->hash_index, file_name, ch->rx_win.committed_size, stamp, ch->rx_win.file_hash);
+    log_debug("File %s is indexed, hash 0x%08X\n", file_name, ch->rx_win.file_hash);
+}
+
+/* Write-behind buffer part of the channel, NULL if there is no buffer */
+static uint8_t *rx_write_part(struct fxfer_ctx *ctx, struct file_xfer_channel *ch) {
+    struct file_xfer_write_buf *wb = &ctx->write_buf;
+    if (wb->buf == NULL) {
+        return NULL;
+    }
+    return &wb->buf[(uint32_t)((ch - ctx->chans) % FXFER_CHANNELS_NUM) * wb->part_size];
+}
+
+/* Copies data to write-behind buffer, the full buffer is written. The first part of
+ * resumed file ends at aligned offset, so all the next ones start at aligned offsets */
+static bool rx_write_append(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, const uint8_t *data,
+        uint32_t len, bool eof_flag) {
+    struct file_xfer_rx_window *win = &ch->rx_win;
+    uint8_t *part = rx_write_part(ctx, ch);
+    while (len > 0) {
+        uint64_t start = win->committed_size - win->write_fill;
+        uint32_t limit = ctx->write_buf.part_size - (uint32_t)(start % FXFER_WRITE_ALIGN);
+        uint32_t piece = limit - win->write_fill < len ? limit - win->write_fill : len;
+        memcpy(&part[win->write_fill], data, piece);
+        win->write_fill += piece;
+        win->committed_size += piece;
+        data += piece;
+        len -= piece;
+        if (win->write_fill == limit && (len > 0 || eof_flag != true)
+                && rx_write_flush(ctx, ch, false, false) != true) {
+            return false;
+        }
+    }
+    return eof_flag == true ? rx_write_flush(ctx, ch, true, false) : true;
+}
+
+/* Gives buffered data to application, eof_flag is set for the last part of file.
+ * File is synced every sync_size bytes, or at once if sync_flag is set */
+static bool rx_write_flush(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, bool eof_flag, bool sync_flag) {
+    struct file_xfer_rx_window *win = &ch->rx_win;
+    if (win->write_fill > 0 || eof_flag == true) {
+        if (ctx->callbacks->file_append_cb(ctx->user_data, ch->file_name_temp,
+                win->committed_size - win->write_fill, win->write_fill,
+                rx_write_part(ctx, ch), &eof_flag) != true) {
+            return false;
+        }
+        log_debug("File %s: %u bytes of data written\n", ch->file_name_temp, win->write_fill);
+        win->write_unsynced += win->write_fill;
+        win->write_fill = 0;
+    }
+
+    uint32_t sync_size = ctx->write_buf.sync_size;
+    if (eof_flag == true || win->write_unsynced == 0 || ctx->callbacks->file_sync_cb == NULL
+            || (sync_flag != true && (sync_size == 0 || win->write_unsynced < sync_size))) {
+        return true;
+    }
+    win->write_unsynced = 0;
+    return ctx->callbacks->file_sync_cb(ctx->user_data, ch->file_name_temp);
+}
+
+/* Buffered data of the file which receiving is interrupted is written,
+ * so the file part that application reports for resume has it, and the file is closed */
+static void rx_write_interrupt(struct fxfer_ctx *ctx, struct file_xfer_channel *ch) {
+    if (ch->session_state == FXFER_SSTATE_WAIT_FILE && ch->rx_win.write_fill > 0
+            && rx_write_part(ctx, ch) != NULL && rx_write_flush(ctx, ch, false, true) != true) {
+        log_error("File %s write error\n", ch->file_name_temp);
+    }
+    ch->rx_win.write_fill = 0;
+    file_close(ctx, ch->file_name_temp, true, &ch->rx_win.open_flag);
+}
+
+static bool is_rx_zero_copy(struct fxfer_ctx *ctx) {
+    return ctx->rx_pool.buf_num > 0 && ctx->callbacks->file_append_buf_cb != NULL;
+}
+
+/* Hold the current rx pool buffer for the segment being handled */
+static uint8_t rx_pool_hold(struct fxfer_ctx *ctx) {
+    if (is_rx_zero_copy(ctx) != true) {
+        return FXFER_RX_POOL_NO_BUF;
+    }
+    ctx->rx_pool.refs[ctx->rx_pool.cur_buf]++;
+    return ctx->rx_pool.cur_buf;
+}
+
+/* Release pool buffers of out of order segments that won't be committed */
+static void rx_pool_drop_slots(struct fxfer_ctx *ctx, struct file_xfer_channel *ch) {
+    struct file_xfer_rx_window *win = &ch->rx_win;
+    for (uint8_t i = 0; i < FXFER_MAX_SEGS_IN_FLIGHT; i++) {
+        if ((win->stored_mask & (1UL << i)) != 0) {
+            uint8_t slot = (win->committed_num + i) % FXFER_MAX_SEGS_IN_FLIGHT;
+            fxfer_rx_buf_release(ctx, win->slot_buf[slot]);
+        }
+    }
+}
+
+/* XOR data into FEC accumulator, its length is the longest data added */
+static void fec_xor(uint8_t *acc, uint16_t *acc_len, const uint8_t *data, uint16_t len) {
+    for (uint16_t i = 0; i < len; i++) {
+        acc[i] ^= data[i];
+    }
+    if (*acc_len < len) {
+        *acc_len = len;
+    }
+}
+
+/* Adds FILE_DATA payload following the segment index to the parity of the group,
+ * it's prefixed with its length, so the rebuilt segment has the right size */
+static void tx_fec_add(struct file_xfer_channel *ch, const uint8_t *fields, uint8_t fields_len,
+        const uint8_t *data, uint16_t data_len) {
+    struct file_xfer_tx_window *win = &ch->tx_win;
+    uint8_t hdr[FXFER_FEC_LEN_FIELD_LEN + 1 + FXFER_FILE_CRC_LEN];
+    uint16_t len = 0;
+    write_uint16_le(fields_len + data_len, hdr);
+    memcpy(&hdr[FXFER_FEC_LEN_FIELD_LEN], fields, fields_len);
+    fec_xor(win->fec_parity, &win->fec_len, hdr, FXFER_FEC_LEN_FIELD_LEN + fields_len);
+    fec_xor(&win->fec_parity[FXFER_FEC_LEN_FIELD_LEN + fields_len], &len, data, data_len);
+    if (win->fec_len < FXFER_FEC_LEN_FIELD_LEN + fields_len + len) {
+        win->fec_len = FXFER_FEC_LEN_FIELD_LEN + fields_len + len;
+    }
+}
+
+/* Sends FILE_PARITY of the group which starts with segment seq, parity isn't ACKed
+ * and isn't resent: the group that it can't rebuild is recovered by resends */
+static void tx_fec_send(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, uint32_t seq) {
+    struct file_xfer_tx_window *win = &ch->tx_win;
+    uint8_t ind_len = get_seg_ind_len(ctx);
+
+    fill_preamble(ctx);
+    fill_msg_id(ctx, ch, FXFER_PACK_FILE_PARITY);
+    fill_len(ctx, ind_len + win->fec_len);
+    put_seg_ind(ctx, win->seg_num - 1 - seq, &ctx->tx_data[get_tx_payload_ind(ctx)]);
+    ctx->status.tx_buf_fill_size += ind_len;
+    memcpy(&ctx->tx_data[ctx->status.tx_buf_fill_size], win->fec_parity, win->fec_len);
+    ctx->status.tx_buf_fill_size += win->fec_len;
+    fill_msg_crc(ctx);
+    send_msg(ctx);
+    log_debug("Sent FEC parity of seg_ind: %" PRIu32 ", %u bytes\n", win->seg_num - 1 - seq, win->fec_len);
+
+    memset(win->fec_parity, 0, win->fec_len);
+    win->fec_len = 0;
+}
+
+/* FEC group state of receiver, the older group in its slot is dropped.
+ * NULL if the slot has newer group already */
+static struct file_xfer_rx_fec *rx_fec_group(struct file_xfer_channel *ch, uint32_t group,
+        uint8_t **acc) {
+    uint8_t slot = group % FXFER_FEC_GROUPS_NUM;
+    struct file_xfer_rx_fec *fec = &ch->rx_win.fec[slot];
+    if (fec->group > group + 1) {
+        return NULL;
+    }
+    if (fec->group < group + 1) {
+        memset(fec, 0, sizeof(struct file_xfer_rx_fec));
+        memset(ch->rx_fec_acc[slot], 0, FXFER_RX_SEG_DATA_MAX);
+        fec->group = group + 1;
+    }
+    *acc = ch->rx_fec_acc[slot];
+    return fec;
+}
+
+/* Adds FILE_DATA payload following the segment index to its group, once per segment */
+static void rx_fec_add(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, uint32_t seq, uint8_t *seg, uint32_t seg_len) {
+    uint8_t *acc;
+    struct file_xfer_rx_fec *fec = rx_fec_group(ch, seq / ctx->status.fec_group, &acc);
+    uint32_t bit = 1UL << (seq % ctx->status.fec_group);
+    if (fec == NULL || (fec->rx_mask & bit) != 0
+            || (uint32_t)FXFER_FEC_LEN_FIELD_LEN + seg_len > FXFER_RX_SEG_DATA_MAX) {
+        return;
+    }
+    uint8_t len_field[FXFER_FEC_LEN_FIELD_LEN];
+    uint16_t len = 0;
+    write_uint16_le(seg_len, len_field);
+    fec_xor(acc, &fec->len, len_field, FXFER_FEC_LEN_FIELD_LEN);
+    fec_xor(&acc[FXFER_FEC_LEN_FIELD_LEN], &len, seg, seg_len);
+    if (fec->len < FXFER_FEC_LEN_FIELD_LEN + len) {
+        fec->len = FXFER_FEC_LEN_FIELD_LEN + len;
+    }
+    fec->rx_mask |= bit;
+}
+
+/* If parity is received and one segment of the group is missing, it's the XOR
+ * of the group. Returns the number of segments that are still missing */
+static uint32_t rx_fec_rebuild(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, uint32_t group) {
+    struct file_xfer_rx_window *win = &ch->rx_win;
+    uint8_t group_size = ctx->status.fec_group;
+    uint32_t first_seq = group * group_size;
+    uint32_t seg_cnt = win->seg_num - first_seq < group_size ? win->seg_num - first_seq : group_size;
+    uint8_t *acc;
+    struct file_xfer_rx_fec *fec = rx_fec_group(ch, group, &acc);
+    if (fec == NULL) {
+        return 0;
+    }
+
+    uint32_t missing = 0;
+    uint32_t missing_pos = 0;
+    for (uint32_t i = 0; i < seg_cnt; i++) {
+        if ((fec->rx_mask & (1UL << i)) == 0) {
+            missing++;
+            missing_pos = i;
+        }
+    }
+    if (missing != 1 || fec->parity_flag != true) {
+        return missing;
+    }
+
+    uint16_t seg_len = get_uint16_by_ptr(acc);
+    if (seg_len < get_data_hdr_len(ctx) - get_seg_ind_len(ctx)
+            || FXFER_FEC_LEN_FIELD_LEN + seg_len > fec->len) {
+        log_error("FEC group of seg_ind: %" PRIu32 " is broken\n", win->seg_num - 1 - first_seq);
+        fec->rx_mask = UINT32_MAX;
+        return 1;
+    }
+    uint32_t seg_ind = win->seg_num - 1 - (first_seq + missing_pos);
+    fec->rx_mask |= 1UL << missing_pos;
+    ctx->link_stat.fec_rebuilt++;
+    log_debug("seg_ind: %" PRIu32 " is rebuilt by FEC parity\n", seg_ind);
+    rx_data_segment(ctx, ch, seg_ind, &acc[FXFER_FEC_LEN_FIELD_LEN], seg_len, false);
+    return 0;
+}
+
+/* True if broken FILE_DATA is sent for the first time, so its group parity is awaited.
+ * Segment index is taken from the broken packet, if it's broken too, the segment
+ * is resent after timeout */
+static bool rx_fec_pending(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, uint8_t *payload, uint32_t len) {
+    struct file_xfer_rx_window *win = &ch->rx_win;
+    if ((ctx->status.caps & FXFER_CAP_FEC) == 0 || ch->session_state != FXFER_SSTATE_WAIT_FILE
+            || len < get_seg_ind_len(ctx)) {
+        return false;
+    }
+    uint32_t seg_ind = get_seg_ind(ctx, payload);
+    return seg_ind < win->seg_num && win->seg_num - 1 - seg_ind >= win->fec_next_seq;
+}
+
+/* Segments up to seq are sent, the broken ones of them are NACKed */
+static void rx_fec_sent(struct file_xfer_channel *ch, uint32_t seq) {
+    if (ch->rx_win.fec_next_seq < seq + 1) {
+        ch->rx_win.fec_next_seq = seq + 1;
+    }
+}
+
+static void ack_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg) {
+    log_debug("ACK received\n");
+    uint32_t len = ctx->status.rx_payload_len;
+    if (ch->session_state == FXFER_SSTATE_WAIT_ACK && len >= FXFER_DATA_ACK_LEN
+            && get_seg_ind(ctx, arg) != ch->tx_win.seg_num) {
+        /* Repeated ACK of previous file segment, not the awaited one */
+        log_debug("Stale segment ACK ignored\n");
+    } else if (ch->session_state == FXFER_SSTATE_WAIT_ACK) {
+        tx_window_start(ctx, ch);
+    } else if (ch->session_state == FXFER_SSTATE_WAIT_FILESEND_ACK) {
+        struct file_xfer_tx_window *win = &ch->tx_win;
+        uint32_t seg_ind = win->seg_num - 1 - win->acked_num;
+        uint32_t cum_seg_ind = win->seg_num - 1 - win->acked_num;
+        uint8_t ind_len = get_seg_ind_len(ctx);
+
+        /* Receiver without sliding window support ACKs segments one by one,
+         * otherwise ACK without payload is the late one of file send request */
+        if (len >= 2 * ind_len) {
+            seg_ind = get_seg_ind(ctx, arg);
+            cum_seg_ind = get_seg_ind(ctx, &((uint8_t *)arg)[ind_len]);
+        } else if (ctx->status.segs_in_flight > 1) {
+            log_debug("Late file send request ACK ignored\n");
+            return;
+        }
+        if (seg_ind == win->seg_num && cum_seg_ind == win->seg_num) {
+            log_debug("Repeated file send request ACK ignored\n");
+            return;
+        }
+        if (seg_ind >= win->seg_num || cum_seg_ind > win->seg_num) {
+            log_error("ACK for wrong seg_ind: %" PRIu32 ", cum_seg_ind: %" PRIu32 "\n",
+                    seg_ind, cum_seg_ind);
+            return;
+        }
+
+        /* RTT of the segment that was sent once */
+        uint32_t seq = win->seg_num - 1 - seg_ind;
+        uint32_t slot_bit = 1UL << (seq % FXFER_MAX_SEGS_IN_FLIGHT);
+        if (seq >= win->acked_num && seq < win->next_seq && (win->timed_mask & slot_bit) != 0) {
+            win->timed_mask &= ~slot_bit;
+            link_rtt_sample(ctx, ctx->platform->get_tick(ctx->user_data)
+                    - win->seg_tick[seq % FXFER_MAX_SEGS_IN_FLIGHT]);
+        }
+
+        /* Selective part */
+        if (seq >= win->acked_num && seq - win->acked_num < 32) {
+            win->sacked_mask |= 1UL << (seq - win->acked_num);
+        }
+
+        /* Cumulative part */
+        uint32_t prev_acked_num = win->acked_num;
+        uint32_t cum_num = win->seg_num - cum_seg_ind;
+        while (win->acked_num < cum_num || (win->sacked_mask & 1) != 0) {
+            win->acked_num++;
+            win->sacked_mask >>= 1;
+        }
+
+        /* Segments after the gap are ACKed, while the gap isn't, resend it */
+        if (win->acked_num != prev_acked_num) {
+            win->dup_ack_cnt = 0;
+        } else if (seq > win->acked_num) {
+            win->dup_ack_cnt++;
+            uint8_t dup_ack_max = ctx->status.segs_in_flight > FXFER_DUP_ACK_MAX
+                    ? FXFER_DUP_ACK_MAX : ctx->status.segs_in_flight - 1;
+            if (win->dup_ack_cnt >= dup_ack_max) {
+                win->dup_ack_cnt = 0;
+                win->retransmit_flag = true;
+            }
+        }
+        log_debug("ACK for seg_ind: %" PRIu32 ", acked %" PRIu32 " of %" PRIu32 "\n",
+                seg_ind, win->acked_num, win->seg_num);
+
+        /* Timeout and retries count from the last window move */
+        if (win->acked_num != prev_acked_num) {
+            ch->request.start_tick = ctx->platform->get_tick(ctx->user_data);
+            ch->request.retries = 0;
+        }
+        tx_window_pump(ctx, ch);
+    } else {
+        /* Late response of the request that was sent again */
+        log_debug("Packet wasn't awaited, it's ignored\n");
+    }
+}
+
+static void nack_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg) {
+    uint8_t *payload = (uint8_t *)arg;
+    uint8_t err = payload[0];
+    log_debug("NACK received, with files error: %u\n", err);
+
+    /* Segments lost while file transfer are resent, ACK lost by the sender
+     * is repeated with the current cumulative segment index. Segment with
+     * broken header may be reported as not fitting receiver's buffer */
+    bool link_err_flag = err == FXFER_NACK_ERR_WRONG_CRC || err == FXFER_NACK_ERR_NO_MEMORY;
+    if (ch->session_state == FXFER_SSTATE_WAIT_FILESEND_ACK && link_err_flag == true) {
+        ctx->link_stat.tx_crc_errors++;
+        ctx->adapt.tx_errors++;
+        adapt_tx_update(ctx, false);
+        if (tx_window_resend_one(ctx, ch) != true) {
+            request_complete(ctx, ch, FXFER_ERR_PLATFORM);
+            return;
+        }
+        tx_window_pump(ctx, ch);
+        return;
+    }
+    struct file_xfer_rx_window *rx_win = &ch->rx_win;
+    if (link_err_flag == true && ch->request.active_flag != true && rx_win->seg_num > 0
+            && (ch->session_state == FXFER_SSTATE_WAIT_FILE || rx_win->committed_num == rx_win->seg_num)) {
+        /* seg_ind equal to segments number repeats ACK of the file send request */
+        uint32_t cum_seg_ind = rx_win->seg_num - rx_win->committed_num;
+        report_data_ack(ctx, ch, cum_seg_ind, cum_seg_ind);
+        return;
+    }
+
+    /* Request broken on the link is sent again */
+    if (ch->request.active_flag == true && link_err_flag == true) {
+        request_retransmit(ctx, ch, err);
+        return;
+    }
+
+    /* Complete awaiting request with error */
+    if (ch->request.active_flag == true) {
+        request_complete(ctx, ch, err);
+        return;
+    }
+
+    /* Link errors don't change the state of the channel without request,
+     * the peer repeats its request or segments */
+    if (link_err_flag == true) {
+        return;
+    }
+    ch->session_state = FXFER_SSTATE_ERR_RECEIVED;
+    ch->last_error = err;
+}
+
+static void file_sigs_req_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg) {
+    log_debug("File signatures request received\n");
+
+    /* Check if handshake wasn't yet */
+    if (ctx->status.handshake_done_flag == false) {
         log_error("There was no handshake yet\n");
-        report_nack(FXFER_NACK_ERR_NO_HANDSHAKE);
+        report_nack(ctx, ch, FXFER_NACK_ERR_NO_HANDSHAKE);
         return;
     }
 
-    /* Respond with FXFER_PACK_FILE_HASH_RES */
-    fill_preamble();
-    fill_msg_id(FXFER_PACK_FILE_HASH_RES);
-    fill_len(sizeof(uint32_t));
-    uint32_t file_hash;
-    if (get_file_hash_cb((const char *)arg, &file_hash) != true) {
-        log_error("Can't get hash for file %s\n", (const char *)arg);
-        report_nack(FXFER_NACK_ERR_BAD_REQUEST);
+    uint32_t len = ctx->status.rx_payload_len;
+    uint8_t *name_end = memchr(arg, '\0', len);
+    uint32_t name_len = name_end != NULL ? (uint32_t)(name_end - (uint8_t *)arg) + 1 : len;
+    if (name_end == NULL || len < name_len + FXFER_SIGS_REQ_INFO_LEN) {
+        log_error("Wrong signatures request\n");
+        report_nack(ctx, ch, FXFER_NACK_ERR_BAD_REQUEST);
         return;
     }
-    fill_payload((uint8_t *)&file_hash, sizeof(uint32_t));
-    fill_msg_crc();
-    send_msg();
-    log_debug("File hash response sent, gotten hash 0x%08X for the file %s\n",
-            file_hash, (const char *)arg);
+    const char *file_name = (const char *)arg;
+    uint32_t first_block = get_uint32_by_ptr(&((uint8_t *)arg)[name_len]);
+    uint32_t blocks_max = get_uint32_by_ptr(&((uint8_t *)arg)[name_len + sizeof(uint32_t)]);
+
+    /* Receiver's file may not exist yet, then there are no blocks. Block size
+     * is chosen so all the blocks fit sender's storage */
+    uint64_t basis_size = 0;
+    if (ctx->callbacks->get_file_size_cb(ctx->user_data, file_name, &basis_size) != true) {
+        basis_size = 0;
+    }
+    uint64_t block_size = blocks_max > 0 ? (basis_size + blocks_max - 1) / blocks_max : 0;
+    if (block_size < FXFER_DELTA_BLOCK_MIN) {
+        block_size = FXFER_DELTA_BLOCK_MIN;
+    }
+    if (block_size > UINT32_MAX || blocks_max == 0) {
+        log_error("Wrong signatures request, blocks max: %u\n", blocks_max);
+        report_nack(ctx, ch, FXFER_NACK_ERR_BAD_REQUEST);
+        return;
+    }
+    uint32_t blocks_total = (uint32_t)(basis_size / block_size);
+
+    /* Respond with FXFER_PACK_FILE_SIGS_RES, with signatures that fit the window */
+    uint8_t *payload = &ctx->tx_data[get_tx_payload_ind(ctx)];
+    uint32_t sig_cnt_max = (get_tx_payload_max(ctx) - FXFER_SIGS_RES_HDR_LEN) / FXFER_SIG_LEN;
+    uint32_t sig_cnt = 0;
+    for (uint32_t block = first_block; block < blocks_total && sig_cnt < sig_cnt_max; block++) {
+        if (rx_block_sig(ctx, file_name, (uint64_t)block * block_size, (uint32_t)block_size,
+                &payload[FXFER_SIGS_RES_HDR_LEN + sig_cnt * FXFER_SIG_LEN]) != true) {
+            report_nack(ctx, ch, FXFER_NACK_ERR_BAD_REQUEST);
+            return;
+        }
+        sig_cnt++;
+    }
+    write_uint64_le(basis_size, &payload[0]);
+    write_uint32_le((uint32_t)block_size, &payload[sizeof(uint64_t)]);
+    write_uint32_le(first_block, &payload[sizeof(uint64_t) + sizeof(uint32_t)]);
+    write_uint32_le(blocks_total, &payload[sizeof(uint64_t) + 2 * sizeof(uint32_t)]);
+
+    fill_preamble(ctx);
+    fill_msg_id(ctx, ch, FXFER_PACK_FILE_SIGS_RES);
+    fill_len(ctx, FXFER_SIGS_RES_HDR_LEN + sig_cnt * FXFER_SIG_LEN);
+    ctx->status.tx_buf_fill_size += FXFER_SIGS_RES_HDR_LEN + sig_cnt * FXFER_SIG_LEN;
+    fill_msg_crc(ctx);
+    send_msg(ctx);
+    log_debug("Signatures of blocks %u..%u of %u sent\n", first_block,
+            first_block + sig_cnt, blocks_total);
 }
 
-static void file_hash_res_handler(void* arg) {
-    uint32_t crc32 = get_uint32_by_ptr(arg);
-    log_debug("File hash response received, with crc32: 0x%08X\n", crc32);
-    if (fxfer_status.session_state == FXFER_SSTATE_WAIT_FILEHASH) {
-        fxfer_status.session_state = FXFER_SSTATE_IDLE;
-        file_hash_gotten_cb(&crc32);
-    } else {
+/* Weak and strong sums of receiver's file block, it's read by small pieces */
+static bool rx_block_sig(struct fxfer_ctx *ctx, const char *file_name, uint64_t offset,
+        uint32_t block_size, uint8_t *out) {
+    uint32_t weak = 0;
+    uint32_t strong = 0;
+    while (block_size > 0) {
+        uint32_t piece = block_size < FXFER_RX_SEG_DATA_MAX ? block_size : FXFER_RX_SEG_DATA_MAX;
+        if (ctx->callbacks->file_read_partial_cb(ctx->user_data, file_name, offset, piece,
+                ctx->rx_unpack_buf) != true) {
+            log_error("File %s read error, offset: %" PRIu64 "\n", file_name, offset);
+            return false;
+        }
+        weak = delta_weak_update(weak, ctx->rx_unpack_buf, piece);
+        strong = crc32_compute_buf(strong, ctx->rx_unpack_buf, piece);
+        offset += piece;
+        block_size -= piece;
+    }
+    write_uint32_le(weak, &out[0]);
+    write_uint32_le(strong, &out[sizeof(uint32_t)]);
+    return true;
+}
+
+static void file_sigs_res_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg) {
+    log_debug("File signatures response received\n");
+    uint8_t *payload = (uint8_t *)arg;
+    uint32_t len = ctx->status.rx_payload_len;
+    if (ch->session_state != FXFER_SSTATE_WAIT_FILESIGS) {
+        log_debug("Packet wasn't awaited, it's ignored\n");
+        return;
+    }
+    if (len < FXFER_SIGS_RES_HDR_LEN) {
         log_error("Packet wasn't awaited\n");
-        report_nack(FXFER_NACK_ERR_UNEXPECTED_PACKET);
+        report_nack(ctx, ch, FXFER_NACK_ERR_UNEXPECTED_PACKET);
+        return;
+    }
+
+    struct file_xfer_tx_delta *delta = &ch->tx_win.delta;
+    uint32_t block_size = get_uint32_by_ptr(&payload[sizeof(uint64_t)]);
+    uint32_t first_block = get_uint32_by_ptr(&payload[sizeof(uint64_t) + sizeof(uint32_t)]);
+    uint32_t blocks_total = get_uint32_by_ptr(&payload[sizeof(uint64_t) + 2 * sizeof(uint32_t)]);
+    uint32_t sig_cnt = (len - FXFER_SIGS_RES_HDR_LEN) / FXFER_SIG_LEN;
+    if (first_block < delta->sig_num) {
+        log_debug("Late signatures of blocks from %u are ignored\n", first_block);
+        return;
     }
+    if (first_block != delta->sig_num || blocks_total > delta->sigs_max || block_size == 0
+            || sig_cnt > blocks_total - first_block) {
+        log_error("Wrong signatures of blocks %u..%u of %u\n", first_block,
+                first_block + sig_cnt, blocks_total);
+        request_complete(ctx, ch, FXFER_ERR_BAD_REQUEST);
+        return;
+    }
+
+    /* Store signatures */
+    for (uint32_t i = 0; i < sig_cnt; i++) {
+        uint8_t *sig = &payload[FXFER_SIGS_RES_HDR_LEN + i * FXFER_SIG_LEN];
+        delta->sigs[first_block + i].weak = get_uint32_by_ptr(sig);
+        delta->sigs[first_block + i].strong = get_uint32_by_ptr(&sig[sizeof(uint32_t)]);
+        delta->sigs[first_block + i].block = first_block + i;
+    }
+    delta->sig_num += sig_cnt;
+    delta->block_size = block_size;
+    ch->request.start_tick = ctx->platform->get_tick(ctx->user_data);
+    ch->request.retries = 0;
+
+    /* Request the rest part of signatures */
+    if (delta->sig_num < blocks_total && sig_cnt > 0) {
+        fill_file_sigs_req(ctx, ch);
+        send_msg(ctx);
+        return;
+    }
+    tx_delta_start(ctx, ch);
 }
 
-static void file_send_req_handler(void* arg) {
-    log_debug("File send request received\n");
-    strncpy(fxfer_status.file_name_temp, (const char*)arg, FXFER_FILE_NAME_LEN_MAX);
-    log_debug("File name to send: %s\n", (const char*)arg);
+static void file_resume_req_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg) {
+    log_debug("File resume request received\n");
+    rx_write_interrupt(ctx, ch);
 
     /* Check if handshake wasn't yet */
-    if (fxfer_status.handshake_done_flag == false) {
+    if (ctx->status.handshake_done_flag == false) {
         log_error("There was no handshake yet\n");
-        report_nack(FXFER_NACK_ERR_NO_HANDSHAKE);
+        report_nack(ctx, ch, FXFER_NACK_ERR_NO_HANDSHAKE);
         return;
     }
 
-    /* Respond with FXFER_PACK_ACK */
-    fill_preamble();
-    fill_msg_id(FXFER_PACK_ACK);
-    fill_len(0);
-    fill_msg_crc();
-
-    /* Set state 'waiting for file' */
-    fxfer_status.session_state = FXFER_SSTATE_WAIT_FILE;
+    if (memchr(arg, '\0', ctx->status.rx_payload_len) == NULL) {
+        log_error("Wrong resume request\n");
+        report_nack(ctx, ch, FXFER_NACK_ERR_BAD_REQUEST);
+        return;
+    }
 
-    send_msg();
-    log_debug("ACK sent\n");
+    /* Application keeps the part of file received before, it's 0 if there is no such part */
+    uint64_t committed_size = 0;
+    uint32_t prefix_hash = 0;
+    if (ctx->callbacks->get_file_partial_cb == NULL
+            || ctx->callbacks->get_file_partial_cb(ctx->user_data, (const char *)arg,
+            &committed_size, &prefix_hash) != true) {
+        committed_size = 0;
+        prefix_hash = 0;
+    }
+    log_debug("File %s has %" PRIu64 " bytes received\n", (const char *)arg, committed_size);
+
+    /* Respond with FXFER_PACK_FILE_RESUME_RES */
+    uint8_t payload[FXFER_RESUME_RES_LEN];
+    write_uint64_le(committed_size, &payload[0]);
+    write_uint32_le(prefix_hash, &payload[sizeof(uint64_t)]);
+    fill_preamble(ctx);
+    fill_msg_id(ctx, ch, FXFER_PACK_FILE_RESUME_RES);
+    fill_len(ctx, FXFER_RESUME_RES_LEN);
+    fill_payload(ctx, payload, FXFER_RESUME_RES_LEN);
+    fill_msg_crc(ctx);
+    send_msg(ctx);
 }
 
-static void file_receive_req_handler(void* arg) {
+static void file_resume_res_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg) {
+    log_debug("File resume response received\n");
+    uint8_t *payload = (uint8_t *)arg;
+    if (ch->session_state != FXFER_SSTATE_WAIT_FILERESUME) {
+        log_debug("Packet wasn't awaited, it's ignored\n");
+        return;
+    }
+    if (ctx->status.rx_payload_len < FXFER_RESUME_RES_LEN) {
+        log_error("Packet wasn't awaited\n");
+        report_nack(ctx, ch, FXFER_NACK_ERR_UNEXPECTED_PACKET);
+        return;
+    }
+
+    /* Receiver's part of file is continued only if it's the same as the sender's one */
+    struct file_xfer_tx_window *win = &ch->tx_win;
+    uint64_t committed_size = get_uint64_by_ptr(&payload[0]);
+    uint32_t prefix_hash = get_uint32_by_ptr(&payload[sizeof(uint64_t)]);
+    uint32_t hash = 0;
+    if (committed_size > 0 && committed_size <= win->file_size
+            && tx_prefix_hash(ctx, ch, committed_size, &hash) == true && hash == prefix_hash) {
+        win->start_offset = committed_size;
+        win->file_hash = hash;
+        log_debug("File %s is resumed from offset %" PRIu64 "\n", win->file_name, committed_size);
+    } else if (committed_size > 0) {
+        log_debug("Received part of file %s differs, it's sent from the beginning\n",
+                win->file_name);
+    }
 
+    if (fill_file_send_req(ctx, ch, get_seg_num(win)) != true) {
+        request_complete(ctx, ch, FXFER_ERR_BAD_REQUEST);
+        return;
+    }
+    ch->session_state = FXFER_SSTATE_WAIT_ACK;
+    ch->request.start_tick = ctx->platform->get_tick(ctx->user_data);
+    ch->request.retries = 0;
+    send_msg(ctx);
 }
 
-static void file_data_handler(void* arg) {
-    log_debug("File data received\n");
+static void file_parity_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg) {
     uint8_t *payload = (uint8_t *)arg;
-    uint16_t chunc_len = get_uint16_by_ptr(&rx_buf[FXFER_PACK_LEN_IND]) - sizeof(uint16_t);
-    uint16_t seg_ind = get_uint16_by_ptr(payload);
-    uint8_t *data = (uint8_t *)&payload[sizeof(uint16_t)];
-    bool eof_flag = seg_ind > 0 ? false : true;
+    uint32_t len = ctx->status.rx_payload_len;
+    uint8_t ind_len = get_seg_ind_len(ctx);
+    struct file_xfer_rx_window *win = &ch->rx_win;
+    log_debug("FEC parity received\n");
+
+    /* Parity of the file that is received completely is late, it isn't needed */
+    if ((ctx->status.caps & FXFER_CAP_FEC) == 0 || ch->session_state != FXFER_SSTATE_WAIT_FILE
+            || win->seg_num == 0) {
+        log_debug("Packet wasn't awaited, it's ignored\n");
+        return;
+    }
+    uint32_t seg_ind = len >= (uint32_t)ind_len + FXFER_FEC_LEN_FIELD_LEN ? get_seg_ind(ctx, payload) : 0;
+    uint32_t seq = win->seg_num - 1 - seg_ind;
+    if (len < (uint32_t)ind_len + FXFER_FEC_LEN_FIELD_LEN || len - ind_len > FXFER_RX_SEG_DATA_MAX
+            || seg_ind >= win->seg_num || seq % ctx->status.fec_group != 0) {
+        log_error("Wrong FEC parity of seg_ind: %" PRIu32 ", %u bytes\n", seg_ind, len);
+        report_nack(ctx, ch, FXFER_NACK_ERR_BAD_REQUEST);
+        return;
+    }
+
+    uint32_t group = seq / ctx->status.fec_group;
+    uint32_t last_seq = seq + ctx->status.fec_group - 1;
+    rx_fec_sent(ch, last_seq < win->seg_num ? last_seq : win->seg_num - 1);
+    uint8_t *acc;
+    struct file_xfer_rx_fec *fec = rx_fec_group(ch, group, &acc);
+    if (fec == NULL || fec->parity_flag == true) {
+        return;
+    }
+    fec_xor(acc, &fec->len, &payload[ind_len], len - ind_len);
+    fec->parity_flag = true;
+
+    /* Segments that parity can't rebuild are lost, sender resends one segment
+     * on every NACK, so the last one is rebuilt when the others are received */
+    win->fec_broken = 0;
+    for (uint32_t missing = rx_fec_rebuild(ctx, ch, group); missing > 1
+            && ch->session_state == FXFER_SSTATE_WAIT_FILE; missing--) {
+        report_nack(ctx, ch, FXFER_NACK_ERR_WRONG_CRC);
+    }
+}
+
+static void file_tree_req_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg) {
+    log_debug("File hash tree request received\n");
 
     /* Check if handshake wasn't yet */
-    if (fxfer_status.handshake_done_flag == false) {
+    if (ctx->status.handshake_done_flag == false) {
         log_error("There was no handshake yet\n");
-        report_nack(FXFER_NACK_ERR_NO_HANDSHAKE);
+        report_nack(ctx, ch, FXFER_NACK_ERR_NO_HANDSHAKE);
         return;
     }
 
-    if (fxfer_status.session_state == FXFER_SSTATE_WAIT_FILE) {
-        /* Get segment index and data pointer */
-        if (file_append_cb(fxfer_status.file_name_temp, chunc_len, data, &eof_flag) != true) {
-            fxfer_status.session_state = FXFER_SSTATE_IDLE;
-            log_error("File %s data append error\n", fxfer_status.file_name_temp);
+    uint32_t len = ctx->status.rx_payload_len;
+    uint8_t *name_end = memchr(arg, '\0', len);
+    uint32_t name_len = name_end != NULL ? (uint32_t)(name_end - (uint8_t *)arg) + 1 : len;
+    if (name_end == NULL || len < name_len + FXFER_TREE_REQ_INFO_LEN) {
+        log_error("Wrong hash tree request\n");
+        report_nack(ctx, ch, FXFER_NACK_ERR_BAD_REQUEST);
+        return;
+    }
+    const char *file_name = (const char *)arg;
+    uint8_t *info = &((uint8_t *)arg)[name_len];
+    uint32_t block_size = get_uint32_by_ptr(&info[0]);
+    uint8_t level = info[sizeof(uint32_t)];
+    uint32_t first_node = get_uint32_by_ptr(&info[sizeof(uint32_t) + 1]);
+    uint32_t nodes_max = get_uint32_by_ptr(&info[2 * sizeof(uint32_t) + 1]);
+
+    uint64_t file_size = 0;
+    if (ctx->callbacks->get_file_size_cb(ctx->user_data, file_name, &file_size) != true) {
+        log_error("Get size of file %s error\n", file_name);
+        report_nack(ctx, ch, FXFER_NACK_ERR_BAD_REQUEST);
+        return;
+    }
+    if (block_size == 0 || level > FXFER_TREE_LEVEL_MAX
+            || tree_level_nodes(file_size, block_size, 0) > UINT32_MAX) {
+        log_error("Wrong hash tree request, block size: %u, level: %u\n", block_size, level);
+        report_nack(ctx, ch, FXFER_NACK_ERR_BAD_REQUEST);
+        return;
+    }
+    uint32_t nodes_total = (uint32_t)tree_level_nodes(file_size, block_size, level);
+
+    /* Respond with FXFER_PACK_FILE_TREE_RES, with nodes that fit the window */
+    uint8_t buf[FXFER_TREE_READ_SIZE];
+    uint8_t *payload = &ctx->tx_data[get_tx_payload_ind(ctx)];
+    uint32_t node_cnt_max = (get_tx_payload_max(ctx) - FXFER_TREE_RES_HDR_LEN) / FXFER_TREE_HASH_LEN;
+    uint32_t node_cnt = 0;
+    bool cached_flag = first_node < nodes_total && level <= tree_top_level(file_size, block_size)
+            && tree_cache_get(ctx, file_name, file_size, block_size, buf);
+    uint64_t level_first = tree_level_first(file_size, block_size, level);
+    if (node_cnt_max > nodes_max) {
+        node_cnt_max = nodes_max;
+    }
+    for (uint32_t node = first_node; node < nodes_total && node_cnt < node_cnt_max; node++) {
+        uint64_t hash;
+        if (cached_flag == true) {
+            hash = ctx->tree_cache.hashes[level_first + node];
+        } else if (tree_node_hash(ctx, file_name, file_size, block_size, level, node, buf, &hash) != true) {
+            report_nack(ctx, ch, FXFER_NACK_ERR_BAD_REQUEST);
             return;
         }
-        log_debug("File %s: %u bytes of data appended\n", fxfer_status.file_name_temp, chunc_len);
-        if (eof_flag == true) {
-            fxfer_status.session_state = FXFER_SSTATE_IDLE;
-        }
-        report_ack();
-    } else {
-        log_error("Packet wasn't awaited\n");
-        report_nack(FXFER_NACK_ERR_UNEXPECTED_PACKET);
+        write_uint64_le(hash, &payload[FXFER_TREE_RES_HDR_LEN + node_cnt * FXFER_TREE_HASH_LEN]);
+        node_cnt++;
     }
+    write_uint64_le(file_size, &payload[0]);
+    payload[sizeof(uint64_t)] = level;
+    write_uint32_le(first_node, &payload[sizeof(uint64_t) + 1]);
+    write_uint32_le(nodes_total, &payload[sizeof(uint64_t) + sizeof(uint32_t) + 1]);
+
+    fill_preamble(ctx);
+    fill_msg_id(ctx, ch, FXFER_PACK_FILE_TREE_RES);
+    fill_len(ctx, FXFER_TREE_RES_HDR_LEN + node_cnt * FXFER_TREE_HASH_LEN);
+    ctx->status.tx_buf_fill_size += FXFER_TREE_RES_HDR_LEN + node_cnt * FXFER_TREE_HASH_LEN;
+    fill_msg_crc(ctx);
+    send_msg(ctx);
+    log_debug("Hash tree nodes %u..%u of %u of level %u sent\n", first_node,
+            first_node + node_cnt, nodes_total, level);
 }
 
-static void ack_handler(void* arg) {
-    log_debug("ACK received\n");
-    if (fxfer_status.session_state == FXFER_SSTATE_WAIT_ACK) {
-        fxfer_status.session_state = FXFER_SSTATE_IDLE;
-    } else {
+static void file_tree_res_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg) {
+    log_debug("File hash tree response received\n");
+    uint8_t *payload = (uint8_t *)arg;
+    uint32_t len = ctx->status.rx_payload_len;
+    if (ch->session_state != FXFER_SSTATE_WAIT_FILETREE) {
+        log_debug("Packet wasn't awaited, it's ignored\n");
+        return;
+    }
+    if (len < FXFER_TREE_RES_HDR_LEN) {
         log_error("Packet wasn't awaited\n");
-        report_nack(FXFER_NACK_ERR_UNEXPECTED_PACKET);
+        report_nack(ctx, ch, FXFER_NACK_ERR_UNEXPECTED_PACKET);
+        return;
     }
-}
 
-static void nack_handler(void* arg) {
-    uint8_t *payload = (uint8_t *)arg;
-    uint8_t err = payload[0];
-    log_debug("NACK received, with files error: %u\n", err);
-    fxfer_status.session_state = FXFER_SSTATE_ERR_RECEIVED;
-    fxfer_status.last_error = err;
+    struct file_xfer_tree_req *tree = &ch->tree;
+    uint8_t level = payload[sizeof(uint64_t)];
+    uint32_t first_node = get_uint32_by_ptr(&payload[sizeof(uint64_t) + 1]);
+    uint32_t nodes_total = get_uint32_by_ptr(&payload[sizeof(uint64_t) + sizeof(uint32_t) + 1]);
+    uint32_t node_cnt = (len - FXFER_TREE_RES_HDR_LEN) / FXFER_TREE_HASH_LEN;
+    if (level != tree->level || first_node != tree->first_node || node_cnt > tree->nodes->hashes_max
+            || (node_cnt > 0 && (first_node >= nodes_total || node_cnt > nodes_total - first_node))) {
+        log_error("Wrong hash tree nodes %u..%u of %u of level %u\n", first_node,
+                first_node + node_cnt, nodes_total, level);
+        request_complete(ctx, ch, FXFER_ERR_BAD_REQUEST);
+        return;
+    }
+
+    /* Store nodes */
+    for (uint32_t i = 0; i < node_cnt; i++) {
+        tree->nodes->hashes[i] = get_uint64_by_ptr(&payload[FXFER_TREE_RES_HDR_LEN + i * FXFER_TREE_HASH_LEN]);
+    }
+    tree->nodes->file_size = get_uint64_by_ptr(&payload[0]);
+    tree->nodes->nodes_total = nodes_total;
+    tree->nodes->node_num = node_cnt;
+    request_complete(ctx, ch, FXFER_NO_ERROR);
 }
 
-static void default_handler(void* arg) {
+static void default_handler(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, void* arg) {
 
 }
 
 /* Utility functions for forming message */
-static void fill_preamble() {
-    fxfer_status.tx_buf_fill_size = 0;
-    write_uint32_le(FXFER_PACK_PREAMBLE, tx_buf);
-    fxfer_status.tx_buf_fill_size += sizeof(uint32_t);
+static void fill_preamble(struct fxfer_ctx *ctx) {
+    ctx->status.tx_buf_fill_size = 0;
+    write_uint32_le(FXFER_PACK_PREAMBLE, ctx->tx_data);
+    ctx->status.tx_buf_fill_size += sizeof(uint32_t);
 }
 
-static void fill_msg_id(uint8_t msg_id) {
-    tx_buf[FXFER_PACK_MSGID_IND] = msg_id;
-    fxfer_status.tx_buf_fill_size += sizeof(uint8_t);
+static void fill_msg_id(struct fxfer_ctx *ctx, struct file_xfer_channel *ch, uint8_t msg_id) {
+    ctx->tx_data[FXFER_PACK_MSGID_IND] = (uint8_t)(ch->id << FXFER_PACK_CHAN_SHIFT) | msg_id;
+    ctx->status.tx_buf_fill_size += sizeof(uint8_t);
 }
 
-static void fill_len(uint16_t msg_len) {
-    write_uint16_le(msg_len, &tx_buf[FXFER_PACK_LEN_IND]);
-    fxfer_status.tx_buf_fill_size += sizeof(uint16_t);
+static void fill_len(struct fxfer_ctx *ctx, uint32_t msg_len) {
+    if (get_tx_payload_ind(ctx) == FXFER_PACK_EXT_PAYLOAD_IND) {
+        write_uint16_le(FXFER_PACK_LEN_EXT, &ctx->tx_data[FXFER_PACK_LEN_IND]);
+        write_uint32_le(msg_len, &ctx->tx_data[FXFER_PACK_EXT_LEN_IND]);
+        ctx->status.tx_buf_fill_size += sizeof(uint16_t) + sizeof(uint32_t);
+        return;
+    }
+    write_uint16_le((uint16_t)msg_len, &ctx->tx_data[FXFER_PACK_LEN_IND]);
+    ctx->status.tx_buf_fill_size += sizeof(uint16_t);
 }
 
-static void fill_payload(uint8_t *data, uint16_t len) {
-    memcpy(&tx_buf[FXFER_PACK_PAYLOAD_IND], data, len);
-    fxfer_status.tx_buf_fill_size += len;
+static void fill_payload(struct fxfer_ctx *ctx, uint8_t *data, uint32_t len) {
+    memcpy(&ctx->tx_data[get_tx_payload_ind(ctx)], data, len);
+    ctx->status.tx_buf_fill_size += len;
 }
 
-static void fill_msg_crc() {
+static void fill_msg_crc(struct fxfer_ctx *ctx) {
     /* Calc crc32 */
-    uint32_t crc32 = crc32_compute_buf(0, tx_buf, fxfer_status.tx_buf_fill_size);
-    write_uint32_le(crc32, &tx_buf[fxfer_status.tx_buf_fill_size]);
-    fxfer_status.tx_buf_fill_size += sizeof(uint32_t);
+    uint32_t crc32 = crc32_compute_buf(0, ctx->tx_data, ctx->status.tx_buf_fill_size);
+    write_uint32_le(crc32, &ctx->tx_data[ctx->status.tx_buf_fill_size]);
+    ctx->status.tx_buf_fill_size += sizeof(uint32_t);
+}
+
+static void send_msg(struct fxfer_ctx *ctx) {
+    ctx->platform->send(ctx->user_data, ctx->tx_data, ctx->status.tx_buf_fill_size);
+    tx_rate_consume(ctx, ctx->status.tx_buf_fill_size);
+}
+
+/* Extended header with 32-bit LEN is used if respondent's window doesn't fit 16-bit one */
+static uint8_t get_tx_payload_ind(struct fxfer_ctx *ctx) {
+    return (ctx->status.caps & FXFER_CAP_JUMBO) != 0 && ctx->status.respondent_winsize > FXFER_PACK_LEN_MAX
+            ? FXFER_PACK_EXT_PAYLOAD_IND : FXFER_PACK_PAYLOAD_IND;
+}
+
+/* Max payload that fits both respondent's window and tx buffer */
+static uint32_t get_tx_payload_max(struct fxfer_ctx *ctx) {
+    uint32_t free_space_in_tx_buf = ctx->tx_data_size - get_tx_payload_ind(ctx)
+            - FXFER_PACK_CRC_FIELD_LEN;
+    return ctx->status.respondent_winsize > free_space_in_tx_buf
+            ? free_space_in_tx_buf : ctx->status.respondent_winsize;
+}
+
+/* FILE_DATA payload: respondent's window, limited by tx buffer if segments
+ * are copied to it or FEC parity is formed there, and by adaptive window */
+static uint32_t get_seg_payload_max(struct fxfer_ctx *ctx, bool zero_copy) {
+    uint32_t max = zero_copy == true ? ctx->status.respondent_winsize : get_tx_payload_max(ctx);
+    if ((ctx->status.caps & FXFER_CAP_FEC) != 0) {
+        max = get_tx_payload_max(ctx) < FXFER_FEC_TX_PARITY_MAX ? get_tx_payload_max(ctx) : FXFER_FEC_TX_PARITY_MAX;
+        max -= FXFER_FEC_LEN_FIELD_LEN;
+    }
+    if (ctx->adapt.enabled_flag == true && ctx->link_stat.tx_winsize < max) {
+        max = ctx->link_stat.tx_winsize;
+    }
+    return max;
+}
+
+/* FILE_DATA segments are sent without copy to tx_buf, so they are limited
+ * by respondent's window only */
+static bool is_tx_zero_copy(struct fxfer_ctx *ctx) {
+    return ctx->platform->sendv != NULL && ctx->callbacks->file_map_partial_cb != NULL;
+}
+
+/* Window given in handshake by default: the one of jumbo rx buffer if it's set */
+static uint32_t get_rx_window(struct fxfer_ctx *ctx) {
+    return ctx->rx_pack_max > FXFER_RX_BUF_SIZE
+            ? ctx->rx_pack_max - FXFER_PACK_EXT_PAYLOAD_IND - FXFER_PACK_CRC_FIELD_LEN
+            : FXFER_DEFAULT_WINDOW_SIZE;
+}
+
+/* Longest payload of the message. Only file data and responses filled up
+ * to respondent's window may be longer than the default packet */
+static uint32_t get_msg_len_max(uint8_t msg_id) {
+    switch (msg_id) {
+    case FXFER_PACK_ACK:
+        return 2 * sizeof(uint32_t);
+    case FXFER_PACK_NACK:
+        return sizeof(uint8_t);
+    case FXFER_PACK_FILE_DATA:
+    case FXFER_PACK_FILE_PARITY:
+    case FXFER_PACK_FILES_LIST_RES:
+    case FXFER_PACK_FILE_SIGS_RES:
+    case FXFER_PACK_FILE_TREE_RES:
+        return UINT32_MAX;
+    default:
+        return FXFER_DEFAULT_WINDOW_SIZE;
+    }
+}
+
+/* Out of order segment is stored in slot of FXFER_RX_SEG_DATA_MAX bytes, or left in
+ * rx pool buffer. Without pool the window which segments don't fit slots has one segment
+ * in flight, so segments are never received out of order */
+static uint8_t get_rx_segs_in_flight(struct fxfer_ctx *ctx, uint32_t window_size) {
+    return window_size > FXFER_RX_SEG_DATA_MAX + sizeof(uint16_t) && is_rx_zero_copy(ctx) != true
+            ? 1 : FXFER_MAX_SEGS_IN_FLIGHT;
+}
+
+static uint8_t negotiate_segs_in_flight(uint8_t peer_segs) {
+    uint8_t segs = peer_segs < FXFER_MAX_SEGS_IN_FLIGHT ? peer_segs : FXFER_MAX_SEGS_IN_FLIGHT;
+    return segs > 0 ? segs : 1;
+}
+
+static void ctx_lock(struct fxfer_ctx *ctx) {
+    if (ctx->platform->lock != NULL) {
+        ctx->platform->lock(ctx->user_data);
+    }
+}
+
+static void ctx_unlock(struct fxfer_ctx *ctx) {
+    if (ctx->platform->unlock != NULL) {
+        ctx->platform->unlock(ctx->user_data);
+    }
+}
+
+static uint8_t negotiate_chans(uint8_t peer_chans) {
+    uint8_t chans = peer_chans < FXFER_CHANNELS_NUM ? peer_chans : FXFER_CHANNELS_NUM;
+    return chans > 0 ? chans : 1;
+}
+
+/* FEC is used if both devices offer it, with the bigger group of the two,
+ * so receiver keeps enough groups for its window */
+static uint8_t negotiate_fec_group(uint8_t caps, uint8_t peer_group) {
+    if ((caps & FXFER_CAP_FEC) == 0 || peer_group == 0) {
+        return 0;
+    }
+    uint8_t group = peer_group > FXFER_FEC_GROUP ? peer_group : FXFER_FEC_GROUP;
+    return group < FXFER_FEC_GROUP_MAX ? group : FXFER_FEC_GROUP_MAX;
+}
+
+/* Channel of id given in MSG_ID, NULL if there is no such channel */
+static struct file_xfer_channel *get_chan(struct fxfer_ctx *ctx, uint8_t chan_id) {
+    uint8_t side = chan_id >> FXFER_CHAN_SIDE_SHIFT;
+    uint8_t ind = chan_id & FXFER_CHAN_IND_MASK;
+    if (side > 1 || ind >= FXFER_CHANNELS_NUM) {
+        return NULL;
+    }
+    return &ctx->chans[side * FXFER_CHANNELS_NUM + ind];
+}
+
+/* Free channel of this device's side for a new request, only the first one
+ * is used if peer doesn't support channels */
+static struct file_xfer_channel *chan_alloc(struct fxfer_ctx *ctx) {
+    for (uint8_t i = 0; i < ctx->status.chans_num; i++) {
+        struct file_xfer_channel *ch = get_chan(ctx,
+                (uint8_t)(ctx->status.chan_side << FXFER_CHAN_SIDE_SHIFT) | i);
+        if (ch->request.active_flag != true) {
+            return ch;
+        }
+    }
+    log_error("All %u channels are busy\n", ctx->status.chans_num);
+    return NULL;
+}
+
+static struct file_xfer_channel *get_req_chan(struct fxfer_ctx *ctx, uint32_t req_id) {
+    for (uint8_t i = 0; i < 2 * FXFER_CHANNELS_NUM && req_id != 0; i++) {
+        if (ctx->chans[i].request.id == req_id) {
+            return &ctx->chans[i];
+        }
+    }
+    return NULL;
+}
+
+/* The highest priority class, the first enqueued job in the class */
+static struct file_xfer_job *queue_next(struct fxfer_ctx *ctx) {
+    struct file_xfer_job *next = NULL;
+    for (uint8_t i = 0; i < FXFER_QUEUE_LEN; i++) {
+        struct file_xfer_job *job = &ctx->queue[i];
+        if (job->used_flag != true) {
+            continue;
+        }
+        if (next == NULL || job->prio > next->prio
+                || (job->prio == next->prio && (int32_t)(job->seq - next->seq) < 0)) {
+            next = job;
+        }
+    }
+    return next;
+}
+
+/* Starts queued file sends while there are free channels */
+static void queue_dispatch(struct fxfer_ctx *ctx) {
+    while (true) {
+        struct file_xfer_job *next = queue_next(ctx);
+        if (next == NULL) {
+            return;
+        }
+
+        uint8_t free_num = 0;
+        for (uint8_t i = 0; i < ctx->status.chans_num; i++) {
+            struct file_xfer_channel *ch = get_chan(ctx,
+                    (uint8_t)(ctx->status.chan_side << FXFER_CHAN_SIDE_SHIFT) | i);
+            if (ch->request.active_flag != true) {
+                free_num++;
+            }
+        }
+        if (free_num == 0 || (free_num == 1 && ctx->status.chans_num > 1
+                && next->prio != FXFER_PRIO_URGENT)) {
+            return;
+        }
+
+        /* Job slot is free before the start, done_cb may queue the next one */
+        struct file_xfer_job job = *next;
+        next->used_flag = false;
+        struct fxfer_queue_stat *stat = &ctx->queue_stat;
+        uint32_t wait = ctx->platform->get_tick(ctx->user_data) - job.enqueue_tick;
+        stat->depth--;
+        stat->started[job.prio]++;
+        stat->wait_last[job.prio] = wait;
+        if (wait > stat->wait_max[job.prio]) {
+            stat->wait_max[job.prio] = wait;
+        }
+        log_debug("Queued file %s is started after %u ticks\n", job.file_name, wait);
+
+        if (file_send_start(ctx, job.file_name, job.id, job.done_cb, job.done_arg) == 0) {
+            if (job.done_cb != NULL) {
+                job.done_cb(ctx, job.id, FXFER_ERR_PLATFORM, job.done_arg);
+            }
+            continue;
+        }
+        struct file_xfer_channel *ch = get_req_chan(ctx, job.id);
+        ch->prio = job.prio;
+        ch->weight = job.weight;
+    }
+}
+
+/* FILE_DATA segment index and its ACK fields are 32-bit if it's negotiated in handshake */
+static uint8_t get_seg_ind_len(struct fxfer_ctx *ctx) {
+    return (ctx->status.caps & FXFER_CAP_WIDE_OFFSETS) != 0 ? sizeof(uint32_t) : sizeof(uint16_t);
+}
+
+static uint32_t get_seg_ind(struct fxfer_ctx *ctx, uint8_t *ptr) {
+    return (ctx->status.caps & FXFER_CAP_WIDE_OFFSETS) != 0
+            ? get_uint32_by_ptr(ptr) : get_uint16_by_ptr(ptr);
+}
+
+static void put_seg_ind(struct fxfer_ctx *ctx, uint32_t seg_ind, uint8_t *ptr) {
+    if ((ctx->status.caps & FXFER_CAP_WIDE_OFFSETS) != 0) {
+        write_uint32_le(seg_ind, ptr);
+    } else {
+        write_uint16_le((uint16_t)seg_ind, ptr);
+    }
+}
+
+/* FILE_DATA header: segment index and codec if compression or delta is negotiated */
+static uint8_t get_data_hdr_len(struct fxfer_ctx *ctx) {
+    return get_seg_ind_len(ctx)
+            + ((ctx->status.caps & (FXFER_CAP_COMPRESS_LZ | FXFER_CAP_DELTA)) != 0 ? 1 : 0);
 }
 
-static void send_msg() {
-    platform_send(tx_buf, fxfer_status.tx_buf_fill_size);
+/* FILE_CRC field is in the last segment only, the others are smaller
+ * by its length too, so the last one fits the window */
+static uint8_t get_seg_crc_len(struct fxfer_ctx *ctx, uint32_t seg_ind) {
+    return (ctx->status.caps & FXFER_CAP_FILE_CRC) != 0 && seg_ind == 0 ? FXFER_FILE_CRC_LEN : 0;
 }
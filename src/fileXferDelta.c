@@ -0,0 +1,176 @@
+#include <string.h>
+#include "fileXferDelta.h"
+#include "fileXferUtils.h"
+
+/* Delta encoding of file against receiver's version of it (rsync algorithm).
+ * Receiver gives weak (rolling) and strong (crc32) sums of its file blocks,
+ * sender looks for the blocks at every byte offset of its file and encodes
+ * the segments as COPY of receiver's data and LITERAL data that isn't there.
+ * Weak sum is a | b << 16, where a is sum of bytes and b is sum of a after
+ * every byte, both modulo 2^16. */
+
+#define DELTA_LITERAL_MAX               0xFFFF
+
+uint32_t delta_weak_update(uint32_t weak, const uint8_t *data, uint32_t len) {
+    uint32_t a = weak & 0xFFFF;
+    uint32_t b = weak >> 16;
+    for (uint32_t i = 0; i < len; i++) {
+        a = (a + data[i]) & 0xFFFF;
+        b = (b + a) & 0xFFFF;
+    }
+    return a | (b << 16);
+}
+
+uint32_t delta_weak_roll(uint32_t weak, uint8_t out_byte, uint8_t in_byte, uint32_t block_size) {
+    uint32_t a = weak & 0xFFFF;
+    uint32_t b = weak >> 16;
+    a = (a - out_byte + in_byte) & 0xFFFF;
+    b = (b - block_size * out_byte + a) & 0xFFFF;
+    return a | (b << 16);
+}
+
+/* Heap sort by weak sum, so blocks are found by binary search without extra memory */
+static void delta_sift_down(struct fxfer_delta_sig *sigs, uint32_t root, uint32_t end) {
+    while (2 * root + 1 < end) {
+        uint32_t child = 2 * root + 1;
+        if (child + 1 < end && sigs[child + 1].weak > sigs[child].weak) {
+            child++;
+        }
+        if (sigs[root].weak >= sigs[child].weak) {
+            return;
+        }
+        struct fxfer_delta_sig tmp = sigs[root];
+        sigs[root] = sigs[child];
+        sigs[child] = tmp;
+        root = child;
+    }
+}
+
+void delta_sort_sigs(struct fxfer_delta_sig *sigs, uint32_t sig_num) {
+    for (uint32_t i = sig_num / 2; i > 0; i--) {
+        delta_sift_down(sigs, i - 1, sig_num);
+    }
+    for (uint32_t end = sig_num; end > 1; end--) {
+        struct fxfer_delta_sig tmp = sigs[0];
+        sigs[0] = sigs[end - 1];
+        sigs[end - 1] = tmp;
+        delta_sift_down(sigs, 0, end - 1);
+    }
+}
+
+/* Returns signature of the block equal to data, NULL if there is no such block */
+static const struct fxfer_delta_sig *delta_find_block(const struct fxfer_delta_sig *sigs,
+        uint32_t sig_num, uint32_t weak, const uint8_t *data, uint32_t block_size) {
+    uint32_t lo = 0;
+    uint32_t hi = sig_num;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (sigs[mid].weak < weak) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == sig_num || sigs[lo].weak != weak) {
+        return NULL;
+    }
+
+    uint32_t strong = crc32_compute_buf(0, data, block_size);
+    for (; lo < sig_num && sigs[lo].weak == weak; lo++) {
+        if (sigs[lo].strong == strong) {
+            return &sigs[lo];
+        }
+    }
+    return NULL;
+}
+
+static void delta_put_literal(uint8_t *out, uint32_t *out_len, const uint8_t *lit, uint32_t lit_len) {
+    if (lit_len == 0) {
+        return;
+    }
+    out[*out_len] = FXFER_DELTA_OP_LITERAL;
+    write_uint16_le((uint16_t)lit_len, &out[*out_len + 1]);
+    memcpy(&out[*out_len + FXFER_DELTA_LITERAL_HDR_LEN], lit, lit_len);
+    *out_len += FXFER_DELTA_LITERAL_HDR_LEN + lit_len;
+}
+
+static void delta_put_copy(uint8_t *out, uint32_t *out_len, uint64_t offset, uint32_t len) {
+    if (len == 0) {
+        return;
+    }
+    out[*out_len] = FXFER_DELTA_OP_COPY;
+    write_uint64_le(offset, &out[*out_len + 1]);
+    write_uint32_le(len, &out[*out_len + 1 + sizeof(uint64_t)]);
+    *out_len += FXFER_DELTA_COPY_LEN;
+}
+
+/* Encodes data from *raw_off while operations fit out buffer, *raw_off is moved
+ * to the end of encoded data. Encoding is the same for the same raw_off, so the
+ * segment can be encoded again to be resent */
+uint32_t delta_encode_seg(const uint8_t *data, uint64_t data_len, uint64_t *raw_off,
+        const struct fxfer_delta_sig *sigs, uint32_t sig_num, uint32_t block_size,
+        uint8_t *out, uint32_t out_size) {
+    uint64_t pos = *raw_off;
+    uint64_t lit_start = pos;
+    uint64_t copy_off = 0;
+    uint32_t copy_len = 0;
+    uint32_t out_len = 0;
+    uint32_t weak = 0;
+    bool weak_valid = false;
+
+    while (pos < data_len) {
+        uint32_t lit_len = (uint32_t)(pos - lit_start);
+        uint32_t copy_op_len = copy_len > 0 ? FXFER_DELTA_COPY_LEN : 0;
+        uint32_t lit_op_len = lit_len > 0 ? FXFER_DELTA_LITERAL_HDR_LEN + lit_len : 0;
+
+        /* Look for the block at this offset */
+        if (sig_num > 0 && data_len - pos >= block_size) {
+            if (weak_valid != true) {
+                weak = delta_weak_update(0, &data[pos], block_size);
+                weak_valid = true;
+            }
+            const struct fxfer_delta_sig *sig = delta_find_block(sigs, sig_num, weak,
+                    &data[pos], block_size);
+            uint64_t block_off = sig != NULL ? (uint64_t)sig->block * block_size : 0;
+            if (sig != NULL && lit_len == 0 && copy_len > 0 && copy_off + copy_len == block_off
+                    && copy_len <= UINT32_MAX - block_size) {
+                /* The next block of receiver's data, extend COPY */
+                copy_len += block_size;
+                pos += block_size;
+                lit_start = pos;
+                weak_valid = false;
+                continue;
+            }
+            if (sig != NULL && out_len + copy_op_len + lit_op_len + FXFER_DELTA_COPY_LEN <= out_size) {
+                delta_put_copy(out, &out_len, copy_off, copy_len);
+                delta_put_literal(out, &out_len, &data[lit_start], lit_len);
+                copy_off = block_off;
+                copy_len = block_size;
+                pos += block_size;
+                lit_start = pos;
+                weak_valid = false;
+                continue;
+            }
+            if (sig != NULL) {
+                break;
+            }
+        }
+
+        /* Data isn't found, it's sent as literal */
+        if (lit_len == DELTA_LITERAL_MAX
+                || out_len + copy_op_len + FXFER_DELTA_LITERAL_HDR_LEN + lit_len + 1 > out_size) {
+            break;
+        }
+        if (weak_valid == true && data_len - pos > block_size) {
+            weak = delta_weak_roll(weak, data[pos], data[pos + block_size], block_size);
+        } else {
+            weak_valid = false;
+        }
+        pos++;
+    }
+
+    delta_put_copy(out, &out_len, copy_off, copy_len);
+    delta_put_literal(out, &out_len, &data[lit_start], (uint32_t)(pos - lit_start));
+    *raw_off = pos;
+    return out_len;
+}
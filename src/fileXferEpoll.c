@@ -0,0 +1,403 @@
+#define _GNU_SOURCE
+#include "fileXferConf.h"
+
+#if FXFER_EPOLL_REACTOR
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include "fileXferEpoll.h"
+
+/* Pieces of one writev(): pending output and the packet pieces after it */
+#define EPOLL_IOV_MAX                   8
+
+/* Reads of one link per wakeup, level-triggered epoll returns to the link
+ * which has more data after the other ones are handled */
+#define EPOLL_READS_MAX                 16
+
+#define EPOLL_EVENTS_MAX                32
+
+static struct fxfer_epoll_link *epoll_link(void *user_data) {
+    return (struct fxfer_epoll_link *)user_data;
+}
+
+static void epoll_link_closed(struct fxfer_epoll_link *link, const char *reason) {
+    if (link->closed_flag != true) {
+        log_error("Link fd %d is closed: %s\n", link->fd, reason);
+    }
+    link->closed_flag = true;
+    link->out_pos = 0;
+    link->out_fill = 0;
+}
+
+/* Output event is watched only while the fd doesn't take pending data */
+static void epoll_out_wait(struct fxfer_epoll_link *link, bool wait_flag) {
+    if (link->out_wait_flag == wait_flag || link->reactor == NULL) {
+        return;
+    }
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | (wait_flag == true ? EPOLLOUT : 0),
+            .data.ptr = link };
+    epoll_ctl(link->reactor->epoll_fd, EPOLL_CTL_MOD, link->fd, &ev);
+    link->out_wait_flag = wait_flag;
+}
+
+static void epoll_out_compact(struct fxfer_epoll_link *link) {
+    if (link->out_pos > 0) {
+        memmove(link->out_buf, &link->out_buf[link->out_pos], link->out_fill - link->out_pos);
+        link->out_fill -= link->out_pos;
+        link->out_pos = 0;
+    }
+}
+
+/* Writes pending output and packet pieces after it by writev(), the rest that fd
+ * doesn't take is kept in output buffer till it's writable. Packet that may not fit
+ * behind pending output is dropped as on congested link, it's sent again on timeout,
+ * so the reactor isn't blocked by one slow peer. Only packet bigger than the whole
+ * buffer is written by waiting for the fd */
+static void epoll_write(struct fxfer_epoll_link *link, const struct fxfer_iovec *iov, uint8_t iov_cnt) {
+    uint8_t piece = 0;
+    uint32_t piece_off = 0;
+    uint32_t len = 0;
+    for (uint8_t i = 0; i < iov_cnt; i++) {
+        len += iov[i].len;
+    }
+    if (len > 0 && link->out_fill > link->out_pos) {
+        epoll_out_compact(link);
+        if (len > link->out_size - link->out_fill && len <= link->out_size) {
+            log_debug("Packet of %u bytes is dropped, output of fd %d is full\n", len, link->fd);
+            link->out_drops++;
+            return;
+        }
+    }
+    while (link->closed_flag != true) {
+        struct iovec v[EPOLL_IOV_MAX];
+        int cnt = 0;
+        uint32_t rest = 0;
+        if (link->out_fill > link->out_pos) {
+            v[cnt].iov_base = &link->out_buf[link->out_pos];
+            v[cnt].iov_len = link->out_fill - link->out_pos;
+            cnt++;
+        }
+        for (uint8_t i = piece; i < iov_cnt; i++) {
+            uint32_t off = i == piece ? piece_off : 0;
+            if (cnt < EPOLL_IOV_MAX && iov[i].len > off) {
+                v[cnt].iov_base = (void *)&iov[i].data[off];
+                v[cnt].iov_len = iov[i].len - off;
+                cnt++;
+            }
+            rest += iov[i].len - off;
+        }
+        if (cnt == 0) {
+            link->out_pos = 0;
+            link->out_fill = 0;
+            epoll_out_wait(link, false);
+            return;
+        }
+
+        ssize_t len = writev(link->fd, v, cnt);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            /* The rest of packet is kept, or the fd is waited for if it doesn't fit */
+            epoll_out_compact(link);
+            if (rest <= link->out_size - link->out_fill) {
+                for (; piece < iov_cnt; piece++, piece_off = 0) {
+                    memcpy(&link->out_buf[link->out_fill], &iov[piece].data[piece_off],
+                            iov[piece].len - piece_off);
+                    link->out_fill += iov[piece].len - piece_off;
+                }
+                epoll_out_wait(link, true);
+                return;
+            }
+            struct pollfd pfd = { .fd = link->fd, .events = POLLOUT };
+            poll(&pfd, 1, -1);
+            continue;
+        }
+        if (len < 0) {
+            epoll_link_closed(link, strerror(errno));
+            return;
+        }
+
+        /* Written data is skipped: pending output first, then packet pieces */
+        uint32_t done = (uint32_t)len;
+        uint32_t pending = link->out_fill - link->out_pos;
+        uint32_t skip = done < pending ? done : pending;
+        link->out_pos += skip;
+        done -= skip;
+        while (done > 0 && piece < iov_cnt) {
+            uint32_t piece_rest = iov[piece].len - piece_off;
+            if (done < piece_rest) {
+                piece_off += done;
+                done = 0;
+            } else {
+                done -= piece_rest;
+                piece++;
+                piece_off = 0;
+            }
+        }
+    }
+}
+
+/* Packets formed while the link is handled by reactor are copied to output buffer
+ * and written together when parser is done, the other ones are written at once */
+static void epoll_sendv(void *user_data, const struct fxfer_iovec *iov, uint8_t iov_cnt) {
+    struct fxfer_epoll_link *link = epoll_link(user_data);
+    uint32_t len = 0;
+    for (uint8_t i = 0; i < iov_cnt; i++) {
+        len += iov[i].len;
+    }
+    pthread_mutex_lock(&link->mtx);
+    if (link->batch_flag == true && link->out_wait_flag != true
+            && len <= link->out_size - link->out_fill) {
+        for (uint8_t i = 0; i < iov_cnt; i++) {
+            memcpy(&link->out_buf[link->out_fill], iov[i].data, iov[i].len);
+            link->out_fill += iov[i].len;
+        }
+    } else {
+        epoll_write(link, iov, iov_cnt);
+    }
+    pthread_mutex_unlock(&link->mtx);
+}
+
+static void epoll_send(void *user_data, uint8_t* data, uint32_t len) {
+    struct fxfer_iovec iov = { data, len };
+    epoll_sendv(user_data, &iov, 1);
+}
+
+static uint32_t epoll_read_some(void *user_data, uint8_t* data, uint32_t len) {
+    struct fxfer_epoll_link *link = epoll_link(user_data);
+    while (link->closed_flag != true) {
+        ssize_t res = read(link->fd, data, len);
+        if (res > 0) {
+            link->rx_flag = true;
+            return (uint32_t)res;
+        }
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+        if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        epoll_link_closed(link, res == 0 ? "end of stream" : strerror(errno));
+    }
+    return 0;
+}
+
+static void epoll_sleep(void *user_data, uint32_t ms) {
+    struct timespec ts = { ms / 1000, (long)(ms % 1000) * 1000000 };
+    while (clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, &ts) == EINTR) {
+    }
+}
+
+static uint32_t epoll_get_tick(void *user_data) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)((uint64_t)ts.tv_sec * FXFER_TICKS_PER_SEC
+            + (uint64_t)ts.tv_nsec / (1000000000 / FXFER_TICKS_PER_SEC));
+}
+
+static void epoll_lock(void *user_data) {
+    pthread_mutex_lock(&epoll_link(user_data)->mtx);
+}
+
+static void epoll_unlock(void *user_data) {
+    pthread_mutex_unlock(&epoll_link(user_data)->mtx);
+}
+
+void fxfer_epoll_platform(struct fxfer_platform *platform) {
+    platform->send = epoll_send;
+    platform->sendv = epoll_sendv;
+    platform->read = NULL;
+    platform->read_some = epoll_read_some;
+    platform->sleep = epoll_sleep;
+    platform->get_tick = epoll_get_tick;
+    platform->lock = epoll_lock;
+    platform->unlock = epoll_unlock;
+}
+
+bool fxfer_epoll_init(struct fxfer_epoll *reactor) {
+    memset(reactor, 0, sizeof(struct fxfer_epoll));
+    reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    reactor->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    reactor->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct itimerspec period = {
+        { FXFER_EPOLL_POLL_MS / 1000, (long)(FXFER_EPOLL_POLL_MS % 1000) * 1000000 },
+        { FXFER_EPOLL_POLL_MS / 1000, (long)(FXFER_EPOLL_POLL_MS % 1000) * 1000000 }
+    };
+    struct epoll_event timer_ev = { .events = EPOLLIN, .data.ptr = &reactor->timer_fd };
+    struct epoll_event wake_ev = { .events = EPOLLIN, .data.ptr = &reactor->event_fd };
+    if (reactor->epoll_fd < 0 || reactor->timer_fd < 0 || reactor->event_fd < 0
+            || timerfd_settime(reactor->timer_fd, 0, &period, NULL) != 0
+            || epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->timer_fd, &timer_ev) != 0
+            || epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->event_fd, &wake_ev) != 0) {
+        log_error("Reactor can't be created: %s\n", strerror(errno));
+        fxfer_epoll_close(reactor);
+        return false;
+    }
+    return true;
+}
+
+void fxfer_epoll_close(struct fxfer_epoll *reactor) {
+    while (reactor->link_num > 0) {
+        fxfer_epoll_remove(reactor, reactor->links[0]);
+    }
+    int *fds[3] = { &reactor->epoll_fd, &reactor->timer_fd, &reactor->event_fd };
+    for (uint8_t i = 0; i < 3; i++) {
+        if (*fds[i] >= 0) {
+            close(*fds[i]);
+        }
+        *fds[i] = -1;
+    }
+}
+
+/* Link is initialized before fxfer_init() of its session, fd is made non-blocking.
+ * Output buffer should fit the packets in flight: FXFER_MAX_SEGS_IN_FLIGHT + 1 packets
+ * of the negotiated window, otherwise the reactor may wait for the fd */
+bool fxfer_epoll_link_init(struct fxfer_epoll_link *link, int fd, uint8_t *out_buf, uint32_t out_size) {
+    memset(link, 0, sizeof(struct fxfer_epoll_link));
+    link->fd = fd;
+    link->out_buf = out_buf;
+    link->out_size = out_buf != NULL ? out_size : 0;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&link->mtx, &attr);
+    pthread_mutexattr_destroy(&attr);
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) {
+        log_error("fd %d can't be made non-blocking: %s\n", fd, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool fxfer_epoll_add(struct fxfer_epoll *reactor, struct fxfer_epoll_link *link, struct fxfer_ctx *ctx) {
+    if (reactor->link_num == FXFER_EPOLL_LINKS_MAX) {
+        log_error("Reactor has no free links\n");
+        return false;
+    }
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = link };
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, link->fd, &ev) != 0) {
+        log_error("fd %d can't be added: %s\n", link->fd, strerror(errno));
+        return false;
+    }
+    link->ctx = ctx;
+    link->reactor = reactor;
+    link->out_wait_flag = false;
+    reactor->links[reactor->link_num++] = link;
+    return true;
+}
+
+/* Link is removed from reactor, its fd is closed by application */
+void fxfer_epoll_remove(struct fxfer_epoll *reactor, struct fxfer_epoll_link *link) {
+    for (uint16_t i = 0; i < reactor->link_num; i++) {
+        if (reactor->links[i] == link) {
+            epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, link->fd, NULL);
+            reactor->links[i] = reactor->links[--reactor->link_num];
+            link->reactor = NULL;
+            return;
+        }
+    }
+}
+
+/* Received data is parsed until fd has no more or read budget is spent,
+ * packets formed meanwhile (ACKs, next segments) are written by one writev() */
+static void epoll_link_input(struct fxfer_epoll_link *link) {
+    pthread_mutex_lock(&link->mtx);
+    link->batch_flag = true;
+    for (uint8_t i = 0; i < EPOLL_READS_MAX && link->closed_flag != true; i++) {
+        link->rx_flag = false;
+        fxfer_parser(link->ctx);
+        if (link->rx_flag != true) {
+            break;
+        }
+    }
+    link->batch_flag = false;
+    if (link->out_wait_flag != true) {
+        epoll_write(link, NULL, 0);
+    }
+    pthread_mutex_unlock(&link->mtx);
+}
+
+static void epoll_link_output(struct fxfer_epoll_link *link) {
+    pthread_mutex_lock(&link->mtx);
+    epoll_write(link, NULL, 0);
+    pthread_mutex_unlock(&link->mtx);
+}
+
+/* Timeouts, transfer queue and rate limiter of all the links are served by the timer */
+static void epoll_timer(struct fxfer_epoll *reactor) {
+    uint64_t expired;
+    if (read(reactor->timer_fd, &expired, sizeof(expired)) != sizeof(expired)) {
+        return;
+    }
+    for (uint16_t i = 0; i < reactor->link_num; i++) {
+        struct fxfer_epoll_link *link = reactor->links[i];
+        pthread_mutex_lock(&link->mtx);
+        link->batch_flag = true;
+        fxfer_poll(link->ctx);
+        link->batch_flag = false;
+        if (link->out_wait_flag != true) {
+            epoll_write(link, NULL, 0);
+        }
+        pthread_mutex_unlock(&link->mtx);
+    }
+}
+
+/* Waits for events up to timeout_ms (-1 is infinite) and handles them,
+ * returns number of events or -1 on error */
+int fxfer_epoll_run_once(struct fxfer_epoll *reactor, int timeout_ms) {
+    struct epoll_event events[EPOLL_EVENTS_MAX];
+    int num = epoll_wait(reactor->epoll_fd, events, EPOLL_EVENTS_MAX, timeout_ms);
+    if (num < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    for (int i = 0; i < num; i++) {
+        if (events[i].data.ptr == &reactor->timer_fd) {
+            epoll_timer(reactor);
+            continue;
+        }
+        if (events[i].data.ptr == &reactor->event_fd) {
+            uint64_t cnt;
+            ssize_t res = read(reactor->event_fd, &cnt, sizeof(cnt));
+            (void)res;
+            continue;
+        }
+        struct fxfer_epoll_link *link = events[i].data.ptr;
+        if (link->reactor != reactor) {
+            continue;
+        }
+        if ((events[i].events & EPOLLOUT) != 0) {
+            epoll_link_output(link);
+        }
+        if ((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0) {
+            epoll_link_input(link);
+        }
+        if (link->closed_flag == true) {
+            fxfer_epoll_remove(reactor, link);
+        }
+    }
+    return num;
+}
+
+void fxfer_epoll_run(struct fxfer_epoll *reactor) {
+    while (reactor->stop_flag != true && fxfer_epoll_run_once(reactor, -1) >= 0) {
+    }
+}
+
+/* May be called from any thread, e.g. signal handler or the other thread */
+void fxfer_epoll_stop(struct fxfer_epoll *reactor) {
+    uint64_t cnt = 1;
+    reactor->stop_flag = true;
+    ssize_t res = write(reactor->event_fd, &cnt, sizeof(cnt));
+    (void)res;
+}
+
+#endif /* FXFER_EPOLL_REACTOR */
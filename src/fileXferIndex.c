@@ -0,0 +1,172 @@
+#include <string.h>
+#include "fileXferIndex.h"
+#include "fileXferUtils.h"
+
+/* Saved index is MAGIC (uint32_t), COUNT (uint16_t) and COUNT entries of
+ * { NAME_LEN (uint8_t), NAME, SIZE (uint64_t), STAMP (uint64_t), HASH (uint32_t) },
+ * followed by crc32 of all of them. Entries are saved from the most recently used,
+ * so the ones that don't fit smaller index are dropped on load */
+
+#define INDEX_MAGIC                     0x49485846
+#define INDEX_HDR_LEN                   6
+#define INDEX_ENTRY_LEN                 21
+#define INDEX_CRC_LEN                   4
+
+/* Length of name, FXFER_FILE_NAME_LEN_MAX + 1 if it's too long to be indexed */
+static uint32_t index_name_len(const char *name) {
+    uint32_t len = 0;
+    while (len <= FXFER_FILE_NAME_LEN_MAX && name[len] != '\0') {
+        len++;
+    }
+    return len;
+}
+
+static struct fxfer_hash_entry *index_lookup(struct fxfer_hash_index *index, const char *name) {
+    for (uint16_t i = 0; i < index->entry_num; i++) {
+        struct fxfer_hash_entry *entry = &index->entries[i];
+        if (entry->use_seq != 0 && strcmp(entry->name, name) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+void hash_index_init(struct fxfer_hash_index *index, struct fxfer_hash_entry *entries, uint16_t entry_num) {
+    index->entries = entries;
+    index->entry_num = entries != NULL ? entry_num : 0;
+    index->use_seq = 0;
+    if (index->entry_num > 0) {
+        memset(entries, 0, sizeof(struct fxfer_hash_entry) * entry_num);
+    }
+}
+
+bool hash_index_find(struct fxfer_hash_index *index, const char *name, uint64_t size, uint64_t stamp,
+        uint32_t *hash) {
+    if (index_name_len(name) > FXFER_FILE_NAME_LEN_MAX) {
+        return false;
+    }
+    struct fxfer_hash_entry *entry = index_lookup(index, name);
+    if (entry == NULL || entry->size != size || entry->stamp != stamp) {
+        return false;
+    }
+    entry->use_seq = ++index->use_seq;
+    *hash = entry->hash;
+    return true;
+}
+
+void hash_index_store(struct fxfer_hash_index *index, const char *name, uint64_t size, uint64_t stamp,
+        uint32_t hash) {
+    uint32_t name_len = index_name_len(name);
+    if (index->entry_num == 0 || name_len > FXFER_FILE_NAME_LEN_MAX) {
+        return;
+    }
+
+    /* The entry of this file is updated, otherwise a free or the least recently used one is taken */
+    struct fxfer_hash_entry *entry = index_lookup(index, name);
+    for (uint16_t i = 0; i < index->entry_num && entry == NULL; i++) {
+        if (index->entries[i].use_seq == 0) {
+            entry = &index->entries[i];
+        }
+    }
+    if (entry == NULL) {
+        entry = &index->entries[0];
+        for (uint16_t i = 1; i < index->entry_num; i++) {
+            if (index->entries[i].use_seq < entry->use_seq) {
+                entry = &index->entries[i];
+            }
+        }
+    }
+    memcpy(entry->name, name, name_len);
+    entry->name[name_len] = '\0';
+    entry->size = size;
+    entry->stamp = stamp;
+    entry->hash = hash;
+    entry->use_seq = ++index->use_seq;
+}
+
+void hash_index_drop(struct fxfer_hash_index *index, const char *name) {
+    struct fxfer_hash_entry *entry = index_name_len(name) <= FXFER_FILE_NAME_LEN_MAX
+            ? index_lookup(index, name) : NULL;
+    if (entry != NULL) {
+        entry->use_seq = 0;
+    }
+}
+
+uint32_t hash_index_save(const struct fxfer_hash_index *index, uint8_t *buf, uint32_t buf_size) {
+    if (buf_size < INDEX_HDR_LEN + INDEX_CRC_LEN) {
+        return 0;
+    }
+    uint32_t len = INDEX_HDR_LEN;
+    uint16_t count = 0;
+    uint32_t last_seq = UINT32_MAX;
+
+    /* Entries are taken from the most recently used one */
+    while (1) {
+        const struct fxfer_hash_entry *entry = NULL;
+        for (uint16_t i = 0; i < index->entry_num; i++) {
+            const struct fxfer_hash_entry *cur = &index->entries[i];
+            if (cur->use_seq != 0 && cur->use_seq < last_seq
+                    && (entry == NULL || cur->use_seq > entry->use_seq)) {
+                entry = cur;
+            }
+        }
+        if (entry == NULL) {
+            break;
+        }
+        uint32_t name_len = index_name_len(entry->name);
+        if (len + INDEX_ENTRY_LEN + name_len + INDEX_CRC_LEN > buf_size) {
+            return 0;
+        }
+        buf[len] = (uint8_t)name_len;
+        memcpy(&buf[len + 1], entry->name, name_len);
+        len += 1 + name_len;
+        write_uint64_le(entry->size, &buf[len]);
+        write_uint64_le(entry->stamp, &buf[len + sizeof(uint64_t)]);
+        write_uint32_le(entry->hash, &buf[len + 2 * sizeof(uint64_t)]);
+        len += INDEX_ENTRY_LEN - 1;
+        last_seq = entry->use_seq;
+        count++;
+    }
+    write_uint32_le(INDEX_MAGIC, &buf[0]);
+    write_uint16_le(count, &buf[sizeof(uint32_t)]);
+    write_uint32_le(crc32_compute_buf(0, buf, len), &buf[len]);
+    return len + INDEX_CRC_LEN;
+}
+
+bool hash_index_load(struct fxfer_hash_index *index, const uint8_t *buf, uint32_t len) {
+    if (len < INDEX_HDR_LEN + INDEX_CRC_LEN || get_uint32_by_ptr((void *)buf) != INDEX_MAGIC
+            || crc32_compute_buf(0, buf, len - INDEX_CRC_LEN)
+            != get_uint32_by_ptr((void *)&buf[len - INDEX_CRC_LEN])) {
+        return false;
+    }
+
+    /* Check all the entries before the index is changed */
+    uint16_t count = get_uint16_by_ptr((void *)&buf[sizeof(uint32_t)]);
+    uint32_t pos = INDEX_HDR_LEN;
+    for (uint16_t i = 0; i < count; i++) {
+        if (pos >= len - INDEX_CRC_LEN || buf[pos] == 0 || buf[pos] > FXFER_FILE_NAME_LEN_MAX
+                || pos + INDEX_ENTRY_LEN + buf[pos] > len - INDEX_CRC_LEN) {
+            return false;
+        }
+        pos += INDEX_ENTRY_LEN + buf[pos];
+    }
+
+    /* The most recently used entries that fit the index are loaded, their order is kept */
+    hash_index_init(index, index->entries, index->entry_num);
+    uint16_t load_num = count < index->entry_num ? count : index->entry_num;
+    pos = INDEX_HDR_LEN;
+    for (uint16_t i = 0; i < load_num; i++) {
+        struct fxfer_hash_entry *entry = &index->entries[i];
+        uint8_t name_len = buf[pos];
+        const uint8_t *fields = &buf[pos + 1 + name_len];
+        memcpy(entry->name, &buf[pos + 1], name_len);
+        entry->name[name_len] = '\0';
+        entry->size = get_uint64_by_ptr((void *)fields);
+        entry->stamp = get_uint64_by_ptr((void *)&fields[sizeof(uint64_t)]);
+        entry->hash = get_uint32_by_ptr((void *)&fields[2 * sizeof(uint64_t)]);
+        entry->use_seq = load_num - i;
+        pos += INDEX_ENTRY_LEN + name_len;
+    }
+    index->use_seq = load_num;
+    return true;
+}
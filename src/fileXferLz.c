@@ -0,0 +1,182 @@
+#include <string.h>
+#include <stdbool.h>
+#include "fileXferConf.h"
+#include "fileXferUtils.h"
+
+/* LZ77 block codec for FILE_DATA segments. Block is a sequence of
+ * { TOKEN, [LIT_LEN...], LITERALS, OFFSET, [MATCH_LEN...] }, the last one
+ * has no OFFSET and match. TOKEN high nibble is literals length, low nibble
+ * is match length - LZ_MATCH_MIN, value 15 is continued by bytes added to it
+ * until the byte that is less than 255. OFFSET is uint16_t (little endian).
+ * Compressor keeps only hash table of FXFER_LZ_HASH_BITS on stack, decompressor
+ * needs no memory except output buffer. */
+
+#define LZ_MATCH_MIN                    4
+#define LZ_OFFSET_MAX                   0xFFFF
+#define LZ_NIBBLE_MAX                   15
+#define LZ_HASH_SIZE                    (1U << FXFER_LZ_HASH_BITS)
+
+static uint32_t lz_read32(const uint8_t *ptr) {
+    return (uint32_t)ptr[0] | ((uint32_t)ptr[1] << 8)
+            | ((uint32_t)ptr[2] << 16) | ((uint32_t)ptr[3] << 24);
+}
+
+static uint16_t lz_hash(uint32_t val) {
+    return (uint16_t)((val * 2654435761U) >> (32 - FXFER_LZ_HASH_BITS));
+}
+
+/* Writes length continuation bytes, returns false if there is no place for them */
+static bool lz_put_len(uint8_t **op, const uint8_t *op_end, uint32_t len) {
+    while (len >= 255) {
+        if (*op >= op_end) {
+            return false;
+        }
+        *(*op)++ = 255;
+        len -= 255;
+    }
+    if (*op >= op_end) {
+        return false;
+    }
+    *(*op)++ = (uint8_t)len;
+    return true;
+}
+
+/* Writes one sequence, match_len is 0 for the last one */
+static bool lz_put_seq(uint8_t **op, const uint8_t *op_end, const uint8_t *lit,
+        uint32_t lit_len, uint16_t offset, uint32_t match_len) {
+    uint32_t match_code = match_len > 0 ? match_len - LZ_MATCH_MIN : 0;
+    if (*op >= op_end) {
+        return false;
+    }
+    uint8_t *token = (*op)++;
+    *token = (uint8_t)(((lit_len < LZ_NIBBLE_MAX ? lit_len : LZ_NIBBLE_MAX) << 4)
+            | (match_code < LZ_NIBBLE_MAX ? match_code : LZ_NIBBLE_MAX));
+    if (lit_len >= LZ_NIBBLE_MAX && lz_put_len(op, op_end, lit_len - LZ_NIBBLE_MAX) != true) {
+        return false;
+    }
+    if ((uint32_t)(op_end - *op) < lit_len) {
+        return false;
+    }
+    memcpy(*op, lit, lit_len);
+    *op += lit_len;
+    if (match_len == 0) {
+        return true;
+    }
+
+    if (op_end - *op < (long)sizeof(uint16_t)) {
+        return false;
+    }
+    write_uint16_le(offset, *op);
+    *op += sizeof(uint16_t);
+    if (match_code >= LZ_NIBBLE_MAX && lz_put_len(op, op_end, match_code - LZ_NIBBLE_MAX) != true) {
+        return false;
+    }
+    return true;
+}
+
+uint32_t lz_compress_buf(const uint8_t *src, uint32_t src_len, uint8_t *dst, uint32_t dst_size) {
+    uint16_t table[LZ_HASH_SIZE];
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    const uint8_t *ip_end = src + src_len;
+    uint8_t *op = dst;
+    const uint8_t *op_end = dst + dst_size;
+
+    /* Positions are stored + 1, so 0 is empty entry. Offsets are limited
+     * by uint16_t, so only the blocks up to 64 KB are compressed */
+    if (src_len >= LZ_OFFSET_MAX) {
+        return 0;
+    }
+    memset(table, 0, sizeof(table));
+
+    while (ip + LZ_MATCH_MIN <= ip_end) {
+        uint32_t seq = lz_read32(ip);
+        uint16_t hash = lz_hash(seq);
+        uint16_t ref_pos = table[hash];
+        table[hash] = (uint16_t)(ip - src + 1);
+
+        if (ref_pos == 0 || lz_read32(&src[ref_pos - 1]) != seq) {
+            ip++;
+            continue;
+        }
+
+        /* Match is found, extend it */
+        const uint8_t *ref = &src[ref_pos - 1];
+        uint32_t match_len = LZ_MATCH_MIN;
+        while (ip + match_len < ip_end && ref[match_len] == ip[match_len]) {
+            match_len++;
+        }
+        if (lz_put_seq(&op, op_end, anchor, (uint32_t)(ip - anchor),
+                (uint16_t)(ip - ref), match_len) != true) {
+            return 0;
+        }
+        ip += match_len;
+        anchor = ip;
+    }
+
+    /* The rest part is literals */
+    if (lz_put_seq(&op, op_end, anchor, (uint32_t)(ip_end - anchor), 0, 0) != true) {
+        return 0;
+    }
+    return (uint32_t)(op - dst);
+}
+
+/* Reads length continuation bytes, returns false if block is broken */
+static bool lz_get_len(const uint8_t **ip, const uint8_t *ip_end, uint32_t *len) {
+    uint8_t byte;
+    do {
+        if (*ip >= ip_end) {
+            return false;
+        }
+        byte = *(*ip)++;
+        *len += byte;
+    } while (byte == 255);
+    return true;
+}
+
+uint32_t lz_decompress_buf(const uint8_t *src, uint32_t src_len, uint8_t *dst, uint32_t dst_size) {
+    const uint8_t *ip = src;
+    const uint8_t *ip_end = src + src_len;
+    uint8_t *op = dst;
+    uint8_t *op_end = dst + dst_size;
+
+    while (ip < ip_end) {
+        uint8_t token = *ip++;
+
+        /* Literals */
+        uint32_t lit_len = token >> 4;
+        if (lit_len == LZ_NIBBLE_MAX && lz_get_len(&ip, ip_end, &lit_len) != true) {
+            return 0;
+        }
+        if ((uint32_t)(ip_end - ip) < lit_len || (uint32_t)(op_end - op) < lit_len) {
+            return 0;
+        }
+        memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+        if (ip == ip_end) {
+            break;
+        }
+
+        /* Match, it may overlap the output, so it's copied by bytes */
+        if (ip_end - ip < (long)sizeof(uint16_t)) {
+            return 0;
+        }
+        uint16_t offset = get_uint16_by_ptr((void *)ip);
+        ip += sizeof(uint16_t);
+        uint32_t match_len = token & LZ_NIBBLE_MAX;
+        if (match_len == LZ_NIBBLE_MAX && lz_get_len(&ip, ip_end, &match_len) != true) {
+            return 0;
+        }
+        match_len += LZ_MATCH_MIN;
+        if (offset == 0 || offset > op - dst || (uint32_t)(op_end - op) < match_len) {
+            return 0;
+        }
+        const uint8_t *ref = op - offset;
+        for (uint32_t i = 0; i < match_len; i++) {
+            op[i] = ref[i];
+        }
+        op += match_len;
+    }
+    return (uint32_t)(op - dst);
+}
@@ -0,0 +1,466 @@
+#define _GNU_SOURCE
+#include "fileXferConf.h"
+
+#if FXFER_POSIX_FS
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "fileXferPosix.h"
+#include "fileXferUtils.h"
+#include "fileXferPlatform.h"
+
+/* Received file is written to DIR/NAME.part and renamed to DIR/NAME when its last part
+ * is written, so the old version stays readable (e.g. as delta basis) until then and
+ * the interrupted part is kept for resume */
+#define POSIX_PART_SUFFIX               ".part"
+
+static struct fxfer_posix_fs *posix_fs(void *user_data) {
+    return (struct fxfer_posix_fs *)user_data;
+}
+
+/* File name given by the library may fill the whole name buffer without terminator */
+static uint32_t posix_name_len(const char *name) {
+    uint32_t len = 0;
+    while (len < FXFER_FILE_NAME_LEN_MAX && name[len] != '\0') {
+        len++;
+    }
+    return len;
+}
+
+static bool posix_path(struct fxfer_posix_fs *fs, const char *name, const char *suffix, char *path) {
+    uint32_t name_len = posix_name_len(name);
+    if (name_len == 0 || memchr(name, '/', name_len) != NULL
+            || (name_len <= 2 && memcmp(name, "..", name_len) == 0)) {
+        log_error("Wrong file name\n");
+        return false;
+    }
+    int len = snprintf(path, FXFER_POSIX_PATH_MAX, "%s/%.*s%s", fs->dir, (int)name_len, name, suffix);
+    return len > 0 && len < FXFER_POSIX_PATH_MAX;
+}
+
+static bool posix_name_eq(const char *entry_name, const char *name) {
+    uint32_t name_len = posix_name_len(name);
+    return memcmp(entry_name, name, name_len) == 0 && entry_name[name_len] == '\0';
+}
+
+static void posix_name_set(char *entry_name, const char *name) {
+    uint32_t name_len = posix_name_len(name);
+    memcpy(entry_name, name, name_len);
+    entry_name[name_len] = '\0';
+}
+
+static uint64_t posix_stamp(const struct stat *st) {
+    return (uint64_t)st->st_mtim.tv_sec * 1000000000 + (uint64_t)st->st_mtim.tv_nsec;
+}
+
+static void posix_unmap(struct fxfer_posix_map *map) {
+    if (map->data != NULL) {
+        munmap((void *)map->data, map->size);
+    }
+    memset(map, 0, sizeof(struct fxfer_posix_map));
+}
+
+/* Pinned map is only marked stale, it's unmapped when it's unpinned */
+static void posix_map_retire(struct fxfer_posix_map *map) {
+    if (map->pins > 0) {
+        map->stale_flag = true;
+    } else {
+        posix_unmap(map);
+    }
+}
+
+static struct fxfer_posix_map *posix_map_lookup(struct fxfer_posix_fs *fs, const char *name) {
+    for (uint16_t i = 0; i < FXFER_POSIX_MAPS_NUM; i++) {
+        struct fxfer_posix_map *map = &fs->maps[i];
+        if (map->use_seq != 0 && map->stale_flag != true && posix_name_eq(map->name, name) == true) {
+            return map;
+        }
+    }
+    return NULL;
+}
+
+/* Gives cached map of the file, it's mapped once in a free or the least recently used
+ * entry that isn't pinned. Kernel reads ahead of sequential access, so segments are
+ * copied from page cache */
+static struct fxfer_posix_map *posix_map_get(struct fxfer_posix_fs *fs, const char *name) {
+    struct fxfer_posix_map *map = posix_map_lookup(fs, name);
+    if (map != NULL) {
+        map->use_seq = ++fs->use_seq;
+        return map;
+    }
+
+    char path[FXFER_POSIX_PATH_MAX];
+    struct stat st;
+    if (posix_path(fs, name, "", path) != true) {
+        return NULL;
+    }
+    map = NULL;
+    for (uint16_t i = 0; i < FXFER_POSIX_MAPS_NUM; i++) {
+        struct fxfer_posix_map *entry = &fs->maps[i];
+        if (entry->pins == 0 && (map == NULL || entry->use_seq < map->use_seq)) {
+            map = entry;
+        }
+    }
+    if (map == NULL) {
+        log_error("Can't map %s: all %u maps are used by sends\n", path, FXFER_POSIX_MAPS_NUM);
+        return NULL;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        log_error("Can't open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    const uint8_t *data = NULL;
+    bool res = fstat(fd, &st) == 0;
+    if (res == true && st.st_size > 0) {
+        void *addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr != MAP_FAILED) {
+            madvise(addr, (size_t)st.st_size, MADV_SEQUENTIAL);
+            data = addr;
+        }
+        res = data != NULL;
+    }
+    close(fd);
+    if (res != true) {
+        log_error("Can't map %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    posix_unmap(map);
+    posix_name_set(map->name, name);
+    map->data = data;
+    map->size = (uint64_t)st.st_size;
+    map->stamp = posix_stamp(&st);
+    map->use_seq = ++fs->use_seq;
+    return map;
+}
+
+static void posix_map_drop(struct fxfer_posix_fs *fs, const char *name) {
+    struct fxfer_posix_map *map = posix_map_lookup(fs, name);
+    if (map != NULL) {
+        posix_map_retire(map);
+    }
+}
+
+/* Send releases the stale map of the file first, it's the older one */
+static void posix_map_unpin(struct fxfer_posix_fs *fs, const char *name) {
+    struct fxfer_posix_map *map = NULL;
+    for (uint16_t i = 0; i < FXFER_POSIX_MAPS_NUM && map == NULL; i++) {
+        struct fxfer_posix_map *entry = &fs->maps[i];
+        if (entry->stale_flag == true && entry->pins > 0 && posix_name_eq(entry->name, name) == true) {
+            map = entry;
+        }
+    }
+    if (map == NULL) {
+        map = posix_map_lookup(fs, name);
+    }
+    if (map == NULL || map->pins == 0) {
+        return;
+    }
+    map->pins--;
+    if (map->pins == 0 && map->stale_flag == true) {
+        posix_unmap(map);
+    }
+}
+
+static struct fxfer_posix_out *posix_out_lookup(struct fxfer_posix_fs *fs, const char *name) {
+    for (uint16_t i = 0; i < FXFER_CHANNELS_NUM; i++) {
+        struct fxfer_posix_out *out = &fs->outs[i];
+        if (out->fd >= 0 && posix_name_eq(out->name, name) == true) {
+            return out;
+        }
+    }
+    return NULL;
+}
+
+static void posix_out_close(struct fxfer_posix_out *out) {
+    if (out->fd >= 0) {
+        close(out->fd);
+    }
+    out->fd = -1;
+    out->users = 0;
+}
+
+/* Gives open temporary file, a free entry is taken or the least recently used one
+ * which receiving isn't in progress is closed. Closed file of the interrupted receiving
+ * is opened again if it's resumed */
+static struct fxfer_posix_out *posix_out_get(struct fxfer_posix_fs *fs, const char *name) {
+    struct fxfer_posix_out *out = posix_out_lookup(fs, name);
+    if (out != NULL) {
+        out->use_seq = ++fs->use_seq;
+        return out;
+    }
+
+    char path[FXFER_POSIX_PATH_MAX];
+    if (posix_path(fs, name, POSIX_PART_SUFFIX, path) != true) {
+        return NULL;
+    }
+    for (uint16_t i = 0; i < FXFER_CHANNELS_NUM; i++) {
+        struct fxfer_posix_out *entry = &fs->outs[i];
+        if (entry->users == 0 && (out == NULL || entry->fd < 0
+                || (out->fd >= 0 && entry->use_seq < out->use_seq))) {
+            out = entry;
+        }
+    }
+    if (out == NULL) {
+        log_error("Can't open %s: all %u files are being received\n", path, FXFER_CHANNELS_NUM);
+        return NULL;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        log_error("Can't open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    posix_out_close(out);
+    posix_name_set(out->name, name);
+    out->fd = fd;
+    out->use_seq = ++fs->use_seq;
+    return out;
+}
+
+static bool posix_file_size(void *user_data, const char *file_name, uint64_t *file_size) {
+    struct fxfer_posix_fs *fs = posix_fs(user_data);
+    char path[FXFER_POSIX_PATH_MAX];
+    struct stat st;
+    if (posix_path(fs, file_name, "", path) != true || stat(path, &st) != 0) {
+        posix_map_drop(fs, file_name);
+        return false;
+    }
+
+    /* Every send asks the size first, so the file that was changed since it was mapped is mapped again */
+    struct fxfer_posix_map *map = posix_map_lookup(fs, file_name);
+    if (map != NULL && (map->size != (uint64_t)st.st_size || map->stamp != posix_stamp(&st))) {
+        posix_map_retire(map);
+    }
+    *file_size = (uint64_t)st.st_size;
+    return true;
+}
+
+static bool posix_file_stamp(void *user_data, const char *file_name, uint64_t *stamp) {
+    char path[FXFER_POSIX_PATH_MAX];
+    struct stat st;
+    if (posix_path(posix_fs(user_data), file_name, "", path) != true || stat(path, &st) != 0) {
+        return false;
+    }
+    *stamp = posix_stamp(&st);
+    return true;
+}
+
+static bool posix_file_map(void *user_data, const char *file_name, uint64_t offset,
+        uint32_t chunc_size, const uint8_t **data_ptr) {
+    struct fxfer_posix_map *map = posix_map_get(posix_fs(user_data), file_name);
+    if (map == NULL || offset > map->size || chunc_size > map->size - offset) {
+        return false;
+    }
+    *data_ptr = &map->data[offset];
+    return true;
+}
+
+static bool posix_file_read(void *user_data, const char *file_name, uint64_t offset,
+        uint32_t chunc_size, uint8_t *out_buf) {
+    const uint8_t *data = NULL;
+    if (posix_file_map(user_data, file_name, offset, chunc_size, &data) != true) {
+        return false;
+    }
+    if (chunc_size > 0) {
+        memcpy(out_buf, data, chunc_size);
+    }
+    return true;
+}
+
+static void posix_file_prefetch(void *user_data, const char *file_name, uint64_t offset, uint32_t len) {
+    struct fxfer_posix_map *map = posix_map_lookup(posix_fs(user_data), file_name);
+    if (map == NULL || map->data == NULL || offset >= map->size) {
+        return;
+    }
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t start = offset - offset % page;
+    uint64_t end = map->size - offset < len ? map->size : offset + len;
+    madvise((void *)&map->data[start], (size_t)(end - start), MADV_WILLNEED);
+}
+
+static bool posix_file_hash(void *user_data, const char *file_name, uint32_t *file_hash) {
+    struct fxfer_posix_map *map = posix_map_get(posix_fs(user_data), file_name);
+    if (map == NULL) {
+        return false;
+    }
+    *file_hash = map->size > 0 ? crc32_compute_buf(0, map->data, map->size) : 0;
+    return true;
+}
+
+/* Temporary file is cut to the part the receiving starts from and its announced size
+ * is reserved, so it's written to contiguous extents without allocation on every write.
+ * Reserved space is kept beyond the file size, that stays the size of written data */
+static bool posix_file_alloc(void *user_data, const char *file_name, uint64_t offset, uint64_t file_size) {
+    struct fxfer_posix_out *out = posix_out_get(posix_fs(user_data), file_name);
+    if (out == NULL) {
+        return false;
+    }
+    if (ftruncate(out->fd, (off_t)offset) != 0) {
+        log_error("Can't truncate %s: %s\n", out->name, strerror(errno));
+        return false;
+    }
+#ifdef FALLOC_FL_KEEP_SIZE
+    if (file_size > offset && fallocate(out->fd, FALLOC_FL_KEEP_SIZE, (off_t)offset,
+            (off_t)(file_size - offset)) != 0 && errno != EOPNOTSUPP) {
+        log_error("Can't allocate %s: %s\n", out->name, strerror(errno));
+        return false;
+    }
+#endif
+    return true;
+}
+
+static bool posix_commit(struct fxfer_posix_fs *fs, struct fxfer_posix_out *out, uint64_t size) {
+    char part_path[FXFER_POSIX_PATH_MAX];
+    char path[FXFER_POSIX_PATH_MAX];
+    bool res = posix_path(fs, out->name, POSIX_PART_SUFFIX, part_path) == true
+            && posix_path(fs, out->name, "", path) == true
+            && ftruncate(out->fd, (off_t)size) == 0 && fdatasync(out->fd) == 0;
+    posix_out_close(out);
+    if (res != true || rename(part_path, path) != 0) {
+        log_error("Can't commit %s: %s\n", out->name, strerror(errno));
+        return false;
+    }
+    posix_map_drop(fs, out->name);
+    return true;
+}
+
+static bool posix_file_append(void *user_data, const char *file_name, uint64_t offset,
+        uint32_t chunc_size, uint8_t *in_buf, bool *eof_flag) {
+    struct fxfer_posix_fs *fs = posix_fs(user_data);
+    struct fxfer_posix_out *out = posix_out_get(fs, file_name);
+    if (out == NULL) {
+        return false;
+    }
+    uint32_t done = 0;
+    while (done < chunc_size) {
+        ssize_t len = pwrite(out->fd, &in_buf[done], chunc_size - done, (off_t)(offset + done));
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            log_error("Can't write %s: %s\n", out->name, strerror(errno));
+            return false;
+        }
+        done += (uint32_t)len;
+    }
+    return *eof_flag == true ? posix_commit(fs, out, offset + chunc_size) : true;
+}
+
+static bool posix_file_sync(void *user_data, const char *file_name) {
+    struct fxfer_posix_out *out = posix_out_lookup(posix_fs(user_data), file_name);
+    return out == NULL || fdatasync(out->fd) == 0;
+}
+
+/* Interrupted part is the size of temporary file, it's hashed by pread as it isn't mapped */
+static bool posix_file_partial(void *user_data, const char *file_name, uint64_t *committed_size,
+        uint32_t *prefix_hash) {
+    char path[FXFER_POSIX_PATH_MAX];
+    uint8_t buf[4096];
+    if (posix_path(posix_fs(user_data), file_name, POSIX_PART_SUFFIX, path) != true) {
+        return false;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    uint64_t size = 0;
+    uint32_t hash = 0;
+    ssize_t len;
+    while ((len = pread(fd, buf, sizeof(buf), (off_t)size)) != 0) {
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len < 0) {
+            close(fd);
+            return false;
+        }
+        hash = crc32_compute_buf(hash, buf, (size_t)len);
+        size += (uint64_t)len;
+    }
+    close(fd);
+    *committed_size = size;
+    *prefix_hash = hash;
+    return true;
+}
+
+/* Map of the file being sent is pinned until the send is done, so the pointers given
+ * for it (e.g. the whole file for delta) stay valid. Temporary file of receiving is
+ * kept open until it's finished */
+static bool posix_file_open(void *user_data, const char *file_name, bool write_flag) {
+    struct fxfer_posix_fs *fs = posix_fs(user_data);
+    if (write_flag == true) {
+        struct fxfer_posix_out *out = posix_out_get(fs, file_name);
+        if (out == NULL) {
+            return false;
+        }
+        out->users++;
+        return true;
+    }
+    struct fxfer_posix_map *map = posix_map_get(fs, file_name);
+    if (map == NULL) {
+        return false;
+    }
+    map->pins++;
+    return true;
+}
+
+static void posix_file_close(void *user_data, const char *file_name, bool write_flag) {
+    struct fxfer_posix_fs *fs = posix_fs(user_data);
+    if (write_flag != true) {
+        posix_map_unpin(fs, file_name);
+        return;
+    }
+    struct fxfer_posix_out *out = posix_out_lookup(fs, file_name);
+    if (out != NULL && out->users > 0) {
+        out->users--;
+        if (out->users == 0) {
+            posix_out_close(out);
+        }
+    }
+}
+
+bool fxfer_posix_fs_init(struct fxfer_posix_fs *fs, const char *dir) {
+    memset(fs, 0, sizeof(struct fxfer_posix_fs));
+    for (uint16_t i = 0; i < FXFER_CHANNELS_NUM; i++) {
+        fs->outs[i].fd = -1;
+    }
+    size_t len = strlen(dir);
+    if (len == 0 || len >= FXFER_POSIX_PATH_MAX) {
+        return false;
+    }
+    memcpy(fs->dir, dir, len + 1);
+    return true;
+}
+
+void fxfer_posix_fs_close(struct fxfer_posix_fs *fs) {
+    for (uint16_t i = 0; i < FXFER_POSIX_MAPS_NUM; i++) {
+        posix_unmap(&fs->maps[i]);
+    }
+    for (uint16_t i = 0; i < FXFER_CHANNELS_NUM; i++) {
+        posix_out_close(&fs->outs[i]);
+    }
+}
+
+void fxfer_posix_fs_callbacks(struct fxfer_callbacks *callbacks) {
+    callbacks->get_file_hash_cb = posix_file_hash;
+    callbacks->get_file_size_cb = posix_file_size;
+    callbacks->file_read_partial_cb = posix_file_read;
+    callbacks->file_append_cb = posix_file_append;
+    callbacks->file_map_partial_cb = posix_file_map;
+    callbacks->file_append_buf_cb = NULL;
+    callbacks->get_file_partial_cb = posix_file_partial;
+    callbacks->get_file_stamp_cb = posix_file_stamp;
+    callbacks->file_sync_cb = posix_file_sync;
+    callbacks->file_prefetch_cb = posix_file_prefetch;
+    callbacks->file_alloc_cb = posix_file_alloc;
+    callbacks->file_open_cb = posix_file_open;
+    callbacks->file_close_cb = posix_file_close;
+}
+
+#endif /* FXFER_POSIX_FS */
@@ -0,0 +1,79 @@
+#include "fileXferConf.h"
+#include "fileXferRate.h"
+
+/* Token bucket is filled by rate bytes per second up to burst bytes. Packet is
+ * allowed while there are tokens, so the bucket may go below zero by one packet,
+ * control packets are never delayed but take tokens of FILE_DATA segments */
+
+void fxfer_rate_limit_set(struct fxfer_rate_limit *lim, uint32_t rate, uint32_t burst) {
+    /* Empty bucket never allows a packet, so zero burst is one tx packet */
+    if (rate > 0 && burst == 0) {
+        burst = FXFER_TX_BUF_SIZE;
+    }
+
+    /* Bucket of disabled limiter is full, so the limit starts with burst */
+    if (lim->rate == 0) {
+        lim->tokens = (int32_t)(burst > INT32_MAX ? INT32_MAX : burst);
+        lim->credit_rem = 0;
+        lim->sync_flag = false;
+    }
+    lim->rate = rate;
+    lim->burst = burst > INT32_MAX ? INT32_MAX : burst;
+    if (lim->tokens > (int32_t)lim->burst) {
+        lim->tokens = (int32_t)lim->burst;
+    }
+}
+
+static void rate_limit_refill(struct fxfer_rate_limit *lim, uint32_t tick) {
+    if (lim->sync_flag != true) {
+        lim->last_tick = tick;
+        lim->sync_flag = true;
+        return;
+    }
+
+    /* Remainder keeps the fraction of byte, so slow rates aren't rounded down */
+    uint64_t credit = (uint64_t)(tick - lim->last_tick) * lim->rate + lim->credit_rem;
+    uint64_t add = credit / FXFER_TICKS_PER_SEC;
+    lim->credit_rem = (uint32_t)(credit % FXFER_TICKS_PER_SEC);
+    lim->last_tick = tick;
+    if ((int64_t)lim->tokens + (int64_t)add >= (int64_t)lim->burst) {
+        lim->tokens = (int32_t)lim->burst;
+        lim->credit_rem = 0;
+    } else {
+        lim->tokens += (int32_t)add;
+    }
+}
+
+bool rate_limit_allow(struct fxfer_rate_limit *lim, uint32_t tick) {
+    if (lim->rate == 0) {
+        return true;
+    }
+    rate_limit_refill(lim, tick);
+    return lim->tokens > 0;
+}
+
+void rate_limit_consume(struct fxfer_rate_limit *lim, uint32_t len, uint32_t tick) {
+    /* Throughput is updated once per second */
+    if (lim->meas_flag != true) {
+        lim->meas_tick = tick;
+        lim->meas_flag = true;
+    }
+    lim->meas_bytes += len;
+    if (tick - lim->meas_tick >= FXFER_TICKS_PER_SEC) {
+        lim->throughput = (uint32_t)((uint64_t)lim->meas_bytes * FXFER_TICKS_PER_SEC
+                / (tick - lim->meas_tick));
+        lim->meas_tick = tick;
+        lim->meas_bytes = 0;
+    }
+
+    if (lim->rate == 0) {
+        return;
+    }
+    rate_limit_refill(lim, tick);
+    lim->tokens -= (int32_t)len;
+}
+
+uint32_t rate_limit_throughput(struct fxfer_rate_limit *lim, uint32_t tick) {
+    rate_limit_consume(lim, 0, tick);
+    return lim->throughput;
+}
@@ -0,0 +1,213 @@
+#include <string.h>
+#include "fileXferTree.h"
+#include "fileXferUtils.h"
+
+/* xxHash64 (XXH64 of xxHash by Yann Collet, the same digests): 32-byte stripes are
+ * mixed into four accumulators, the tail is mixed by 8, 4 and 1 bytes. It runs at
+ * several GB/s without tables, so tree leaves are hashed much faster than by crc32 */
+
+#define XXH_PRIME64_1                   0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2                   0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3                   0x165667B19E3779F9ULL
+#define XXH_PRIME64_4                   0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5                   0x27D4EB2F165667C5ULL
+#define XXH_STRIPE_LEN                  32
+
+static uint64_t xxh_rotl64(uint64_t val, uint8_t bits) {
+    return (val << bits) | (val >> (64 - bits));
+}
+
+static uint64_t xxh_read64(const uint8_t *ptr) {
+    uint64_t val = 0;
+    for (uint8_t i = 8; i > 0; i--) {
+        val = (val << 8) | ptr[i - 1];
+    }
+    return val;
+}
+
+static uint32_t xxh_read32(const uint8_t *ptr) {
+    return (uint32_t)ptr[0] | ((uint32_t)ptr[1] << 8)
+            | ((uint32_t)ptr[2] << 16) | ((uint32_t)ptr[3] << 24);
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    acc = xxh_rotl64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static uint64_t xxh_merge_round(uint64_t acc, uint64_t val) {
+    acc ^= xxh_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static void xxh_stripe(struct fxfer_xxh64 *state, const uint8_t *data) {
+    for (uint8_t i = 0; i < 4; i++) {
+        state->v[i] = xxh_round(state->v[i], xxh_read64(&data[i * sizeof(uint64_t)]));
+    }
+}
+
+void xxh64_init(struct fxfer_xxh64 *state, uint64_t seed) {
+    state->v[0] = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    state->v[1] = seed + XXH_PRIME64_2;
+    state->v[2] = seed;
+    state->v[3] = seed - XXH_PRIME64_1;
+    state->total_len = 0;
+    state->mem_len = 0;
+}
+
+void xxh64_update(struct fxfer_xxh64 *state, const uint8_t *data, uint32_t len) {
+    state->total_len += len;
+    if (state->mem_len + len < XXH_STRIPE_LEN) {
+        memcpy(&state->mem[state->mem_len], data, len);
+        state->mem_len += len;
+        return;
+    }
+
+    /* Complete the stripe kept from the previous data */
+    if (state->mem_len > 0) {
+        uint32_t fill = XXH_STRIPE_LEN - state->mem_len;
+        memcpy(&state->mem[state->mem_len], data, fill);
+        xxh_stripe(state, state->mem);
+        data += fill;
+        len -= fill;
+        state->mem_len = 0;
+    }
+    while (len >= XXH_STRIPE_LEN) {
+        xxh_stripe(state, data);
+        data += XXH_STRIPE_LEN;
+        len -= XXH_STRIPE_LEN;
+    }
+    memcpy(state->mem, data, len);
+    state->mem_len = len;
+}
+
+uint64_t xxh64_digest(const struct fxfer_xxh64 *state) {
+    uint64_t hash;
+    if (state->total_len >= XXH_STRIPE_LEN) {
+        hash = xxh_rotl64(state->v[0], 1) + xxh_rotl64(state->v[1], 7)
+                + xxh_rotl64(state->v[2], 12) + xxh_rotl64(state->v[3], 18);
+        for (uint8_t i = 0; i < 4; i++) {
+            hash = xxh_merge_round(hash, state->v[i]);
+        }
+    } else {
+        /* v[2] is the seed while no stripe is mixed */
+        hash = state->v[2] + XXH_PRIME64_5;
+    }
+    hash += state->total_len;
+
+    /* The tail */
+    const uint8_t *ptr = state->mem;
+    uint32_t len = state->mem_len;
+    for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t), ptr += sizeof(uint64_t)) {
+        hash ^= xxh_round(0, xxh_read64(ptr));
+        hash = xxh_rotl64(hash, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (len >= sizeof(uint32_t)) {
+        hash ^= (uint64_t)xxh_read32(ptr) * XXH_PRIME64_1;
+        hash = xxh_rotl64(hash, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        len -= sizeof(uint32_t);
+        ptr += sizeof(uint32_t);
+    }
+    for (; len > 0; len--, ptr++) {
+        hash ^= *ptr * XXH_PRIME64_5;
+        hash = xxh_rotl64(hash, 11) * XXH_PRIME64_1;
+    }
+
+    /* Avalanche */
+    hash ^= hash >> 33;
+    hash *= XXH_PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= XXH_PRIME64_3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+uint64_t xxh64_compute_buf(const uint8_t *data, uint32_t len, uint64_t seed) {
+    struct fxfer_xxh64 state;
+    xxh64_init(&state, seed);
+    xxh64_update(&state, data, len);
+    return xxh64_digest(&state);
+}
+
+/* Number of nodes of the level, levels above the top one have one node too */
+uint64_t tree_level_nodes(uint64_t file_size, uint32_t block_size, uint8_t level) {
+    uint64_t nodes = file_size / block_size + (file_size % block_size != 0 ? 1 : 0);
+    if (nodes == 0) {
+        nodes = 1;
+    }
+    for (uint8_t i = 0; i < level && nodes > 1; i++) {
+        nodes = (nodes + 1) / 2;
+    }
+    return nodes;
+}
+
+uint8_t tree_top_level(uint64_t file_size, uint32_t block_size) {
+    uint8_t level = 0;
+    while (tree_level_nodes(file_size, block_size, level) > 1) {
+        level++;
+    }
+    return level;
+}
+
+uint64_t tree_parent_hash(uint64_t left, uint64_t right) {
+    uint8_t children[2 * sizeof(uint64_t)];
+    write_uint64_le(left, &children[0]);
+    write_uint64_le(right, &children[sizeof(uint64_t)]);
+    return xxh64_compute_buf(children, sizeof(children), 0);
+}
+
+/* Index of the first node of the level in cache, the number of nodes of the levels below */
+uint64_t tree_level_first(uint64_t file_size, uint32_t block_size, uint8_t level) {
+    uint64_t first = 0;
+    for (uint8_t i = 0; i < level; i++) {
+        first += tree_level_nodes(file_size, block_size, i);
+    }
+    return first;
+}
+
+void tree_cache_init(struct fxfer_tree_cache *cache, uint64_t *hashes, uint32_t hashes_max) {
+    cache->hashes = hashes;
+    cache->hashes_max = hashes != NULL ? hashes_max : 0;
+    cache->node_total = 0;
+}
+
+bool tree_cache_find(const struct fxfer_tree_cache *cache, const char *name, uint64_t file_size,
+        uint64_t stamp, uint32_t block_size) {
+    return cache->node_total != 0 && cache->file_size == file_size && cache->stamp == stamp
+            && cache->block_size == block_size && strcmp(cache->name, name) == 0;
+}
+
+/* Leaves are already put to hashes by caller, the upper levels are made of them.
+ * Returns false if the name is too long or the tree doesn't fit hashes */
+bool tree_cache_store(struct fxfer_tree_cache *cache, const char *name, uint64_t file_size,
+        uint64_t stamp, uint32_t block_size) {
+    uint8_t top = tree_top_level(file_size, block_size);
+    uint32_t name_len = (uint32_t)strlen(name);
+    cache->node_total = 0;
+    if (name_len > FXFER_FILE_NAME_LEN_MAX
+            || tree_level_first(file_size, block_size, top + 1) > cache->hashes_max) {
+        return false;
+    }
+    for (uint8_t level = 1; level <= top; level++) {
+        uint64_t *below = &cache->hashes[tree_level_first(file_size, block_size, level - 1)];
+        uint64_t *nodes = &cache->hashes[tree_level_first(file_size, block_size, level)];
+        uint64_t below_num = tree_level_nodes(file_size, block_size, level - 1);
+        for (uint64_t node = 0; 2 * node < below_num; node++) {
+            nodes[node] = 2 * node + 1 < below_num
+                    ? tree_parent_hash(below[2 * node], below[2 * node + 1]) : below[2 * node];
+        }
+    }
+    memcpy(cache->name, name, name_len + 1);
+    cache->file_size = file_size;
+    cache->stamp = stamp;
+    cache->block_size = block_size;
+    cache->node_total = (uint32_t)tree_level_first(file_size, block_size, top + 1);
+    return true;
+}
+
+void tree_cache_drop(struct fxfer_tree_cache *cache, const char *name) {
+    if (cache->node_total != 0 && strncmp(cache->name, name, FXFER_FILE_NAME_LEN_MAX) == 0) {
+        cache->node_total = 0;
+    }
+}